@@ -13,6 +13,7 @@
 #define _TEST_AGENT_H_
 
 #include <Constants.h>
+#include <Log.h>
 #include <SocketUTransport.h>
 #include <up-client-zenoh-cpp/client/upZenohClient.h>
 #include <up-cpp/uri/serializer/LongUriSerializer.h>
@@ -9,16 +9,32 @@
 //
 // SPDX-License-Identifier: Apache-2.0
 
+#include <Allocations.h>
 #include <TestAgent.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
 
 using namespace google::protobuf;
 using namespace rapidjson;
 using namespace uprotocol::uri;
 using namespace uprotocol::v1;
 
+// Most "received" lines logged a second; the rest are only counted.
+constexpr double kReceiveLogsPerSecond = 10;
+
+// Heap use of a ProtoConverter conversion, when the build counts it (see
+// TEST_AGENT_ALLOCATION_ACCOUNTING).
+static void logAllocations(const char* conversion,
+                           const allocation::Counts& used) {
+	if (allocation::installed()) {
+		UP_LOG_SAMPLED_DEBUG(kReceiveLogsPerSecond,
+		                     "{} took {} allocations of {} bytes", conversion,
+		                     used.allocations, used.bytes);
+	}
+}
+
 TestAgent::TestAgent(const std::string transportType) {
 	// Log the creation of the TestAgent with the specified transport type
-	spdlog::info(
+	UP_LOG_INFO(
 	    "TestAgent::TestAgent(), Creating TestAgent with transport type: {}",
 	    transportType);
 
@@ -27,7 +43,7 @@ TestAgent::TestAgent(const std::string transportType) {
 
 	// If the transport creation failed, log an error and exit
 	if (nullptr == transportPtr_) {
-		spdlog::error("TestAgent::TestAgent(), Failed to create transport");
+		UP_LOG_ERROR("TestAgent::TestAgent(), Failed to create transport");
 		exit(1);
 	}
 
@@ -74,7 +90,8 @@ TestAgent::~TestAgent() {}
 
 UStatus TestAgent::onReceive(
     uprotocol::utransport::UMessage& transportUMessage) const {
-	spdlog::info("TestAgent::onReceive(), received.");
+	UP_LOG_SAMPLED_INFO(kReceiveLogsPerSecond,
+	                    "TestAgent::onReceive(), received.");
 	uprotocol::v1::UPayload payV1;
 
 	// Cast the format from transport to v1
@@ -141,7 +158,7 @@ std::shared_ptr<uprotocol::utransport::UTransport> TestAgent::createTransport(
 	} else {
 		// If the transport type is neither "socket" nor "zenoh", log an error
 		// and return null.
-		spdlog::error("Invalid transport type: {}", transportType);
+		UP_LOG_ERROR("Invalid transport type: {}", transportType);
 		return nullptr;
 	}
 }
@@ -185,11 +202,11 @@ void TestAgent::writeDataToTMSocket(Document& responseDoc,
 	// Get the JSON data as a C++ string.
 	std::string json = buffer.GetString();
 	// Log the sent data.
-	spdlog::info("TestAgent::writeDataToTMSocket(), Sent to TM : {}", json);
+	UP_LOG_DEBUG("TestAgent::writeDataToTMSocket(), Sent to TM : {}", json);
 
 	// Send the JSON data to the TM socket. If there is an error, log it.
 	if (send(clientSocket_, json.c_str(), strlen(json.c_str()), 0) == -1) {
-		spdlog::error(
+		UP_LOG_ERROR(
 		    "TestAgent::writeDataToTMSocket(), Error sending data to TM ");
 	}
 }
@@ -201,10 +218,12 @@ void TestAgent::sendToTestManager(const Message& proto, const string& action,
 	responseDict.SetObject();
 
 	// Convert the proto message to a RapidJSON value.
+	allocation::Scope conversion;
 	Value dataValue = ProtoConverter::convertMessageToJson(proto, responseDict);
+	logAllocations("convertMessageToJson", conversion.taken());
 
 	// Log the converted data value.
-	spdlog::info("TestAgent::sendToTestManager(), dataValue is : {}",
+	UP_LOG_DEBUG("TestAgent::sendToTestManager(), dataValue is : {}",
 	             dataValue.GetString());
 
 	// Create a RapidJSON string value for the data key.
@@ -272,10 +291,12 @@ UStatus TestAgent::handleSendCommand(Document& jsonData) {
 	// Create a v1 UMessage object.
 	UMessage umsg;
 	// Convert the jsonData to a proto message.
+	allocation::Scope conversion;
 	ProtoConverter::dictToProto(jsonData[Constants::DATA], umsg,
 	                            jsonData.GetAllocator());
+	logAllocations("dictToProto", conversion.taken());
 	// Log the UMessage string.
-	spdlog::info("TestAgent::handleSendCommand(), umsg string is: {}",
+	UP_LOG_DEBUG("TestAgent::handleSendCommand(), umsg string is: {}",
 	             umsg.DebugString());
 
 	// Get the payload data from the UMessage.
@@ -283,7 +304,7 @@ UStatus TestAgent::handleSendCommand(Document& jsonData) {
 	// Convert the payload data to a string.
 	std::string payloadString = payloadData.value();
 	// Log the payload string.
-	spdlog::debug(
+	UP_LOG_DEBUG(
 	    "TestAgent::handleSendCommand(), payload in string format is: {}",
 	    payloadString);
 
@@ -347,7 +368,7 @@ void TestAgent::handleInvokeMethodCommand(Document& jsonData) {
 	// Convert the payload data to a string.
 	string str = upPay.value();
 	// Log the payload string.
-	spdlog::debug(
+	UP_LOG_DEBUG(
 	    "TestAgent::handleInvokeMethodCommand(), payload in string format is : "
 	    " {}",
 	    str);
@@ -365,7 +386,7 @@ void TestAgent::handleInvokeMethodCommand(Document& jsonData) {
 	// Convert the data to a proto message.
 	ProtoConverter::dictToProto(data, uri, jsonData.GetAllocator());
 	// Log the UUri string.
-	spdlog::debug(
+	UP_LOG_DEBUG(
 	    "TestAgent::handleInvokeMethodCommand(), UUri in string format is :  "
 	    "{}",
 	    uri.DebugString());
@@ -384,13 +405,13 @@ void TestAgent::handleInvokeMethodCommand(Document& jsonData) {
 
 	try {
 		// Wait for the response.
-		spdlog::debug(
+		UP_LOG_DEBUG(
 		    "handleInvokeMethodCommand(), waiting for payload from "
 		    "responseFuture ");
 		responseFuture.wait();
 
 		// Get the response.
-		spdlog::debug(
+		UP_LOG_DEBUG(
 		    "TestAgent::handleInvokeMethodCommand(), getting payload from "
 		    "responseFuture ");
 		uprotocol::rpc::RpcResponse rpcResponse = responseFuture.get();
@@ -399,7 +420,7 @@ void TestAgent::handleInvokeMethodCommand(Document& jsonData) {
 		uprotocol::utransport::UPayload pay2 = rpcResponse.message.payload();
 
 		// Log the size of the payload.
-		spdlog::debug(
+		UP_LOG_DEBUG(
 		    "TestAgent::handleInvokeMethodCommand(), payload size from "
 		    "responseFuture is : {}",
 		    pay2.size());
@@ -409,7 +430,7 @@ void TestAgent::handleInvokeMethodCommand(Document& jsonData) {
 		    reinterpret_cast<const char*>(pay2.data()), pay2.size());
 
 		// Log the payload string.
-		spdlog::info(
+		UP_LOG_DEBUG(
 		    "TestAgent::handleInvokeMethodCommand(), payload got from "
 		    "responseFuture is : {}",
 		    strPayload);
@@ -431,17 +452,17 @@ void TestAgent::handleInvokeMethodCommand(Document& jsonData) {
 		sendToTestManager(umsg, Constants::INVOKE_METHOD_COMMAND, strTest_id);
 
 	} catch (const std::future_error& e) {
-		spdlog::error(
+		UP_LOG_ERROR(
 		    "TestAgent::handleInvokeMethodCommand(), Future error exception "
 		    "received while getting payload: {}",
 		    e.what());
 	} catch (const std::exception& e) {
-		spdlog::error(
+		UP_LOG_ERROR(
 		    "TestAgent::handleInvokeMethodCommand(), General exception "
 		    "received while getting payload: {}",
 		    e.what());
 	} catch (...) {
-		spdlog::error(
+		UP_LOG_ERROR(
 		    "TestAgent::handleInvokeMethodCommand(), Unknown exception "
 		    "received while getting payload.");
 	}
@@ -514,14 +535,14 @@ void TestAgent::processMessage(Document& json_msg) {
 	std::string strTest_id = json_msg[Constants::TEST_ID].GetString();
 
 	// Log the received action.
-	spdlog::info("TestAgent::processMessage(), Received action : {}", action);
+	UP_LOG_INFO("TestAgent::processMessage(), Received action : {}", action);
 
 	// Find the action in the action handlers map.
 	auto it = actionHandlers_.find(action);
 	if (it != actionHandlers_.end()) {
 		// If the action is found, get the corresponding function.
 		const auto& function = it->second;
-		spdlog::debug(
+		UP_LOG_DEBUG(
 		    "TestAgent::processMessage(), Found respective function and "
 		    "calling the same. ");
 
@@ -533,8 +554,8 @@ void TestAgent::processMessage(Document& json_msg) {
 			    std::get<std::function<UStatus(Document&)>>(function)(json_msg);
 
 			// Log the received result.
-			spdlog::info("TestAgent::processMessage(), received result is : {}",
-			             result.message());
+			UP_LOG_INFO("TestAgent::processMessage(), received result is : {}",
+			            result.message());
 
 			// Create a new JSON document and status object.
 			Document document;
@@ -569,12 +590,12 @@ void TestAgent::processMessage(Document& json_msg) {
 			// If the function does not return a UStatus, call it without
 			// getting a result.
 			std::get<std::function<void(Document&)>>(function)(json_msg);
-			spdlog::warn("TestAgent::processMessage(), Received no result");
+			UP_LOG_WARN("TestAgent::processMessage(), Received no result");
 		}
 	} else {
 		// If the action is not found in the action handlers map, log a warning.
-		spdlog::warn("TestAgent::processMessage(), action '{}' not found.",
-		             action);
+		UP_LOG_WARN("TestAgent::processMessage(), action '{}' not found.",
+		            action);
 	}
 }
 
@@ -592,7 +613,7 @@ void TestAgent::receiveFromTM() {
 			// If no data is received, log a warning, disconnect the socket, and
 			// break the loop
 			if (bytes_received < 1) {
-				spdlog::warn(
+				UP_LOG_WARN(
 				    "TestAgent::receiveFromTM(), no data received, exiting the "
 				    "CPP Test Agent ...");
 				socketDisconnect();
@@ -606,7 +627,7 @@ void TestAgent::receiveFromTM() {
 			std::string json_str(recv_data);
 
 			// Log the received data
-			spdlog::info(
+			UP_LOG_DEBUG(
 			    "TestAgent::receiveFromTM(), Received data from test manager: "
 			    "{}",
 			    json_str);
@@ -618,7 +639,7 @@ void TestAgent::receiveFromTM() {
 			// If there is a parse error, log an error and continue to the next
 			// iteration
 			if (json_msg.HasParseError()) {
-				spdlog::error(
+				UP_LOG_ERROR(
 				    "TestAgent::receiveFromTM(), Failed to parse JSON data: {}",
 				    json_str);
 				continue;
@@ -629,17 +650,17 @@ void TestAgent::receiveFromTM() {
 		}
 	} catch (const std::runtime_error& e) {
 		// If a runtime error occurs, log an error
-		spdlog::error(
+		UP_LOG_ERROR(
 		    "TestAgent::receiveFromTM(), Runtime error occurred due to {}",
 		    e.what());
 	} catch (const std::exception& e) {
 		// If a general exception occurs, log an error
-		spdlog::error(
+		UP_LOG_ERROR(
 		    "TestAgent::receiveFromTM(), Exception occurred due to {}",
 		    e.what());
 	} catch (...) {
 		// If an unknown exception occurs, log an error
-		spdlog::error(
+		UP_LOG_ERROR(
 		    "TestAgent::receiveFromTM(), Unknown exception occurred.");
 	}
 }
@@ -650,7 +671,7 @@ bool TestAgent::socketConnect() {
 
 	// If the socket descriptor is -1, an error occurred
 	if (clientSocket_ == -1) {
-		spdlog::error("TestAgent::socketConnect(), Error creating socket");
+		UP_LOG_ERROR("TestAgent::socketConnect(), Error creating socket");
 		return false;
 	}
 
@@ -665,7 +686,7 @@ bool TestAgent::socketConnect() {
 	// Attempt to connect to the server
 	if (connect(clientSocket_, (struct sockaddr*)&mServerAddress_,
 	            sizeof(mServerAddress_)) == -1) {
-		spdlog::error("TestAgent::socketConnect(), Error connecting to server");
+		UP_LOG_ERROR("TestAgent::socketConnect(), Error connecting to server");
 		return false;
 	}
 
@@ -682,12 +703,17 @@ int main(int argc, char* argv[]) {
 	// Uncomment this line to set log level to debug
 	// spdlog::set_level(spdlog::level::level_enum::debug);
 
+	// Write logs from a thread of their own, so that logging the JSON
+	// exchanged with the Test Manager doesn't hold up the test
+	logging::useAsyncDefaultLogger(
+	    std::make_shared<spdlog::sinks::stdout_color_sink_mt>());
+
 	// Log the start of the Test Agent
-	spdlog::info(" *** Starting CPP Test Agent *** ");
+	UP_LOG_INFO(" *** Starting CPP Test Agent *** ");
 
 	// Check if the correct number of command line arguments were provided
 	if (argc < 3) {
-		spdlog::error("Incorrect input params: {} ", argv[0]);
+		UP_LOG_ERROR("Incorrect input params: {} ", argv[0]);
 		return 1;
 	}
 
@@ -705,7 +731,7 @@ int main(int argc, char* argv[]) {
 
 	// If no transport type was specified, log an error and exit
 	if (transportType.empty()) {
-		spdlog::error("Transport type not specified");
+		UP_LOG_ERROR("Transport type not specified");
 		return 1;
 	}
 
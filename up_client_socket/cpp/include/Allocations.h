@@ -0,0 +1,247 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+#include "Log.h"
+
+//
+// Heap allocation accounting, per thread, for seeing what a piece of code
+// allocates and holding it to a budget:
+//
+//     allocation::Scope scope;
+//     transport->send(message);
+//     auto used = scope.taken();  // allocations, bytes and frees
+//
+//     {
+//         allocation::Budget budget("send", 2);
+//         transport->send(message);
+//     }  // more than 2 allocations calls the budget handler
+//
+// Counting takes replacing the global operator new and delete, which a
+// program opts in to by defining UP_CLIENT_SOCKET_ALLOCATION_HOOKS in one of
+// its translation units before including this header. Without that,
+// installed() is false, counts stay at zero and budgets always hold.
+//
+namespace allocation {
+
+struct Counts {
+	uint64_t allocations = 0;
+	// as requested, not as rounded up by malloc
+	uint64_t bytes = 0;
+	uint64_t frees = 0;
+
+	Counts operator-(const Counts& other) const {
+		return {allocations - other.allocations, bytes - other.bytes,
+		        frees - other.frees};
+	}
+};
+
+namespace detail {
+
+// constant initialized, so operator new may use them from the first
+// allocation of a thread on
+inline thread_local Counts counts;
+inline std::atomic<bool> installed{false};
+
+}  // namespace detail
+
+// Whether this program counts allocations.
+inline bool installed() {
+	return detail::installed.load(std::memory_order_relaxed);
+}
+
+// What the calling thread allocated so far.
+inline Counts current() { return detail::counts; }
+
+// What the calling thread allocated since the scope began.
+class Scope {
+	Counts start_;
+
+public:
+	Scope() : start_(current()) {}
+
+	Counts taken() const { return current() - start_; }
+};
+
+using BudgetHandler =
+    std::function<void(const char* name, const Counts& used,
+                       uint64_t max_allocations, uint64_t max_bytes)>;
+
+namespace detail {
+
+inline BudgetHandler& budgetHandler() {
+	static BudgetHandler handler = [](const char* name, const Counts& used,
+	                                  uint64_t max_allocations,
+	                                  uint64_t max_bytes) {
+		UP_LOG_SAMPLED_ERROR(
+		    1,
+		    "allocation budget {} exceeded: {} allocations of {} bytes, "
+		    "{} and {} allowed",
+		    name, used.allocations, used.bytes, max_allocations, max_bytes);
+	};
+	return handler;
+}
+
+}  // namespace detail
+
+// Replaces what happens when a Budget is exceeded, logging an error by
+// default. Tests may count the failure or abort instead, but not throw, as
+// the handler runs in ~Budget. Not thread safe, so set it up front.
+inline void setBudgetHandler(BudgetHandler handler) {
+	detail::budgetHandler() = std::move(handler);
+}
+
+// A Scope that calls the budget handler when it ends having allocated more
+// than allowed.
+class Budget {
+	const char* name_;
+	uint64_t max_allocations_;
+	uint64_t max_bytes_;
+	Scope scope_;
+
+public:
+	explicit Budget(const char* name, uint64_t max_allocations,
+	                uint64_t max_bytes = UINT64_MAX)
+	    : name_(name),
+	      max_allocations_(max_allocations),
+	      max_bytes_(max_bytes) {}
+
+	~Budget() {
+		if (exceeded()) {
+			detail::budgetHandler()(name_, taken(), max_allocations_,
+			                        max_bytes_);
+		}
+	}
+
+	Budget(const Budget&) = delete;
+	Budget& operator=(const Budget&) = delete;
+
+	Counts taken() const { return scope_.taken(); }
+
+	bool exceeded() const {
+		auto used = taken();
+		return used.allocations > max_allocations_ || used.bytes > max_bytes_;
+	}
+};
+
+}  // namespace allocation
+
+#ifdef UP_CLIENT_SOCKET_ALLOCATION_HOOKS
+
+namespace allocation::detail {
+
+inline void* allocate(std::size_t size, std::size_t alignment) noexcept {
+	auto& thread_counts = counts;
+	thread_counts.allocations++;
+	thread_counts.bytes += size;
+	if (size == 0)
+		size = 1;
+	if (alignment <= alignof(std::max_align_t))
+		return std::malloc(size);
+	void* ptr = nullptr;
+	return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+
+inline void* allocateOrThrow(std::size_t size, std::size_t alignment) {
+	while (true) {
+		if (auto ptr = allocate(size, alignment))
+			return ptr;
+		auto handler = std::get_new_handler();
+		if (handler == nullptr)
+			throw std::bad_alloc();
+		handler();
+	}
+}
+
+inline void release(void* ptr) noexcept {
+	if (ptr != nullptr) {
+		counts.frees++;
+		std::free(ptr);
+	}
+}
+
+[[maybe_unused]] static const bool hooks_installed = (installed = true);
+
+}  // namespace allocation::detail
+
+void* operator new(std::size_t size) {
+	return allocation::detail::allocateOrThrow(size, 0);
+}
+void* operator new[](std::size_t size) {
+	return allocation::detail::allocateOrThrow(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+	return allocation::detail::allocateOrThrow(size, std::size_t(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+	return allocation::detail::allocateOrThrow(size, std::size_t(alignment));
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+	return allocation::detail::allocate(size, 0);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+	return allocation::detail::allocate(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+	return allocation::detail::allocate(size, std::size_t(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+	return allocation::detail::allocate(size, std::size_t(alignment));
+}
+
+void operator delete(void* ptr) noexcept { allocation::detail::release(ptr); }
+void operator delete[](void* ptr) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete(void* ptr, std::size_t) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete[](void* ptr, std::size_t) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete(void* ptr, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+	allocation::detail::release(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+	allocation::detail::release(ptr);
+}
+
+#endif  // UP_CLIENT_SOCKET_ALLOCATION_HOOKS
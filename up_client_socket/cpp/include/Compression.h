@@ -0,0 +1,227 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#if defined(UP_CLIENT_SOCKET_WITH_LZ4)
+#include <lz4.h>
+#endif
+#if defined(UP_CLIENT_SOCKET_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
+//
+// Payload compression for framed messages. Each codec is only there when the
+// build found its library, as told by UP_CLIENT_SOCKET_WITH_LZ4 and
+// UP_CLIENT_SOCKET_WITH_ZSTD, and a peer without it drops the messages that
+// need it.
+//
+// A dictionary, shared by all peers and trained on typical payloads with
+// `zstd --train`, makes small payloads compress well. Peers tell which one
+// a payload needs by an id computed from its bytes.
+//
+namespace compression {
+
+enum Codec : uint8_t {
+	kLz4 = 1,
+	kZstd = 2,
+};
+
+inline bool available(Codec codec) {
+	switch (codec) {
+#if defined(UP_CLIENT_SOCKET_WITH_LZ4)
+		case kLz4:
+			return true;
+#endif
+#if defined(UP_CLIENT_SOCKET_WITH_ZSTD)
+		case kZstd:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+// FNV-1a of the dictionary, never 0, which stands for no dictionary.
+inline uint32_t dictionaryId(std::string_view dictionary) {
+	if (dictionary.empty())
+		return 0;
+	uint32_t hash = 0x811c9dc5;
+	for (unsigned char c : dictionary) {
+		hash = (hash ^ c) * 0x01000193;
+	}
+	return hash != 0 ? hash : 1;
+}
+
+//
+// Compresses with one codec and level, and decompresses with any codec that
+// is built in. The dictionary is digested once and each thread keeps its own
+// working state, so one Compressor serves any number of threads.
+//
+class Compressor {
+	Codec codec_;
+	int level_;
+	std::string dictionary_;
+	uint32_t dictionary_id_;
+#if defined(UP_CLIENT_SOCKET_WITH_LZ4)
+	// the dictionary loaded once, copied into a thread's stream per message
+	std::unique_ptr<LZ4_stream_t> lz4_dictionary_;
+#endif
+#if defined(UP_CLIENT_SOCKET_WITH_ZSTD)
+	std::unique_ptr<ZSTD_CDict, size_t (*)(ZSTD_CDict*)> zstd_cdict_{
+	    nullptr, ZSTD_freeCDict};
+	std::unique_ptr<ZSTD_DDict, size_t (*)(ZSTD_DDict*)> zstd_ddict_{
+	    nullptr, ZSTD_freeDDict};
+
+	static ZSTD_CCtx* zstdCompressContext() {
+		thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx(
+		    ZSTD_createCCtx(), ZSTD_freeCCtx);
+		return ctx.get();
+	}
+
+	static ZSTD_DCtx* zstdDecompressContext() {
+		thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx(
+		    ZSTD_createDCtx(), ZSTD_freeDCtx);
+		return ctx.get();
+	}
+#endif
+
+public:
+	Compressor(Codec codec, int level, std::string dictionary)
+	    : codec_(codec),
+	      level_(level),
+	      dictionary_(std::move(dictionary)),
+	      dictionary_id_(compression::dictionaryId(dictionary_)) {
+		if (dictionary_.empty())
+			return;
+#if defined(UP_CLIENT_SOCKET_WITH_LZ4)
+		lz4_dictionary_ = std::make_unique<LZ4_stream_t>();
+		LZ4_initStream(lz4_dictionary_.get(), sizeof(LZ4_stream_t));
+		LZ4_loadDict(lz4_dictionary_.get(), dictionary_.data(),
+		             dictionary_.size());
+#endif
+#if defined(UP_CLIENT_SOCKET_WITH_ZSTD)
+		zstd_cdict_.reset(
+		    ZSTD_createCDict(dictionary_.data(), dictionary_.size(), level_));
+		zstd_ddict_.reset(
+		    ZSTD_createDDict(dictionary_.data(), dictionary_.size()));
+#endif
+	}
+
+	Compressor(const Compressor&) = delete;
+	Compressor& operator=(const Compressor&) = delete;
+
+	Codec codec() const { return codec_; }
+
+	uint32_t dictionaryId() const { return dictionary_id_; }
+
+	bool hasDictionary() const { return dictionary_id_ != 0; }
+
+	// Replaces out with in compressed, using the dictionary if asked to and
+	// there is one. Returns false if the codec isn't built in or the result
+	// would not be smaller.
+	bool compress(std::string_view in, bool with_dictionary,
+	              std::string& out) const {
+		if (in.size() < 2)
+			return false;
+		with_dictionary = with_dictionary && hasDictionary();
+		switch (codec_) {
+#if defined(UP_CLIENT_SOCKET_WITH_LZ4)
+			case kLz4: {
+				if (in.size() > LZ4_MAX_INPUT_SIZE)
+					return false;
+				out.resize(in.size() - 1);
+				int n;
+				if (with_dictionary) {
+					thread_local LZ4_stream_t stream;
+					memcpy(&stream, lz4_dictionary_.get(), sizeof(stream));
+					n = LZ4_compress_fast_continue(&stream, in.data(),
+					                               out.data(), in.size(),
+					                               out.size(), 1);
+				} else {
+					n = LZ4_compress_default(in.data(), out.data(), in.size(),
+					                         out.size());
+				}
+				if (n <= 0)
+					return false;
+				out.resize(n);
+				return true;
+			}
+#endif
+#if defined(UP_CLIENT_SOCKET_WITH_ZSTD)
+			case kZstd: {
+				out.resize(ZSTD_compressBound(in.size()));
+				auto n = with_dictionary
+				             ? ZSTD_compress_usingCDict(
+				                   zstdCompressContext(), out.data(),
+				                   out.size(), in.data(), in.size(),
+				                   zstd_cdict_.get())
+				             : ZSTD_compressCCtx(zstdCompressContext(),
+				                                 out.data(), out.size(),
+				                                 in.data(), in.size(), level_);
+				if (ZSTD_isError(n) || n >= in.size())
+					return false;
+				out.resize(n);
+				return true;
+			}
+#endif
+			default:
+				return false;
+		}
+	}
+
+	// Replaces out with in decompressed to exactly size bytes. Returns false
+	// if the codec isn't built in, the dictionary isn't ours or the data is
+	// corrupt.
+	bool decompress(Codec codec, uint32_t dictionary_id, std::string_view in,
+	                size_t size, std::string& out) const {
+		if (dictionary_id != 0 && dictionary_id != dictionary_id_)
+			return false;
+		out.resize(size);
+		switch (codec) {
+#if defined(UP_CLIENT_SOCKET_WITH_LZ4)
+			case kLz4: {
+				if (size > LZ4_MAX_INPUT_SIZE)
+					return false;
+				auto n = dictionary_id != 0
+				             ? LZ4_decompress_safe_usingDict(
+				                   in.data(), out.data(), in.size(), size,
+				                   dictionary_.data(), dictionary_.size())
+				             : LZ4_decompress_safe(in.data(), out.data(),
+				                                   in.size(), size);
+				return n >= 0 && size_t(n) == size;
+			}
+#endif
+#if defined(UP_CLIENT_SOCKET_WITH_ZSTD)
+			case kZstd: {
+				auto n = dictionary_id != 0
+				             ? ZSTD_decompress_usingDDict(
+				                   zstdDecompressContext(), out.data(), size,
+				                   in.data(), in.size(), zstd_ddict_.get())
+				             : ZSTD_decompressDCtx(zstdDecompressContext(),
+				                                   out.data(), size,
+				                                   in.data(), in.size());
+				return !ZSTD_isError(n) && n == size;
+			}
+#endif
+			default:
+				return false;
+		}
+	}
+};
+
+}  // namespace compression
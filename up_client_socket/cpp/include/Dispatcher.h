@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+///
+/// Native replacement for dispatcher/dispatcher.py: relays the messages it
+/// receives to connected clients, the sender included.
+///
+/// Framed messages are relayed one frame at a time, and bare messages from
+/// peers that don't frame are relayed as read, as the Python relay does. One
+/// copy of each read is shared by the outbound queues of all recipients.
+///
+/// Connections are spread over worker threads, each with its own epoll loop.
+/// Messages pass between workers in batches over lock-free queues, and a
+/// client that can't keep up is dealt with by the slow_consumer policy
+/// rather than holding back the others.
+///
+/// Clients that advertise their listener filters (see Subscription.h) only
+/// get the routed messages that match one of them.
+///
+class Dispatcher {
+public:
+	/// @brief What to do with a client whose outbound queue is full.
+	enum class SlowConsumer {
+		/// Close the connection, so the client can reconnect and resync.
+		kDisconnect,
+		/// Keep the connection and discard messages until the queue drains.
+		kDrop,
+	};
+
+	struct Options {
+		std::string ip = "127.0.0.1";
+		int port = 44444;
+		/// @brief Worker threads, each serving a share of the connections.
+		unsigned threads = 1;
+		/// @brief Bytes queued for one client before slow_consumer applies.
+		size_t max_queued_bytes = 64 * 1024 * 1024;
+		SlowConsumer slow_consumer = SlowConsumer::kDisconnect;
+	};
+
+	/// @brief Bind and listen on the configured address.
+	/// @throws std::system_error if the socket can't be set up.
+	explicit Dispatcher(const Options& options);
+	~Dispatcher();
+
+	/// @brief Relay messages until stop() is called.
+	void run();
+
+	/// @brief Make run() return. Safe to call from a signal handler.
+	void stop();
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> pImpl;
+};
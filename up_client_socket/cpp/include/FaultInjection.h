@@ -0,0 +1,158 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <utility>
+
+//
+// Degrades one direction of a connection the way a bad network would: frames
+// arrive late, by a fixed delay plus jitter and as fast as the bandwidth
+// allows, some are lost or arrive twice, and reads and writes take only
+// part of the bytes at a time.
+//
+// Every decision is drawn from a random sequence of its own, seeded by the
+// caller, so the same frames through the same Injector always see the same
+// faults.
+//
+namespace fault {
+
+using Clock = std::chrono::steady_clock;
+
+struct Profile {
+	Clock::duration delay{0};
+	// up to this much more delay, uniformly distributed
+	Clock::duration jitter{0};
+	// probability of a frame being lost, and of it arriving twice
+	double drop = 0;
+	double duplicate = 0;
+	// 0 for unlimited
+	uint64_t bytes_per_second = 0;
+	// probability of a read or write taking only part of its bytes
+	double partial = 0;
+};
+
+class Injector {
+	Profile profile_;
+	// the fate of frames, and separately how reads and writes are cut, as
+	// those depend on timing and mustn't shift the fate of later frames
+	std::mt19937_64 random_;
+	std::mt19937_64 pieces_;
+	// when the frames released so far are through the link, and when the
+	// last of them arrives, so frames keep their order as on a stream
+	Clock::time_point busy_until_;
+	Clock::time_point last_arrival_;
+
+	// Uniform in [0, 1), computed here rather than by a distribution so
+	// the sequence is the same with every standard library.
+	static double unit(std::mt19937_64& random) {
+		return (random() >> 11) * 0x1.0p-53;
+	}
+
+	double unit() { return unit(random_); }
+
+public:
+	Injector(const Profile& profile, uint64_t seed)
+	    : profile_(profile), random_(seed), pieces_(~seed) {}
+
+	// Whether frames have to wait in a DelayLine.
+	bool delays() const {
+		return profile_.delay.count() > 0 || profile_.jitter.count() > 0 ||
+		       profile_.bytes_per_second > 0;
+	}
+
+	// How many copies of a frame come out: 0 when it is lost, 2 when it is
+	// duplicated, 1 otherwise.
+	int copies() {
+		// always draw both so one outcome doesn't shift the sequence
+		bool dropped = unit() < profile_.drop;
+		bool duplicated = unit() < profile_.duplicate;
+		return dropped ? 0 : duplicated ? 2 : 1;
+	}
+
+	// When a frame of the given size, handed to the link now, arrives.
+	Clock::time_point arrival(size_t bytes, Clock::time_point now) {
+		auto start = std::max(now, busy_until_);
+		busy_until_ = start;
+		if (profile_.bytes_per_second > 0) {
+			busy_until_ += std::chrono::duration_cast<Clock::duration>(
+			    std::chrono::duration<double>(
+			        double(bytes) / profile_.bytes_per_second));
+		}
+		auto jitter = std::chrono::duration_cast<Clock::duration>(
+		    profile_.jitter * unit());
+		last_arrival_ =
+		    std::max(last_arrival_, busy_until_ + profile_.delay + jitter);
+		return last_arrival_;
+	}
+
+	// How many of size bytes one read or write takes: all of them, or
+	// sometimes at least one but fewer.
+	size_t partial(size_t size) {
+		if (profile_.partial <= 0 || size < 2 ||
+		    unit(pieces_) >= profile_.partial)
+			return size;
+		return 1 + size_t(unit(pieces_) * (size - 1));
+	}
+};
+
+// Seed of the sequence for one direction of one connection, so that each
+// has its own but all follow from the one seed.
+inline uint64_t seedFor(uint64_t seed, size_t link, bool receive) {
+	uint64_t mixed = seed + (link * 2 + receive + 1) * 0x9e3779b97f4a7c15ULL;
+	mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebULL;
+	return mixed ^ (mixed >> 31);
+}
+
+// Holds items until they are due, in the order they were pushed. Due times
+// must not decrease, as Injector::arrival() guarantees.
+template <typename T>
+class DelayLine {
+	std::deque<std::pair<Clock::time_point, T>> items_;
+
+public:
+	bool empty() const { return items_.empty(); }
+
+	size_t size() const { return items_.size(); }
+
+	void push(Clock::time_point due, T item) {
+		items_.emplace_back(due, std::move(item));
+	}
+
+	// Calls fn(T&&) for each item due by now.
+	template <typename FN>
+	void release(Clock::time_point now, FN&& fn) {
+		while (!items_.empty() && items_.front().first <= now) {
+			auto item = std::move(items_.front().second);
+			items_.pop_front();
+			fn(std::move(item));
+		}
+	}
+
+	// ms until the next item is due, -1 when there are none.
+	int timeoutMs(Clock::time_point now) const {
+		if (items_.empty())
+			return -1;
+		auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+		                items_.front().first - now)
+		                .count();
+		return int(std::max<decltype(wait)>(wait, 0));
+	}
+};
+
+}  // namespace fault
@@ -0,0 +1,275 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+//
+// Records frames as they are sent and received into a ring in a file, for
+// looking at after an incident or replaying as load. The file is mapped
+// shared, so what was recorded is in the page cache the moment append()
+// returns and outlives a crash of the process.
+//
+// File layout, integers in host order:
+//   page 0  FileHeader
+//   then    the ring, capacity bytes of records, each a Record followed by
+//           the frame padded to 8 bytes
+//
+// Like Spool, the ring is mapped twice back to back so that a record is
+// contiguous in memory even where it wraps. Writers claim space with one
+// atomic add on the head kept in the file, and mark a record complete by
+// storing its position in it last, so any number of threads, or processes
+// sharing the file, append without locks or syscalls. Once the ring is full
+// the oldest records are overwritten.
+//
+class FlightRecorder {
+public:
+	enum Direction : uint8_t { kSent = 0, kReceived = 1 };
+
+	static constexpr char kMagic[8] = {'U', 'P', 'F', 'L', 'I', 'G', 'H', 'T'};
+	static constexpr uint32_t kVersion = 1;
+
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		// offset of the ring in the file
+		uint32_t ring_offset;
+		uint64_t capacity;
+		// bytes ever claimed; only grows
+		std::atomic<uint64_t> head;
+	};
+
+	struct Record {
+		// where the record starts, counted like head; stored last, so a
+		// record is complete when this matches its place in the ring
+		std::atomic<uint64_t> position;
+		// unix time in ns
+		uint64_t time_ns;
+		// bytes of frame kept after the record
+		uint32_t size;
+		// bytes of the frame, more than size if it was cut short
+		uint32_t length;
+		uint8_t direction;
+		uint8_t reserved;
+		// index of the dispatcher connection, their count for multicast
+		uint16_t link;
+		uint32_t reserved2;
+	};
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free,
+	              "the file is shared through lock-free atomics");
+	static_assert(sizeof(Record) == 32, "records are 8 byte aligned");
+
+	static size_t footprint(size_t size) {
+		return sizeof(Record) + (size + 7) / 8 * 8;
+	}
+
+private:
+	FileHeader* header_ = nullptr;
+	char* ring_ = nullptr;
+	size_t capacity_ = 0;
+	size_t page_ = 0;
+	// frames beyond this are cut short so one can't wipe the whole ring
+	size_t max_size_ = 0;
+	std::atomic<bool> enabled_{true};
+
+	[[noreturn]] static void fail(int error,
+	                              const char* what = "flight recorder") {
+		throw std::system_error(error, std::generic_category(), what);
+	}
+
+public:
+	// Opens or creates the file at path with a ring of at least capacity
+	// bytes. A recording with the same capacity is appended to, one with
+	// another is started over. Any other existing file is left alone and
+	// refused. Throws std::system_error on failure.
+	FlightRecorder(const std::string& path, size_t capacity) {
+		page_ = sysconf(_SC_PAGESIZE);
+		capacity = std::max<size_t>(capacity, 1);
+		capacity_ = (capacity + page_ - 1) / page_ * page_;
+		max_size_ = capacity_ / 8;
+		int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			fail(errno);
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			auto error = errno;
+			close(fd);
+			fail(error);
+		}
+		// never resize or overwrite what someone pointed us at by mistake
+		char magic[sizeof(kMagic)];
+		if (!S_ISREG(st.st_mode) ||
+		    (st.st_size != 0 &&
+		     (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+		      memcmp(magic, kMagic, sizeof(kMagic)) != 0))) {
+			close(fd);
+			fail(EEXIST, "flight recorder: file is not a recording");
+		}
+		bool reuse = size_t(st.st_size) == page_ + capacity_;
+		if (!reuse && ftruncate(fd, page_ + capacity_) < 0) {
+			auto error = errno;
+			close(fd);
+			fail(error);
+		}
+		auto header = mmap(nullptr, page_, PROT_READ | PROT_WRITE, MAP_SHARED,
+		                   fd, 0);
+		// reserve twice the ring, then map the same pages into both halves
+		auto reserved = mmap(nullptr, 2 * capacity_, PROT_NONE,
+		                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (header == MAP_FAILED || reserved == MAP_FAILED) {
+			auto error = errno;
+			if (header != MAP_FAILED)
+				munmap(header, page_);
+			if (reserved != MAP_FAILED)
+				munmap(reserved, 2 * capacity_);
+			close(fd);
+			fail(error);
+		}
+		header_ = static_cast<FileHeader*>(header);
+		ring_ = static_cast<char*>(reserved);
+		for (size_t half = 0; half < 2; half++) {
+			if (mmap(ring_ + half * capacity_, capacity_,
+			         PROT_READ | PROT_WRITE,
+			         MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd,
+			         page_) == MAP_FAILED) {
+				auto error = errno;
+				close(fd);
+				munmap(header_, page_);
+				munmap(ring_, 2 * capacity_);
+				fail(error);
+			}
+		}
+		close(fd);
+		if (!reuse || memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+		    header_->version != kVersion || header_->ring_offset != page_ ||
+		    header_->capacity != capacity_) {
+			memset(ring_, 0, capacity_);
+			header_->version = kVersion;
+			header_->ring_offset = page_;
+			header_->capacity = capacity_;
+			header_->head.store(0);
+			memcpy(header_->magic, kMagic, sizeof(kMagic));
+		}
+	}
+
+	~FlightRecorder() {
+		munmap(header_, page_);
+		munmap(ring_, 2 * capacity_);
+	}
+
+	FlightRecorder(const FlightRecorder&) = delete;
+	FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+	void setEnabled(bool enabled) {
+		enabled_.store(enabled, std::memory_order_relaxed);
+	}
+
+	bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+	// Records a frame, unless recording is off. Safe from any thread.
+	void append(Direction direction, size_t link, std::string_view frame) {
+		if (!enabled())
+			return;
+		auto size = std::min(frame.size(), max_size_);
+		auto bytes = footprint(size);
+		auto position =
+		    header_->head.fetch_add(bytes, std::memory_order_relaxed);
+		auto record = reinterpret_cast<Record*>(ring_ + position % capacity_);
+		// readers must not take a half written record for the one before
+		record->position.store(UINT64_MAX, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		record->time_ns =
+		    std::chrono::duration_cast<std::chrono::nanoseconds>(
+		        std::chrono::system_clock::now().time_since_epoch())
+		        .count();
+		record->size = size;
+		record->length = frame.size();
+		record->direction = direction;
+		record->reserved = 0;
+		record->link = link;
+		record->reserved2 = 0;
+		memcpy(reinterpret_cast<char*>(record + 1), frame.data(), size);
+		record->position.store(position, std::memory_order_release);
+	}
+
+	// A record as read back by load().
+	struct Entry {
+		uint64_t time_ns;
+		Direction direction;
+		uint16_t link;
+		// the frame as sent or received, possibly cut short
+		std::string_view frame;
+		uint32_t length;
+	};
+
+	// Calls fn(const Entry&) for each complete record in the file at path,
+	// oldest first. Records being written or overwritten at the time are
+	// skipped. Returns false if the file isn't a recording.
+	template <typename FN>
+	static bool load(const std::string& path, FN&& fn) {
+		std::ifstream in(path, std::ios::binary);
+		std::string file((std::istreambuf_iterator<char>(in)),
+		                 std::istreambuf_iterator<char>());
+		if (file.size() < sizeof(FileHeader))
+			return false;
+		auto header = reinterpret_cast<const FileHeader*>(file.data());
+		if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+		    header->version != kVersion ||
+		    file.size() != header->ring_offset + header->capacity) {
+			return false;
+		}
+		uint64_t capacity = header->capacity;
+		uint64_t head = header->head.load();
+		// the ring twice over, so records that wrap can be read in one go
+		std::string ring = file.substr(header->ring_offset);
+		ring += ring;
+		uint64_t position = head > capacity ? head - capacity : 0;
+		while (position + sizeof(Record) <= head) {
+			auto record =
+			    reinterpret_cast<const Record*>(&ring[position % capacity]);
+			auto bytes = footprint(record->size);
+			if (record->position.load() != position ||
+			    record->size > record->length || bytes > capacity ||
+			    position + bytes > head) {
+				// not the start of a complete record, look further on
+				position += 8;
+				continue;
+			}
+			Entry entry;
+			entry.time_ns = record->time_ns;
+			entry.direction = static_cast<Direction>(record->direction);
+			entry.link = record->link;
+			entry.frame = std::string_view(
+			    reinterpret_cast<const char*>(record + 1), record->size);
+			entry.length = record->length;
+			fn(entry);
+			position += bytes;
+		}
+		return true;
+	}
+};
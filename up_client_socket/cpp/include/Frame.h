@@ -0,0 +1,332 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+//
+// Optional framing for messages exchanged through the dispatcher.
+//
+// Peers in other languages write bare serialized UMessages, one per socket
+// write. A frame starts with a zero byte instead, which can never begin a
+// valid protobuf encoding (field number 0 is reserved), so both forms can
+// share a connection.
+//
+// Fixed header, integers little endian:
+//   u8  magic     0x00
+//   u8  version   1
+//   u16 flags     what the extension area holds
+//   u16 ext_len   bytes of extensions following the fixed header
+//   u32 body_len  bytes of body (a serialized UMessage) following those
+//
+namespace frame {
+
+constexpr uint8_t kMagic = 0x00;
+constexpr uint8_t kVersion = 1;
+constexpr size_t kHeaderSize = 10;
+constexpr uint32_t kMaxBodySize = 64 * 1024 * 1024;
+
+enum Flags : uint16_t {
+	kRouting = 1 << 0,
+	// the body is a message for the dispatcher itself, see Subscription.h
+	kControl = 1 << 1,
+	// one piece of a message sent in several frames, see Chunk below
+	kChunk = 1 << 2,
+	// the payload in the body is compressed, see Compressed below
+	kCompressed = 1 << 3,
+};
+
+struct Header {
+	uint16_t flags = 0;
+	uint16_t ext_len = 0;
+	uint32_t body_len = 0;
+
+	size_t size() const { return kHeaderSize + ext_len + body_len; }
+};
+
+// One message read off the wire. Views point into owner, which callers may
+// hold on to in order to keep them valid beyond the callback.
+struct Frame {
+	uint16_t flags = 0;
+	std::string_view ext;
+	std::string_view body;
+	// the whole message as received, including any frame header
+	std::string_view raw;
+	std::shared_ptr<const std::string> owner;
+	// true when the peer sent a bare UMessage without any framing
+	bool bare = false;
+};
+
+//
+// Routing extension: just enough of UAttributes to match a message against
+// listener filters without parsing the protobuf body.
+//
+//   u8 type, u8 priority, then source and sink, each encoded as
+//   u8 authority length, authority bytes, u32 ue_id, u8 ue_version_major,
+//   u16 resource_id
+//
+struct RoutingUUri {
+	std::string_view authority_name;
+	uint32_t ue_id = 0;
+	uint32_t ue_version_major = 0;
+	uint32_t resource_id = 0;
+};
+
+struct Routing {
+	uint8_t type = 0;
+	uint8_t priority = 0;
+	RoutingUUri source;
+	RoutingUUri sink;
+};
+
+//
+// Chunk extension, following the routing extension that chunked frames always
+// carry so the dispatcher can route each piece on its own:
+//
+//   u64 id msb, u64 id lsb   the id of the message the piece belongs to
+//   u32 seq                  0 for the first piece
+//   u8  flags                kAbort when the sender gave up on the message
+//   u64 total                payload bytes of the whole message
+//
+// The first piece's body is the message with its attributes and no payload.
+// Every later body is the next stretch of payload, until total is reached.
+//
+enum ChunkFlags : uint8_t {
+	kAbort = 1 << 0,
+};
+
+constexpr size_t kChunkSize = 29;
+
+struct Chunk {
+	uint64_t msb = 0;
+	uint64_t lsb = 0;
+	uint32_t seq = 0;
+	uint8_t flags = 0;
+	uint64_t total = 0;
+};
+
+//
+// Compression extension, last in the extension area of a frame whose body
+// holds the message with its payload field compressed. The attributes are
+// left as they are, so the frame is routed and matched as usual.
+//
+//   u8  codec          see Compression.h
+//   u32 dictionary id  0 when compressed without a dictionary
+//   u32 size           bytes of the payload once decompressed
+//
+constexpr size_t kCompressedSize = 9;
+
+struct Compressed {
+	uint8_t codec = 0;
+	uint32_t dictionary_id = 0;
+	uint32_t size = 0;
+};
+
+namespace detail {
+
+template <typename T>
+void put(std::string& out, T value) {
+	for (size_t i = 0; i < sizeof(T); i++) {
+		out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+	}
+}
+
+template <typename T>
+bool get(std::string_view& in, T& value) {
+	if (in.size() < sizeof(T))
+		return false;
+	value = 0;
+	for (size_t i = 0; i < sizeof(T); i++) {
+		value |= static_cast<T>(static_cast<uint8_t>(in[i])) << (8 * i);
+	}
+	in.remove_prefix(sizeof(T));
+	return true;
+}
+
+inline bool fits(const RoutingUUri& uri) {
+	return uri.authority_name.size() <= 0xff && uri.ue_version_major <= 0xff &&
+	       uri.resource_id <= 0xffff;
+}
+
+inline void putUUri(std::string& out, const RoutingUUri& uri) {
+	put<uint8_t>(out, uri.authority_name.size());
+	out.append(uri.authority_name);
+	put<uint32_t>(out, uri.ue_id);
+	put<uint8_t>(out, uri.ue_version_major);
+	put<uint16_t>(out, uri.resource_id);
+}
+
+inline bool getUUri(std::string_view& in, RoutingUUri& uri) {
+	uint8_t len;
+	uint8_t version;
+	uint16_t resource;
+	if (!get(in, len) || in.size() < len)
+		return false;
+	uri.authority_name = in.substr(0, len);
+	in.remove_prefix(len);
+	if (!get(in, uri.ue_id) || !get(in, version) || !get(in, resource))
+		return false;
+	uri.ue_version_major = version;
+	uri.resource_id = resource;
+	return true;
+}
+
+}  // namespace detail
+
+inline void appendHeader(std::string& out, const Header& header) {
+	detail::put<uint8_t>(out, kMagic);
+	detail::put<uint8_t>(out, kVersion);
+	detail::put<uint16_t>(out, header.flags);
+	detail::put<uint16_t>(out, header.ext_len);
+	detail::put<uint32_t>(out, header.body_len);
+}
+
+// Fill in a header over kHeaderSize bytes reserved at the start of out, for
+// callers that only learn the extension length after writing it.
+inline void writeHeader(std::string& out, const Header& header) {
+	std::string raw;
+	appendHeader(raw, header);
+	out.replace(0, kHeaderSize, raw);
+}
+
+// Returns false if the data is not a frame header this version understands.
+inline bool parseHeader(std::string_view in, Header& header) {
+	uint8_t magic;
+	uint8_t version;
+	return detail::get(in, magic) && magic == kMagic &&
+	       detail::get(in, version) && version == kVersion &&
+	       detail::get(in, header.flags) && detail::get(in, header.ext_len) &&
+	       detail::get(in, header.body_len) && header.body_len <= kMaxBodySize;
+}
+
+// Appends the routing extension. Returns false, leaving out untouched, if a
+// field is outside the range the compact encoding can carry.
+inline bool appendRouting(std::string& out, const Routing& routing) {
+	if (!detail::fits(routing.source) || !detail::fits(routing.sink))
+		return false;
+	detail::put<uint8_t>(out, routing.type);
+	detail::put<uint8_t>(out, routing.priority);
+	detail::putUUri(out, routing.source);
+	detail::putUUri(out, routing.sink);
+	return true;
+}
+
+inline bool parseRouting(std::string_view in, Routing& routing) {
+	return detail::get(in, routing.type) && detail::get(in, routing.priority) &&
+	       detail::getUUri(in, routing.source) &&
+	       detail::getUUri(in, routing.sink);
+}
+
+inline void appendChunk(std::string& out, const Chunk& chunk) {
+	detail::put<uint64_t>(out, chunk.msb);
+	detail::put<uint64_t>(out, chunk.lsb);
+	detail::put<uint32_t>(out, chunk.seq);
+	detail::put<uint8_t>(out, chunk.flags);
+	detail::put<uint64_t>(out, chunk.total);
+}
+
+inline void appendCompressed(std::string& out, const Compressed& compressed) {
+	detail::put<uint8_t>(out, compressed.codec);
+	detail::put<uint32_t>(out, compressed.dictionary_id);
+	detail::put<uint32_t>(out, compressed.size);
+}
+
+// Reads the compression extension from the end of a frame's extension area.
+inline bool parseCompressed(std::string_view ext, Compressed& compressed) {
+	if (ext.size() < kCompressedSize)
+		return false;
+	ext.remove_prefix(ext.size() - kCompressedSize);
+	return detail::get(ext, compressed.codec) &&
+	       detail::get(ext, compressed.dictionary_id) &&
+	       detail::get(ext, compressed.size) &&
+	       compressed.size <= kMaxBodySize;
+}
+
+// Reads the chunk extension from the end of a frame's extension area.
+inline bool parseChunk(std::string_view ext, Chunk& chunk) {
+	if (ext.size() < kChunkSize)
+		return false;
+	ext.remove_prefix(ext.size() - kChunkSize);
+	return detail::get(ext, chunk.msb) && detail::get(ext, chunk.lsb) &&
+	       detail::get(ext, chunk.seq) && detail::get(ext, chunk.flags) &&
+	       detail::get(ext, chunk.total);
+}
+
+//
+// Splits a received byte stream into frames. A partial frame at the end of a
+// read is kept until the rest arrives. Bare messages can't be delimited, so
+// as before, whatever remains of a read is taken to be one message.
+//
+// Frames handed out reference either the chunk passed in or a buffer the
+// reader assembled, never a buffer that will be modified afterwards. Callers
+// should check chunk.use_count() before reusing it for the next read.
+//
+class Reader {
+	// holds the start of an incomplete frame, null at a frame boundary
+	std::shared_ptr<std::string> partial_;
+
+public:
+	// Calls fn(const Frame&) for each complete message. Returns false if the
+	// stream can't be resynchronized, after discarding what was buffered.
+	template <typename FN>
+	bool consume(const std::shared_ptr<std::string>& chunk, FN&& fn) {
+		auto owner = chunk;
+		if (partial_) {
+			partial_->append(*chunk);
+			owner = std::move(partial_);
+		}
+		std::string_view data = *owner;
+		size_t pos = 0;
+		bool ok = true;
+		while (pos < data.size()) {
+			auto rest = data.substr(pos);
+			if (static_cast<uint8_t>(rest[0]) != kMagic) {
+				Frame bare;
+				bare.body = rest;
+				bare.raw = rest;
+				bare.owner = owner;
+				bare.bare = true;
+				fn(bare);
+				pos = data.size();
+				break;
+			}
+			if (rest.size() < kHeaderSize)
+				break;
+			Header header;
+			if (!parseHeader(rest, header)) {
+				ok = false;
+				pos = data.size();
+				break;
+			}
+			if (rest.size() < header.size())
+				break;
+			Frame frame;
+			frame.flags = header.flags;
+			frame.ext = rest.substr(kHeaderSize, header.ext_len);
+			frame.body = rest.substr(kHeaderSize + header.ext_len,
+			                         header.body_len);
+			frame.raw = rest.substr(0, header.size());
+			frame.owner = owner;
+			fn(frame);
+			pos += header.size();
+		}
+		if (pos < data.size()) {
+			partial_ = std::make_shared<std::string>(data.substr(pos));
+		}
+		return ok;
+	}
+};
+
+}  // namespace frame
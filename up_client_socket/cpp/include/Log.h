@@ -0,0 +1,296 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <spdlog/details/log_msg_buffer.h>
+#include <spdlog/sinks/sink.h>
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+//
+// Logging on top of spdlog for code that runs per message.
+//
+// UP_LOG_DEBUG(...) and friends take the arguments of spdlog::debug() but
+// only evaluate them once the level is known to be on, so a disabled log
+// costs one branch. Levels below UP_CLIENT_SOCKET_LOG_LEVEL, a SPDLOG_LEVEL_*
+// value, are compiled out entirely.
+//
+// UP_LOG_SAMPLED_DEBUG(per_second, ...) and friends also let through at most
+// per_second messages a second from their call site, with short bursts,
+// and say how many they held back.
+//
+// AsyncSink moves writing off the logging thread, through a lock-free ring
+// that drops messages rather than making anyone wait when it is full.
+//
+
+#ifndef UP_CLIENT_SOCKET_LOG_LEVEL
+#define UP_CLIENT_SOCKET_LOG_LEVEL SPDLOG_LEVEL_DEBUG
+#endif
+
+#define UP_LOG_AT_(level, ...)                                          \
+	do {                                                               \
+		if constexpr (static_cast<int>(level) >=                       \
+		              UP_CLIENT_SOCKET_LOG_LEVEL) {                    \
+			if (spdlog::should_log(level))                             \
+				spdlog::log(level, __VA_ARGS__);                       \
+		}                                                              \
+	} while (0)
+
+#define UP_LOG_SAMPLED_AT_(level, per_second, ...)                      \
+	do {                                                               \
+		if constexpr (static_cast<int>(level) >=                       \
+		              UP_CLIENT_SOCKET_LOG_LEVEL) {                    \
+			if (spdlog::should_log(level)) {                           \
+				static ::logging::RateLimit up_log_limit_(per_second); \
+				if (up_log_limit_.allow()) {                           \
+					if (auto skipped = up_log_limit_.takeSkipped())    \
+						spdlog::log(level,                             \
+						            "{} similar messages not logged",  \
+						            skipped);                          \
+					spdlog::log(level, __VA_ARGS__);                   \
+				}                                                      \
+			}                                                          \
+		}                                                              \
+	} while (0)
+
+#define UP_LOG_TRACE(...) UP_LOG_AT_(spdlog::level::trace, __VA_ARGS__)
+#define UP_LOG_DEBUG(...) UP_LOG_AT_(spdlog::level::debug, __VA_ARGS__)
+#define UP_LOG_INFO(...) UP_LOG_AT_(spdlog::level::info, __VA_ARGS__)
+#define UP_LOG_WARN(...) UP_LOG_AT_(spdlog::level::warn, __VA_ARGS__)
+#define UP_LOG_ERROR(...) UP_LOG_AT_(spdlog::level::err, __VA_ARGS__)
+
+#define UP_LOG_SAMPLED_DEBUG(per_second, ...) \
+	UP_LOG_SAMPLED_AT_(spdlog::level::debug, per_second, __VA_ARGS__)
+#define UP_LOG_SAMPLED_INFO(per_second, ...) \
+	UP_LOG_SAMPLED_AT_(spdlog::level::info, per_second, __VA_ARGS__)
+#define UP_LOG_SAMPLED_WARN(per_second, ...) \
+	UP_LOG_SAMPLED_AT_(spdlog::level::warn, per_second, __VA_ARGS__)
+#define UP_LOG_SAMPLED_ERROR(per_second, ...) \
+	UP_LOG_SAMPLED_AT_(spdlog::level::err, per_second, __VA_ARGS__)
+
+namespace logging {
+
+//
+// Lets through per_second events a second on average, and up to burst at
+// once after a quiet spell (the generic cell rate algorithm). allow() is one
+// compare-and-swap, from any number of threads.
+//
+class RateLimit {
+	int64_t interval_ns_;
+	int64_t burst_ns_;
+	// when the next event would be on schedule
+	std::atomic<int64_t> due_ns_{0};
+	std::atomic<uint64_t> skipped_{0};
+
+	static int64_t nowNs() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		           std::chrono::steady_clock::now().time_since_epoch())
+		    .count();
+	}
+
+public:
+	explicit RateLimit(double per_second, unsigned burst = 10)
+	    : interval_ns_(static_cast<int64_t>(1e9 / std::max(per_second, 1e-9))),
+	      burst_ns_(interval_ns_ * std::max(burst, 1u)) {}
+
+	bool allow() {
+		auto now = nowNs();
+		auto due = due_ns_.load(std::memory_order_relaxed);
+		int64_t next;
+		do {
+			auto start = std::max(due, now);
+			if (start - now >= burst_ns_) {
+				skipped_.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			next = start + interval_ns_;
+		} while (!due_ns_.compare_exchange_weak(due, next,
+		                                        std::memory_order_relaxed));
+		return true;
+	}
+
+	// Events refused since the last call.
+	uint64_t takeSkipped() {
+		return skipped_.exchange(0, std::memory_order_relaxed);
+	}
+};
+
+//
+// Bounded ring for many producers and one consumer, after Dmitry Vyukov's
+// bounded MPMC queue: each slot carries a sequence number telling whose
+// turn it is, so producers claim slots with one compare-and-swap and never
+// wait on each other or on the consumer.
+//
+template <typename T>
+class Ring {
+	struct alignas(64) Slot {
+		std::atomic<size_t> seq;
+		T value;
+	};
+
+	std::unique_ptr<Slot[]> slots_;
+	size_t mask_;
+	alignas(64) std::atomic<size_t> head_{0};
+	alignas(64) size_t tail_ = 0;
+
+public:
+	// capacity is rounded up to a power of two
+	explicit Ring(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity) {
+			size <<= 1;
+		}
+		slots_ = std::make_unique<Slot[]>(size);
+		mask_ = size - 1;
+		for (size_t i = 0; i < size; i++) {
+			slots_[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	Ring(const Ring&) = delete;
+	Ring& operator=(const Ring&) = delete;
+
+	// Returns false when full.
+	bool tryPush(T&& value) {
+		auto pos = head_.load(std::memory_order_relaxed);
+		while (true) {
+			auto& slot = slots_[pos & mask_];
+			auto seq = slot.seq.load(std::memory_order_acquire);
+			auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0) {
+				if (head_.compare_exchange_weak(pos, pos + 1,
+				                                std::memory_order_relaxed)) {
+					slot.value = std::move(value);
+					slot.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Only one thread may pop.
+	bool tryPop(T& out) {
+		auto& slot = slots_[tail_ & mask_];
+		if (slot.seq.load(std::memory_order_acquire) != tail_ + 1)
+			return false;
+		out = std::move(slot.value);
+		slot.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+		tail_++;
+		return true;
+	}
+};
+
+//
+// spdlog sink that copies each message into a Ring and has a thread of its
+// own pass it on to target. Logging never blocks on I/O or a lock; when the
+// ring is full the message is dropped, and the count of those is logged
+// once there is room again. The thread polls, backing off to 1 ms when idle,
+// so that producers need not wake it.
+//
+class AsyncSink : public spdlog::sinks::sink {
+	spdlog::sink_ptr target_;
+	Ring<spdlog::details::log_msg_buffer> ring_;
+	std::atomic<uint64_t> queued_{0};
+	std::atomic<uint64_t> written_{0};
+	std::atomic<uint64_t> dropped_{0};
+	std::atomic<bool> stop_{false};
+	std::thread thread_;
+
+	void run() {
+		spdlog::details::log_msg_buffer msg;
+		unsigned idle = 0;
+		while (true) {
+			if (ring_.tryPop(msg)) {
+				if (auto dropped = dropped_.exchange(0)) {
+					auto note = fmt::format(
+					    "{} log messages dropped, the queue was full",
+					    dropped);
+					target_->log(spdlog::details::log_msg(
+					    msg.logger_name, spdlog::level::warn, note));
+				}
+				target_->log(msg);
+				written_.fetch_add(1, std::memory_order_release);
+				idle = 0;
+				continue;
+			}
+			if (stop_.load(std::memory_order_acquire))
+				break;
+			if (idle++ == 0)
+				target_->flush();
+			std::this_thread::sleep_for(idle < 100
+			                                ? std::chrono::microseconds(50)
+			                                : std::chrono::microseconds(1000));
+		}
+		target_->flush();
+	}
+
+public:
+	explicit AsyncSink(spdlog::sink_ptr target, size_t capacity = 8192)
+	    : target_(std::move(target)), ring_(capacity) {
+		thread_ = std::thread([this]() { run(); });
+	}
+
+	~AsyncSink() override {
+		stop_.store(true, std::memory_order_release);
+		thread_.join();
+	}
+
+	void log(const spdlog::details::log_msg& msg) override {
+		if (ring_.tryPush(spdlog::details::log_msg_buffer(msg))) {
+			queued_.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Waits until what was logged before has been written.
+	void flush() override {
+		auto queued = queued_.load(std::memory_order_relaxed);
+		while (written_.load(std::memory_order_acquire) < queued) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		target_->flush();
+	}
+
+	void set_pattern(const std::string& pattern) override {
+		target_->set_pattern(pattern);
+	}
+
+	void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override {
+		target_->set_formatter(std::move(formatter));
+	}
+};
+
+// Swaps the default logger for one that writes to target through an
+// AsyncSink, keeping its name and level.
+inline void useAsyncDefaultLogger(spdlog::sink_ptr target,
+                                  size_t capacity = 8192) {
+	auto previous = spdlog::default_logger();
+	auto logger = std::make_shared<spdlog::logger>(
+	    previous->name(),
+	    std::make_shared<AsyncSink>(std::move(target), capacity));
+	logger->set_level(previous->level());
+	spdlog::set_default_logger(std::move(logger));
+}
+
+}  // namespace logging
@@ -0,0 +1,233 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//
+// Counters, gauges and latency histograms cheap enough to leave on in
+// production: recording is a relaxed atomic add, and all the summing happens
+// when someone takes a snapshot.
+//
+namespace metrics {
+
+//
+// Counter spread over cache lines, so that threads counting at the same time
+// don't fight over one.
+//
+class Counter {
+	static constexpr size_t kShards = 16;
+
+	struct alignas(64) Shard {
+		std::atomic<uint64_t> value{0};
+	};
+
+	std::array<Shard, kShards> shards_;
+
+	static size_t shard() {
+		static std::atomic<size_t> next{0};
+		thread_local size_t index =
+		    next.fetch_add(1, std::memory_order_relaxed) % kShards;
+		return index;
+	}
+
+public:
+	void add(uint64_t n = 1) {
+		shards_[shard()].value.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64_t value() const {
+		uint64_t sum = 0;
+		for (auto& shard : shards_) {
+			sum += shard.value.load(std::memory_order_relaxed);
+		}
+		return sum;
+	}
+};
+
+//
+// Log-linear histogram after HdrHistogram: every power of two is split into
+// 16 buckets, so any value is placed within 1/16 of itself, from 0 up to
+// 2^64. Values are usually nanoseconds.
+//
+class HistogramSnapshot;
+
+class Histogram {
+public:
+	static constexpr unsigned kSubBits = 4;
+	static constexpr size_t kSub = size_t(1) << kSubBits;
+	static constexpr size_t kBuckets = (64 - kSubBits + 1) * kSub;
+
+	static size_t bucketOf(uint64_t value) {
+		if (value < kSub)
+			return value;
+		unsigned msb = 63 - __builtin_clzll(value);
+		auto sub = (value >> (msb - kSubBits)) & (kSub - 1);
+		return (msb - kSubBits + 1) * kSub + sub;
+	}
+
+	// The smallest value that falls into a bucket.
+	static uint64_t lowest(size_t bucket) {
+		if (bucket < kSub)
+			return bucket;
+		unsigned msb = bucket / kSub + kSubBits - 1;
+		return (kSub + bucket % kSub) << (msb - kSubBits);
+	}
+
+	// The largest value that falls into a bucket.
+	static uint64_t highest(size_t bucket) {
+		return bucket + 1 < kBuckets ? lowest(bucket + 1) - 1 : UINT64_MAX;
+	}
+
+	void record(uint64_t value) {
+		buckets_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	inline HistogramSnapshot snapshot() const;
+
+private:
+	std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+	std::atomic<uint64_t> sum_{0};
+};
+
+class HistogramSnapshot {
+public:
+	uint64_t count() const { return count_; }
+
+	uint64_t sum() const { return sum_; }
+
+	double mean() const { return count_ ? double(sum_) / count_ : 0; }
+
+	// The value that q of all recorded values are at or below, as the top
+	// of its bucket. 0 when nothing was recorded.
+	uint64_t percentile(double q) const {
+		if (count_ == 0)
+			return 0;
+		auto rank = static_cast<uint64_t>(q * count_ + 0.5);
+		rank = rank < 1 ? 1 : rank > count_ ? count_ : rank;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < buckets_.size(); i++) {
+			seen += buckets_[i];
+			if (seen >= rank)
+				return Histogram::highest(i);
+		}
+		return Histogram::highest(buckets_.size() - 1);
+	}
+
+	uint64_t max() const { return percentile(1.0); }
+
+private:
+	friend class Histogram;
+	std::vector<uint64_t> buckets_;
+	uint64_t count_ = 0;
+	uint64_t sum_ = 0;
+};
+
+inline HistogramSnapshot Histogram::snapshot() const {
+	HistogramSnapshot ret;
+	ret.buckets_.resize(kBuckets);
+	for (size_t i = 0; i < kBuckets; i++) {
+		ret.buckets_[i] = buckets_[i].load(std::memory_order_relaxed);
+		ret.count_ += ret.buckets_[i];
+	}
+	ret.sum_ = sum_.load(std::memory_order_relaxed);
+	return ret;
+}
+
+struct Snapshot {
+	std::map<std::string, uint64_t> counters;
+	std::map<std::string, uint64_t> gauges;
+	std::map<std::string, HistogramSnapshot> histograms;
+
+	// One metric per line, histograms as count, mean and percentiles.
+	std::string text() const {
+		std::string out;
+		for (auto& [name, value] : counters) {
+			out += name + " " + std::to_string(value) + "\n";
+		}
+		for (auto& [name, value] : gauges) {
+			out += name + " " + std::to_string(value) + "\n";
+		}
+		for (auto& [name, histogram] : histograms) {
+			out += name + " count=" + std::to_string(histogram.count()) +
+			       " mean=" + std::to_string(uint64_t(histogram.mean())) +
+			       " p50=" + std::to_string(histogram.percentile(0.5)) +
+			       " p90=" + std::to_string(histogram.percentile(0.9)) +
+			       " p99=" + std::to_string(histogram.percentile(0.99)) +
+			       " p999=" + std::to_string(histogram.percentile(0.999)) +
+			       " max=" + std::to_string(histogram.max()) + "\n";
+		}
+		return out;
+	}
+};
+
+//
+// Named metrics. Looking one up takes a lock, so hot paths look theirs up
+// once and keep the reference, which stays valid as long as the registry.
+//
+class Registry {
+	mutable std::mutex mtx_;
+	std::map<std::string, std::unique_ptr<Counter>> counters_;
+	std::map<std::string, std::unique_ptr<Histogram>> histograms_;
+	std::map<std::string, std::function<uint64_t()>> gauges_;
+
+public:
+	Counter& counter(const std::string& name) {
+		std::unique_lock<std::mutex> lock(mtx_);
+		auto& ptr = counters_[name];
+		if (!ptr)
+			ptr = std::make_unique<Counter>();
+		return *ptr;
+	}
+
+	Histogram& histogram(const std::string& name) {
+		std::unique_lock<std::mutex> lock(mtx_);
+		auto& ptr = histograms_[name];
+		if (!ptr)
+			ptr = std::make_unique<Histogram>();
+		return *ptr;
+	}
+
+	// A value read when a snapshot is taken, such as a queue depth. read
+	// must be safe to call from any thread.
+	void gauge(const std::string& name, std::function<uint64_t()> read) {
+		std::unique_lock<std::mutex> lock(mtx_);
+		gauges_[name] = std::move(read);
+	}
+
+	Snapshot snapshot() const {
+		Snapshot ret;
+		std::unique_lock<std::mutex> lock(mtx_);
+		for (auto& [name, counter] : counters_) {
+			ret.counters[name] = counter->value();
+		}
+		for (auto& [name, read] : gauges_) {
+			ret.gauges[name] = read();
+		}
+		for (auto& [name, histogram] : histograms_) {
+			ret.histograms.emplace(name, histogram->snapshot());
+		}
+		return ret;
+	}
+};
+
+}  // namespace metrics
@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+//
+// Unbounded lock-free queue for many producers and a single consumer, after
+// Dmitry Vyukov's intrusive MPSC node queue. push() is one atomic exchange
+// and never waits. pop() may briefly report empty while a concurrent push is
+// half done; that push's item becomes visible once the producer finishes,
+// so producers should signal the consumer only after push() returns.
+//
+template <typename T>
+class MpscQueue {
+	struct Node {
+		std::atomic<Node*> next{nullptr};
+		T value;
+	};
+
+	// producers link new nodes after head_, the consumer reads from tail_,
+	// which always points at an already consumed node
+	std::atomic<Node*> head_;
+	Node* tail_;
+
+public:
+	MpscQueue() : head_(new Node()), tail_(head_.load()) {}
+
+	~MpscQueue() {
+		T discard;
+		while (pop(discard)) {
+		}
+		delete tail_;
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	void push(T value) {
+		auto node = new Node();
+		node->value = std::move(value);
+		auto prev = head_.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	// Only one thread may pop.
+	bool pop(T& out) {
+		auto next = tail_->next.load(std::memory_order_acquire);
+		if (next == nullptr)
+			return false;
+		out = std::move(next->value);
+		delete tail_;
+		tail_ = next;
+		return true;
+	}
+};
@@ -0,0 +1,54 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+//
+// Static tracepoints (USDT) of the provider up_client_socket, built in when
+// UP_CLIENT_SOCKET_WITH_USDT is defined and <sys/sdt.h> is there. Each is a
+// single nop until a tracer attaches, for instance
+//
+//     bpftrace -e 'usdt:./app:up_client_socket:callback { @ = hist(arg3); }'
+//
+// Arguments are evaluated whether or not anything is attached, so they are
+// kept to values the code has at hand or that are cheap to compute.
+//
+//   send(id msb, id lsb, source hash, bytes, status code)
+//   send_syscall(link, bytes, ns)
+//   wake_read(link, bytes)
+//   receive(frame flags, bytes, link)
+//   match(id msb, id lsb, source hash, hash probes, matched entries)
+//   callback(id msb, id lsb, kind 0 view 1 UMessage 2 stream, ns)
+//
+// Without them the macros expand to nothing and their arguments are not
+// evaluated.
+//
+
+#if defined(UP_CLIENT_SOCKET_WITH_USDT) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define UP_PROBE2(name, a, b) DTRACE_PROBE2(up_client_socket, name, a, b)
+#define UP_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(up_client_socket, name, a, b, c)
+#define UP_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(up_client_socket, name, a, b, c, d)
+#define UP_PROBE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(up_client_socket, name, a, b, c, d, e)
+
+#else
+
+#define UP_PROBE2(name, a, b) ((void)0)
+#define UP_PROBE3(name, a, b, c) ((void)0)
+#define UP_PROBE4(name, a, b, c, d) ((void)0)
+#define UP_PROBE5(name, a, b, c, d, e) ((void)0)
+
+#endif
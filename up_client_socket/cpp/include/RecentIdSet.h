@@ -0,0 +1,117 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+//
+// Fixed capacity set of recently sent message ids. Inserting beyond the
+// capacity evicts the oldest id, and a successful consume() removes one
+// occurrence. Lookups are a single open addressed probe sequence so the
+// receive path can test every incoming id without allocating.
+//
+class RecentIdSet {
+	struct Slot {
+		uint64_t msb = 0;
+		uint64_t lsb = 0;
+		uint32_t count = 0;
+	};
+
+	struct Id {
+		uint64_t msb;
+		uint64_t lsb;
+	};
+
+	std::vector<Slot> slots_;
+	std::vector<Id> order_;
+	size_t head_ = 0;
+	size_t size_ = 0;
+	size_t mask_;
+	std::mutex mtx;
+
+	size_t home(uint64_t msb, uint64_t lsb) const {
+		return ((msb ^ lsb) * 0x9e3779b97f4a7c15ULL >> 17) & mask_;
+	}
+
+	Slot* lookup(uint64_t msb, uint64_t lsb) {
+		for (size_t i = home(msb, lsb);; i = (i + 1) & mask_) {
+			auto& slot = slots_[i];
+			if (slot.count == 0)
+				return nullptr;
+			if (slot.msb == msb && slot.lsb == lsb)
+				return &slot;
+		}
+	}
+
+	// Drop one occurrence of an id, using backward shift deletion so that
+	// probe sequences stay unbroken without tombstones.
+	bool release(uint64_t msb, uint64_t lsb) {
+		auto slot = lookup(msb, lsb);
+		if (slot == nullptr)
+			return false;
+		if (--slot->count > 0)
+			return true;
+		size_t hole = slot - slots_.data();
+		for (size_t i = (hole + 1) & mask_; slots_[i].count != 0;
+		     i = (i + 1) & mask_) {
+			size_t want = home(slots_[i].msb, slots_[i].lsb);
+			if (((i - want) & mask_) >= ((i - hole) & mask_)) {
+				slots_[hole] = slots_[i];
+				slots_[i].count = 0;
+				hole = i;
+			}
+		}
+		return true;
+	}
+
+public:
+	explicit RecentIdSet(size_t capacity) : order_(capacity) {
+		size_t table = 1;
+		while (table < capacity * 2)
+			table <<= 1;
+		slots_.resize(table);
+		mask_ = table - 1;
+	}
+
+	void insert(uint64_t msb, uint64_t lsb) {
+		std::unique_lock<std::mutex> lock(mtx);
+		if (size_ == order_.size()) {
+			release(order_[head_].msb, order_[head_].lsb);
+			head_ = (head_ + 1) % order_.size();
+			size_--;
+		}
+		order_[(head_ + size_) % order_.size()] = Id{msb, lsb};
+		size_++;
+		for (size_t i = home(msb, lsb);; i = (i + 1) & mask_) {
+			auto& slot = slots_[i];
+			if (slot.count == 0) {
+				slot = Slot{msb, lsb, 1};
+				return;
+			}
+			if (slot.msb == msb && slot.lsb == lsb) {
+				slot.count++;
+				return;
+			}
+		}
+	}
+
+	// Returns true (and forgets one occurrence) if the id was recently
+	// inserted. The eviction ring keeps its entry, so an id that is consumed
+	// and then inserted again may age out one generation early.
+	bool consume(uint64_t msb, uint64_t lsb) {
+		std::unique_lock<std::mutex> lock(mtx);
+		return release(msb, lsb);
+	}
+};
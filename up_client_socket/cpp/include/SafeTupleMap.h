@@ -11,9 +11,12 @@
 
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
@@ -26,6 +29,36 @@ class SafeTupleMap {
 	    map_;
 	std::mutex mtx;
 
+	static constexpr size_t shape_count = size_t(1) << std::tuple_size_v<KEY>;
+	using ShapeSet = std::array<uint64_t, (shape_count + 63) / 64>;
+	// wildcard shapes of every key that has been inserted
+	ShapeSet shapes_{};
+
+	// Calls fn for each stored entry matching key until fn returns true.
+	// Adds the number of lookups made to probes, if given. Must be called
+	// with mtx held.
+	template <typename FN>
+	bool probe(const KEY& key, FN&& fn, size_t* probes = nullptr) {
+		auto key_shape = wildcardShape(key);
+		ShapeSet seen{};
+		for (size_t word = 0; word < shapes_.size(); word++) {
+			for (auto bits = shapes_[word]; bits != 0; bits &= bits - 1) {
+				size_t shape =
+				    (word * 64 + __builtin_ctzll(bits)) | key_shape;
+				auto& seen_word = seen[shape / 64];
+				if (seen_word & (uint64_t(1) << (shape % 64)))
+					continue;
+				seen_word |= uint64_t(1) << (shape % 64);
+				if (probes)
+					(*probes)++;
+				auto it = map_.find(withShape(key, shape));
+				if (it != map_.end() && fn(it->second))
+					return true;
+			}
+		}
+		return false;
+	}
+
 public:
 	using Key = KEY;
 
@@ -41,14 +74,53 @@ public:
 				return it->second;
 			auto ptr = std::make_shared<VALUE>();
 			map_.emplace(key, ptr);
+			auto shape = wildcardShape(key);
+			shapes_[shape / 64] |= uint64_t(1) << (shape % 64);
 			return ptr;
 		}
 	}
 
-	void erase(std::function<void(std::shared_ptr<VALUE>)> fn) {
+	// Collect every entry whose key matches a concrete key, treating nullopt
+	// elements of the stored keys as wildcards. Each entry is returned once.
+	// The number of lookups it took is added to probes, if given.
+	std::vector<std::shared_ptr<VALUE>> findMatches(const KEY& key,
+	                                                size_t* probes = nullptr) {
+		std::vector<std::shared_ptr<VALUE>> ret;
+		std::unique_lock<std::mutex> lock(mtx);
+		probe(
+		    key,
+		    [&](const std::shared_ptr<VALUE>& ptr) {
+			    ret.push_back(ptr);
+			    return false;
+		    },
+		    probes);
+		return ret;
+	}
+
+	// True if pred holds for any entry matching key. pred runs with the map
+	// locked, so it must not call back into the map.
+	template <typename PRED>
+	bool anyMatch(const KEY& key, PRED&& pred) {
+		std::unique_lock<std::mutex> lock(mtx);
+		return probe(key, [&](const std::shared_ptr<VALUE>& ptr) {
+			return pred(*ptr);
+		});
+	}
+
+	// Calls fn for every entry matching key, with the map locked.
+	template <typename FN>
+	void forEachMatch(const KEY& key, FN&& fn) {
+		std::unique_lock<std::mutex> lock(mtx);
+		probe(key, [&](const std::shared_ptr<VALUE>& ptr) {
+			fn(*ptr);
+			return false;
+		});
+	}
+
+	void erase(std::function<void(const KEY&, std::shared_ptr<VALUE>)> fn) {
 		std::unique_lock<std::mutex> lock(mtx);
 		for (auto [key, ptr] : map_) {
-			fn(ptr);
+			fn(key, ptr);
 		}
 	}
 };
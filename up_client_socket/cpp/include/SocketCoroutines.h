@@ -0,0 +1,403 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+//
+// C++20 coroutine wrappers for SocketUTransport. Empty unless the including
+// translation unit is compiled with coroutine support, so the library itself
+// stays C++17.
+//
+//     coro::Task<void> handle(SocketUTransport& transport, UUri method) {
+//         auto first = co_await coro::invoke(transport, method, "a");
+//         if (!first.ok())
+//             co_return;
+//         auto second = co_await coro::invoke(transport, method, "b");
+//         ...
+//     }
+//
+//     coro::spawn(handle(transport, method));
+//
+// The awaiters live in the coroutine frame and hand the transport their own
+// address or the coroutine handle. Each coroutine frame is still allocated
+// on the heap, as are the callbacks and posted tasks that resume it. Awaits
+// that have to wait are resumed through SocketUTransport::post(), on the
+// receive thread but outside the listener locks, so a resumed coroutine may
+// close streams or start calls. It runs there up to its next suspension, so
+// it must not block any more than a listener may.
+//
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "SocketUTransport.h"
+
+namespace coro {
+
+// A received message, with its payload still in the receive buffer.
+struct Message {
+	uprotocol::v1::UAttributes attributes;
+	SocketUTransport::PayloadRef payload;
+
+	explicit Message(const SocketUTransport::MessageView& view)
+	    : attributes(view.attributes()), payload(view.retainPayload()) {}
+};
+
+// The outcome of invoke(): the status, and the response when there is one.
+struct Response {
+	uprotocol::v1::UStatus status;
+	std::optional<Message> message;
+
+	bool ok() const { return status.code() == uprotocol::v1::UCode::OK; }
+};
+
+//
+// Lazily started coroutine whose result is obtained by co_await. Finishing
+// resumes the awaiting coroutine directly, without going through a queue.
+//
+template <typename T>
+class Task;
+
+namespace detail {
+
+template <typename T>
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(
+		    std::coroutine_handle<P> handle) noexcept {
+			auto continuation = handle.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase<T> {
+	std::optional<T> value;
+
+	Task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+
+	T result() {
+		if (this->exception)
+			std::rethrow_exception(this->exception);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct Promise<void> : PromiseBase<void> {
+	Task<void> get_return_object();
+	void return_void() {}
+
+	void result() {
+		if (this->exception)
+			std::rethrow_exception(this->exception);
+	}
+};
+
+}  // namespace detail
+
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+	using promise_type = detail::Promise<T>;
+
+	Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+	Task& operator=(Task&& other) noexcept {
+		if (this != &other) {
+			if (handle_)
+				handle_.destroy();
+			handle_ = std::exchange(other.handle_, {});
+		}
+		return *this;
+	}
+
+	~Task() {
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+		handle_.promise().continuation = awaiting;
+		return handle_;
+	}
+
+	T await_resume() { return handle_.promise().result(); }
+
+private:
+	friend promise_type;
+	explicit Task(std::coroutine_handle<promise_type> handle)
+	    : handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+	return Task<void>(
+	    std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Coroutine that starts at once and frees itself when done.
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+}  // namespace detail
+
+// Runs a task to completion without anyone awaiting it. An exception it
+// lets escape terminates the program.
+inline void spawn(Task<void> task) {
+	[](Task<void> task) -> detail::Detached {
+		co_await std::move(task);
+	}(std::move(task));
+}
+
+// co_await send(transport, message) sends at once on the calling thread,
+// since the transport never blocks on a send, and yields the status.
+class SendAwaiter {
+public:
+	SendAwaiter(SocketUTransport& transport,
+	            const uprotocol::v1::UMessage& message)
+	    : transport_(transport), message_(message) {}
+
+	bool await_ready() {
+		status_ = transport_.send(message_);
+		return true;
+	}
+
+	void await_suspend(std::coroutine_handle<>) {}
+
+	uprotocol::v1::UStatus await_resume() { return std::move(status_); }
+
+private:
+	SocketUTransport& transport_;
+	const uprotocol::v1::UMessage& message_;
+	uprotocol::v1::UStatus status_;
+};
+
+inline SendAwaiter send(SocketUTransport& transport,
+                        const uprotocol::v1::UMessage& message) {
+	return SendAwaiter(transport, message);
+}
+
+// co_await invoke(...) suspends until SocketUTransport::invokeMethod()
+// reports the outcome, and resumes on the receive thread.
+class InvokeAwaiter {
+public:
+	InvokeAwaiter(SocketUTransport& transport,
+	              const uprotocol::v1::UUri& method, std::string_view payload,
+	              const SocketUTransport::RpcOptions& options)
+	    : transport_(transport),
+	      method_(method),
+	      payload_(payload),
+	      options_(options) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle) {
+		handle_ = handle;
+		auto status = transport_.invokeMethod(
+		    method_, payload_, options_,
+		    [this](const uprotocol::v1::UStatus& status,
+		           const SocketUTransport::MessageView* response) {
+			    response_.status = status;
+			    if (response != nullptr) {
+				    response_.message.emplace(*response);
+			    }
+			    transport_.post([handle = handle_]() { handle.resume(); });
+		    });
+		// The coroutine may already be running again, so this is left
+		// alone from here on. It is only ever resumed through post(): a
+		// failed call never reaches the callback, so it is resumed here.
+		if (status.code() != uprotocol::v1::UCode::OK) {
+			response_.status = std::move(status);
+			transport_.post([handle]() { handle.resume(); });
+		}
+		return true;
+	}
+
+	Response await_resume() { return std::move(response_); }
+
+private:
+	SocketUTransport& transport_;
+	const uprotocol::v1::UUri& method_;
+	std::string_view payload_;
+	const SocketUTransport::RpcOptions& options_;
+	std::coroutine_handle<> handle_;
+	Response response_;
+};
+
+// The method, payload and options must outlive the co_await, which they do
+// when passed straight into it.
+inline InvokeAwaiter invoke(SocketUTransport& transport,
+                            const uprotocol::v1::UUri& method,
+                            std::string_view payload,
+                            const SocketUTransport::RpcOptions& options = {}) {
+	return InvokeAwaiter(transport, method, payload, options);
+}
+
+//
+// Asynchronous sequence of the messages matching a filter, registered as a
+// view listener for as long as the stream exists. co_await next() yields
+// the next message, or nullopt once the stream is closed. A message that
+// arrives while a coroutine waits is handed to it directly; others are
+// queued, dropping the oldest beyond the capacity. One coroutine at a time
+// may wait on a stream.
+//
+class MessageStream {
+public:
+	MessageStream(SocketUTransport& transport,
+	              const uprotocol::v1::UUri& source_filter,
+	              std::optional<uprotocol::v1::UUri> sink_filter = {},
+	              size_t capacity = 1024)
+	    : transport_(transport), capacity_(std::max<size_t>(capacity, 1)) {
+		handle_ = transport.registerViewListener(
+		    [this](const SocketUTransport::MessageView& view) { push(view); },
+		    source_filter, std::move(sink_filter));
+	}
+
+	MessageStream(const MessageStream&) = delete;
+	MessageStream& operator=(const MessageStream&) = delete;
+
+	~MessageStream() { close(); }
+
+	// Messages dropped because the queue was full.
+	size_t dropped() const {
+		std::unique_lock<std::mutex> lock(mtx_);
+		return dropped_;
+	}
+
+	// Stops listening, drops what is queued and ends a pending next() with
+	// nullopt, resuming its coroutine through post() like any other wait.
+	void close() {
+		handle_.reset();
+		std::coroutine_handle<> waiter;
+		{
+			std::unique_lock<std::mutex> lock(mtx_);
+			closed_ = true;
+			queue_.clear();
+			waiter = std::exchange(waiter_, {});
+		}
+		if (waiter)
+			transport_.post([waiter]() { waiter.resume(); });
+	}
+
+	class NextAwaiter {
+	public:
+		explicit NextAwaiter(MessageStream& stream) : stream_(stream) {}
+
+		bool await_ready() {
+			std::unique_lock<std::mutex> lock(stream_.mtx_);
+			return stream_.take(result_);
+		}
+
+		bool await_suspend(std::coroutine_handle<> handle) {
+			std::unique_lock<std::mutex> lock(stream_.mtx_);
+			// something may have arrived since await_ready()
+			if (stream_.take(result_))
+				return false;
+			stream_.waiter_ = handle;
+			stream_.slot_ = &result_;
+			return true;
+		}
+
+		std::optional<Message> await_resume() { return std::move(result_); }
+
+	private:
+		MessageStream& stream_;
+		std::optional<Message> result_;
+	};
+
+	NextAwaiter next() { return NextAwaiter(*this); }
+
+private:
+	// With mtx_ held: fills out with a queued message and returns true, or
+	// returns true with nothing once closed, or false to wait.
+	bool take(std::optional<Message>& out) {
+		if (!queue_.empty()) {
+			out.emplace(std::move(queue_.front()));
+			queue_.pop_front();
+			return true;
+		}
+		return closed_;
+	}
+
+	void push(const SocketUTransport::MessageView& view) {
+		std::coroutine_handle<> waiter;
+		{
+			std::unique_lock<std::mutex> lock(mtx_);
+			if (waiter_) {
+				slot_->emplace(view);
+				waiter = std::exchange(waiter_, {});
+			} else {
+				if (queue_.size() >= capacity_) {
+					queue_.pop_front();
+					dropped_++;
+				}
+				queue_.emplace_back(view);
+			}
+		}
+		if (waiter)
+			transport_.post([waiter]() { waiter.resume(); });
+	}
+
+	SocketUTransport& transport_;
+	mutable std::mutex mtx_;
+	std::deque<Message> queue_;
+	size_t capacity_;
+	size_t dropped_ = 0;
+	bool closed_ = false;
+	std::coroutine_handle<> waiter_;
+	std::optional<Message>* slot_ = nullptr;
+	SocketUTransport::ViewListenerHandle handle_;
+};
+
+}  // namespace coro
+
+#endif  // __cpp_impl_coroutine
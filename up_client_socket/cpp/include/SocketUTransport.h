@@ -14,8 +14,17 @@
 
 #include <up-cpp/transport/UTransport.h>
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "Metrics.h"
 
 /// @class SocketUTransport
 /// @brief Represents a socket-based implementation of the UTransport interface
@@ -23,17 +32,511 @@
 ///
 /// The SocketUTransport class provides functionality for sending messages,
 /// registering and unregistering listeners, and invoking remote methods over a
-/// socket connection. It inherits from the UTransport and RpcClient classes.
+/// socket connection. It inherits from the UTransport class and provides RPC
+/// through invokeMethod().
 class SocketUTransport : public uprotocol::transport::UTransport {
+	struct Impl;
+
 public:
 	static constexpr const char* default_dispatcher_ip = "127.0.0.1";
 	static constexpr int default_dispatcher_port = 44444;
 
-	/// @brief Constructs a SocketUTransport object.
+	/// @brief Address of one dispatcher.
+	struct Endpoint {
+		std::string ip = default_dispatcher_ip;
+		int port = default_dispatcher_port;
+	};
+
+	/// @brief Where publish messages go when they are sent by multicast.
+	struct Multicast {
+		/// @brief Group i of groups is base_group plus i.
+		std::string base_group = "239.255.76.0";
+		/// @brief At most 20, the default igmp_max_memberships on Linux.
+		unsigned groups = 16;
+		int port = 44544;
+		/// @brief Address of the interface to send and join groups on.
+		std::string interface_ip = "127.0.0.1";
+		/// @brief Larger messages go through the dispatcher. At most 32 KiB.
+		size_t max_datagram = 1472;
+		/// @brief Multicast ttl, 1 keeps datagrams on the local link.
+		int hops = 1;
+	};
+
+	/// @brief How payloads are compressed when that is enabled.
+	struct Compression {
+		enum class Codec { kLz4, kZstd };
+		Codec codec = Codec::kZstd;
+		/// @brief zstd level; lz4 always runs at its fastest.
+		int level = 1;
+		/// @brief Smaller payloads are sent as they are.
+		size_t min_bytes = 256;
+		/// @brief Payload formats worth compressing.
+		std::vector<uprotocol::v1::UPayloadFormat> formats = {
+		    uprotocol::v1::UPayloadFormat::UPAYLOAD_FORMAT_JSON,
+		    uprotocol::v1::UPayloadFormat::UPAYLOAD_FORMAT_TEXT};
+		/// @brief Optional dictionary trained on typical payloads with
+		/// `zstd --train`. Receivers need the same one to decompress what
+		/// was compressed with it.
+		std::string dictionary;
+		/// @brief Payloads below this size are compressed with the
+		/// dictionary, larger ones carry enough context of their own.
+		size_t dictionary_below = 16 * 1024;
+	};
+
+	/// @brief Recording of every frame sent and received, with its time,
+	/// direction and connection, into a ring in a memory mapped file that
+	/// survives a crash of the process. Read it back with flight_dump. See
+	/// FlightRecorder.h.
+	struct FlightRecording {
+		std::string path;
+		/// @brief Size of the ring; the oldest frames are overwritten.
+		size_t bytes = 64 * 1024 * 1024;
+		/// @brief Whether to record from the start, see
+		/// setFlightRecording().
+		bool enabled = true;
+	};
+
+	/// @brief How latency tracing works when that is enabled. Each message
+	/// handed to listeners is timed from the creation time in its id to
+	/// being dispatched on the receive thread, and from there until its
+	/// listeners returned. The two go into the histograms
+	/// producer_latency_ns{topic="..."} and dispatch_latency_ns{topic="..."}
+	/// of metrics(), for the source URI of the message as topic. Ids only
+	/// hold whole ms, and the producer's clock may differ from ours, so the
+	/// first is no more accurate than that.
+	struct LatencyTracing {
+		/// @brief Messages that took longer than this in all are counted as
+		/// latency_outliers and logged as warnings, at most once a second.
+		std::chrono::milliseconds outlier{100};
+		/// @brief Topics beyond this many share the topic "other".
+		size_t max_topics = 64;
+	};
+
+	/// @brief Faults and latency added to the connections to the
+	/// dispatchers, for testing how the transport and what uses it behave
+	/// over a degraded link without a network emulator. Multicast is left
+	/// alone. Every decision is drawn from a random sequence per connection
+	/// and direction, all derived from seed, so a run with the same traffic
+	/// sees the same faults. See FaultInjection.h.
+	struct FaultInjection {
+		/// @brief What happens to frames going one way.
+		struct Direction {
+			/// @brief Added to each frame, plus up to jitter more, to within
+			/// a millisecond. Frames still arrive in order, as on a stream.
+			std::chrono::microseconds delay{0};
+			std::chrono::microseconds jitter{0};
+			/// @brief Probability of a message being lost, and of it being
+			/// delivered twice. Control frames are never lost.
+			double drop = 0;
+			double duplicate = 0;
+			/// @brief Link speed, 0 for unlimited.
+			uint64_t bytes_per_second = 0;
+		};
+		Direction send;
+		Direction receive;
+		/// @brief Probability of a write to the socket taking only part of
+		/// a frame, leaving the rest to be sent as when the socket is full.
+		double short_writes = 0;
+		/// @brief Probability of data read from the socket reaching the
+		/// frame parser in several pieces. Short reads and writes split
+		/// bare messages, so only use them with routing_header.
+		double short_reads = 0;
+		uint64_t seed = 1;
+	};
+
+	/// @brief Optional behavior beyond the plain protocol shared with the
+	/// socket transports of the other languages.
+	struct Options {
+		/// @brief Dispatchers to keep a connection to. Each message is sent
+		/// through the one picked by a consistent hash of its source, so a
+		/// topic always takes the same path, and messages are received from
+		/// all of them. When empty, the dispatcher_ip and dispatcher_port
+		/// passed to the constructor are used. Transports that talk to each
+		/// other must list the same endpoints in the same order.
+		std::vector<Endpoint> endpoints;
+
+		/// @brief Send each message in a frame whose routing header carries
+		/// the source, sink, type and priority. Receivers with no matching
+		/// listener then drop the message without parsing it. Listener
+		/// filters are also advertised, so that the native dispatcher only
+		/// forwards routed messages to connections that want them. Only
+		/// enable when every peer on the dispatcher is a C++ SocketUTransport.
+		/// Sends of messages over 64 MiB, which need a StreamWriter, or with
+		/// an authority over 255 bytes then fail with INVALID_ARGUMENT.
+		bool routing_header = false;
+
+		/// @brief Send publish messages that fit in a datagram to a multicast
+		/// group picked by their source ue_id, so the kernel does the fan-out
+		/// instead of the dispatcher. Listeners join the groups their source
+		/// filters map to, or all of them for a wildcard ue_id. Other message
+		/// types always go through the dispatcher. Datagrams may be lost
+		/// under load, and every transport exchanging publish messages must
+		/// use the same settings.
+		std::optional<Multicast> multicast;
+
+		/// @brief Bytes of outbound messages held for each dispatcher while
+		/// it is unreachable or not taking data fast enough. They are sent
+		/// once it catches up, minus those whose ttl ran out meanwhile. Sends
+		/// that don't fit fail with UNAVAILABLE instead of blocking. Zero
+		/// drops such sends right away.
+		size_t spool_bytes = 8 * 1024 * 1024;
+
+		/// @brief Ids of own sends remembered so that the dispatcher's echo
+		/// of them is dropped. Should exceed the messages sent while the
+		/// oldest of them is still on its way back, spooled ones included,
+		/// or its echo is delivered to local listeners a second time. Each
+		/// id takes 64 to 112 bytes.
+		size_t echo_ids = 16 * 1024;
+
+		/// @brief Delay before reconnecting to a dispatcher after its
+		/// connection failed. It doubles with each failed attempt up to
+		/// reconnect_max. Listener filters are advertised again on each new
+		/// connection.
+		std::chrono::milliseconds reconnect_min{100};
+		std::chrono::milliseconds reconnect_max{5000};
+
+		/// @brief Largest stretch of payload a StreamWriter sends in one
+		/// frame.
+		size_t chunk_bytes = 64 * 1024;
+
+		/// @brief Bytes a StreamWriter lets queue up for its dispatcher
+		/// before write() waits. This also bounds how long other messages
+		/// sent through the same dispatcher wait behind a stream.
+		size_t stream_window = 1024 * 1024;
+
+		/// @brief How long a StreamWriter waits for its dispatcher to take
+		/// any of the window before write() fails with UNAVAILABLE.
+		std::chrono::milliseconds stream_stall{5000};
+
+		/// @brief Payload bytes of chunked messages held while they are
+		/// reassembled for listeners that want them whole. A message that
+		/// doesn't fit is only passed to stream listeners.
+		size_t reassembly_bytes = 64 * 1024 * 1024;
+
+		/// @brief How long a chunked message being received may go without
+		/// its next chunk, ttl or not, before it is dropped as aborted and
+		/// its share of reassembly_bytes freed.
+		std::chrono::milliseconds stream_idle{30000};
+
+		/// @brief Compress the payloads of messages sent with the routing
+		/// header when that makes them smaller, flagging each such frame so
+		/// peers know to decompress it. Received payloads are decompressed
+		/// whatever this is set to, as long as the codec was built in.
+		std::optional<Compression> compression;
+
+		/// @brief How often to log all metrics at info level, 0 for never.
+		std::chrono::milliseconds metrics_interval{0};
+
+		/// @brief Measure the latency of received messages, see
+		/// LatencyTracing.
+		std::optional<LatencyTracing> latency_tracing;
+
+		/// @brief Record the frames sent and received to a file.
+		std::optional<FlightRecording> flight_recording;
+
+		/// @brief Degrade the connections on purpose, for testing only.
+		std::optional<FaultInjection> fault_injection;
+	};
+
+	/// @brief Payload bytes together with a reference to the buffer that
+	/// holds them.
+	struct PayloadRef {
+		std::shared_ptr<const std::string> buffer;
+		std::string_view data;
+	};
+
+	/// @brief A received message whose payload has not been copied out of the
+	/// receive buffer.
+	///
+	/// Only the attributes are decoded up front. The view and payload() are
+	/// valid for the duration of the listener callback; use retainPayload()
+	/// to keep the payload beyond that.
+	class MessageView {
+	public:
+		MessageView(const MessageView&) = delete;
+		MessageView& operator=(const MessageView&) = delete;
+
+		const uprotocol::v1::UAttributes& attributes() const {
+			return *attributes_;
+		}
+
+		bool has_payload() const { return has_payload_; }
+
+		std::string_view payload() const { return payload_; }
+
+		/// @brief Extends the lifetime of the payload bytes without copying.
+		PayloadRef retainPayload() const { return {buffer_, payload_}; }
+
+		/// @brief The complete UMessage. The payload is copied into it the
+		/// first time this is called.
+		const uprotocol::v1::UMessage& message() const;
+
+	private:
+		friend class SocketUTransport;
+		MessageView() = default;
+
+		const uprotocol::v1::UAttributes* attributes_ = nullptr;
+		std::string_view payload_;
+		bool has_payload_ = false;
+		std::shared_ptr<const std::string> buffer_;
+		const uprotocol::v1::UMessage* full_ = nullptr;
+		mutable std::optional<uprotocol::v1::UMessage> materialized_;
+	};
+
+	using ViewListener = std::function<void(const MessageView&)>;
+
+	/// @brief A stretch of a message's payload, as passed to stream
+	/// listeners.
+	///
+	/// A chunked message arrives as a run of chunks in payload order. Any
+	/// other message arrives as a single chunk holding all of its payload.
+	/// The view and data() are valid for the duration of the listener
+	/// callback; use retainData() to keep the data beyond that.
+	class ChunkView {
+	public:
+		ChunkView(const ChunkView&) = delete;
+		ChunkView& operator=(const ChunkView&) = delete;
+
+		const uprotocol::v1::UAttributes& attributes() const {
+			return *attributes_;
+		}
+
+		/// @brief Where data() starts within the whole payload.
+		uint64_t offset() const { return offset_; }
+
+		/// @brief Size of the whole payload.
+		uint64_t total() const { return total_; }
+
+		std::string_view data() const { return data_; }
+
+		/// @brief Extends the lifetime of the data without copying.
+		PayloadRef retainData() const { return {buffer_, data_}; }
+
+		/// @brief Whether this chunk completes the message.
+		bool last() const {
+			return !aborted_ && offset_ + data_.size() == total_;
+		}
+
+		/// @brief The rest of the message will not come, because the
+		/// sender gave up on it, a chunk was lost or its ttl ran out. The
+		/// chunk holds no data.
+		bool aborted() const { return aborted_; }
+
+	private:
+		friend class SocketUTransport;
+		ChunkView() = default;
+
+		const uprotocol::v1::UAttributes* attributes_ = nullptr;
+		uint64_t offset_ = 0;
+		uint64_t total_ = 0;
+		std::string_view data_;
+		std::shared_ptr<const std::string> buffer_;
+		bool aborted_ = false;
+	};
+
+	using StreamListener = std::function<void(const ChunkView&)>;
+
+	/// @brief Keeps a view or stream listener registered until it is
+	/// destroyed or reset.
+	class ViewListenerHandle {
+	public:
+		ViewListenerHandle() = default;
+		ViewListenerHandle(ViewListenerHandle&& other) noexcept = default;
+		ViewListenerHandle& operator=(ViewListenerHandle&& other) noexcept;
+		~ViewListenerHandle() { reset(); }
+
+		void reset();
+
+		explicit operator bool() const {
+			return listener_ != nullptr || stream_listener_ != nullptr;
+		}
+
+	private:
+		friend class SocketUTransport;
+		std::weak_ptr<Impl> transport_;
+		std::shared_ptr<ViewListener> listener_;
+		std::shared_ptr<StreamListener> stream_listener_;
+	};
+
+	/// @brief Attributes encoded once for a publisher that sends many
+	/// messages differing only in id and payload.
+	///
+	/// Created by makeTemplate(). Copies share the encoded bytes.
+	class MessageTemplate {
+	public:
+		/// @brief The attributes the template was made from, without id.
+		const uprotocol::v1::UAttributes& attributes() const;
+
+	private:
+		friend class SocketUTransport;
+		struct Encoded;
+		std::shared_ptr<const Encoded> encoded_;
+	};
+
+	/// @brief Constructs a SocketUTransport object. A dispatcher that can't
+	/// be reached is retried in the background while sends are spooled.
 	SocketUTransport(const uprotocol::v1::UUri&,
 	                 const std::string& dispatcher_ip = default_dispatcher_ip,
 	                 int dispatcher_port = default_dispatcher_port);
 
+	/// @brief Constructs a SocketUTransport object with non-default options.
+	SocketUTransport(const uprotocol::v1::UUri&, const Options& options,
+	                 const std::string& dispatcher_ip = default_dispatcher_ip,
+	                 int dispatcher_port = default_dispatcher_port);
+
+	/// @brief Register a listener that receives messages as MessageViews,
+	/// so payloads are never copied unless the listener asks for it.
+	/// @param[in] listener Callback object to invoke for a message.
+	/// @param[in] source_filter The primary key for callback lookup.
+	/// @param[in] sink_filter An optional secondary key for callback lookup.
+	/// @return Handle that unregisters the listener when destroyed.
+	[[nodiscard]] ViewListenerHandle registerViewListener(
+	    ViewListener&& listener, const uprotocol::v1::UUri& source_filter,
+	    std::optional<uprotocol::v1::UUri>&& sink_filter = {});
+
+	/// @brief Register a listener that receives payloads chunk by chunk as
+	/// they arrive, so a chunked message never has to be held whole. A
+	/// listener registered while a message is on its way gets the chunks
+	/// that are still to come.
+	/// @param[in] listener Callback object to invoke for a chunk.
+	/// @param[in] source_filter The primary key for callback lookup.
+	/// @param[in] sink_filter An optional secondary key for callback lookup.
+	/// @return Handle that unregisters the listener when destroyed.
+	[[nodiscard]] ViewListenerHandle registerStreamListener(
+	    StreamListener&& listener, const uprotocol::v1::UUri& source_filter,
+	    std::optional<uprotocol::v1::UUri>&& sink_filter = {});
+
+	/// @brief Pre-encode everything but the id of the given attributes.
+	/// @param[in] attributes Attributes shared by every message sent with
+	/// the template. Any id they carry is ignored.
+	[[nodiscard]] MessageTemplate makeTemplate(
+	    const uprotocol::v1::UAttributes& attributes) const;
+
+	using uprotocol::transport::UTransport::send;
+
+	/// @brief Send a message made of a template, an id and a payload. The
+	/// encoded attributes are copied as is, so this costs little more than
+	/// copying the payload into the output buffer.
+	/// @param[in] message_template Attributes made by makeTemplate().
+	/// @param[in] id The id for this message.
+	/// @param[in] payload The payload for this message.
+	[[nodiscard]] uprotocol::v1::UStatus send(
+	    const MessageTemplate& message_template,
+	    const uprotocol::v1::UUID& id, std::string_view payload);
+
+	/// @brief Sends one message whose payload is handed over piece by
+	/// piece, so that it never has to be in memory as a whole. Made by
+	/// openStream(). Not thread safe.
+	class StreamWriter {
+	public:
+		StreamWriter() = default;
+		StreamWriter(StreamWriter&& other) noexcept = default;
+		StreamWriter& operator=(StreamWriter&& other) noexcept;
+		/// @brief Aborts the message unless all of it was written.
+		~StreamWriter() { abort(); }
+
+		/// @brief Send the next stretch of the payload, in frames of at
+		/// most Options::chunk_bytes. Waits while more than
+		/// Options::stream_window bytes are queued for the dispatcher, but
+		/// no longer than the message's ttl or Options::stream_stall without
+		/// progress, and never on the receive thread. Queues up to the
+		/// spool without waiting while the dispatcher is unreachable. When
+		/// it fails, remaining() tells what didn't go out.
+		[[nodiscard]] uprotocol::v1::UStatus write(std::string_view data);
+
+		/// @brief Payload bytes still to be written.
+		uint64_t remaining() const;
+
+		/// @brief Tell receivers that the rest of the message won't come.
+		void abort();
+
+	private:
+		friend class SocketUTransport;
+		struct State;
+		std::weak_ptr<Impl> transport_;
+		std::shared_ptr<State> state_;
+	};
+
+	/// @brief Start sending a message in chunks, for payloads too large to
+	/// send or hold at once. Stream listeners get each chunk as it arrives
+	/// and other listeners get the whole message once it is complete.
+	/// Needs Options::routing_header.
+	/// @param[in] attributes The attributes of the message. An id is made
+	/// up if they carry none.
+	/// @param[in] size The size of the whole payload.
+	/// @param[out] writer Takes the payload, when OK is returned.
+	/// @return The status of sending the attributes.
+	[[nodiscard]] uprotocol::v1::UStatus openStream(
+	    const uprotocol::v1::UAttributes& attributes, uint64_t size,
+	    StreamWriter& writer);
+
+	/// @brief Running totals of messages dropped because their ttl, counted
+	/// from the timestamp in their id, had already passed.
+	struct ExpiryCounters {
+		/// Received messages dropped before reaching listeners.
+		uint64_t received = 0;
+		/// Messages not written to the dispatcher.
+		uint64_t sent = 0;
+	};
+
+	/// @brief Snapshot of the expired message counters.
+	ExpiryCounters expiryCounters() const;
+
+	/// @brief Snapshot of all metrics: counters of messages, bytes, parse
+	/// failures and unmatched messages, gauges of queue depths, and
+	/// histograms of match probes per message, callback run time and send
+	/// syscall time in ns. Taking one costs a few microseconds; recording
+	/// costs the hot paths a relaxed atomic add each.
+	metrics::Snapshot metrics() const;
+
+	/// @brief Starts or pauses the recording set up with
+	/// Options::flight_recording.
+	/// @return False if there is none.
+	bool setFlightRecording(bool enabled);
+
+	/// @brief How invokeMethod() sends a request.
+	struct RpcOptions {
+		/// @brief How long to wait for the response. Also sent as the ttl
+		/// of the request.
+		std::chrono::milliseconds ttl{10000};
+		/// @brief Raised to UPRIORITY_CS4 if lower, as requests require.
+		uprotocol::v1::UPriority priority =
+		    uprotocol::v1::UPriority::UPRIORITY_CS4;
+		uprotocol::v1::UPayloadFormat format =
+		    uprotocol::v1::UPayloadFormat::UPAYLOAD_FORMAT_UNSPECIFIED;
+	};
+
+	/// @brief Receives the outcome of a call exactly once. An OK status
+	/// comes with the response. A response whose commstatus isn't OK comes
+	/// with that code, and DEADLINE_EXCEEDED once the ttl ran out, or
+	/// CANCELLED when the transport is destroyed, with a null response.
+	/// Runs on the receive thread, so it must not block.
+	using RpcCallback = std::function<void(const uprotocol::v1::UStatus&,
+	                                       const MessageView* response)>;
+
+	/// @brief Send a request to a method and report its response to a
+	/// callback. Calls are matched to responses by request id and their
+	/// timeouts share one timing wheel on the receive thread, so any
+	/// number can be in flight without extra threads.
+	/// @param[in] method The method to invoke.
+	/// @param[in] payload The request payload.
+	/// @param[in] options The ttl, priority and payload format.
+	/// @param[in] callback Called with the outcome, unless this returns an
+	/// error.
+	/// @return The status of sending the request. When it isn't OK, the
+	/// callback is never called.
+	[[nodiscard]] uprotocol::v1::UStatus invokeMethod(
+	    const uprotocol::v1::UUri& method, std::string_view payload,
+	    const RpcOptions& options, RpcCallback&& callback);
+
+	/// @brief Calls still waiting for their response.
+	size_t pendingCalls() const;
+
+	/// @brief Run a task on the receive thread once it is done with the
+	/// message at hand, outside every listener lock. Code running in a
+	/// listener can use it to unregister listeners or resume coroutines.
+	void post(std::function<void()> task);
+
 private:
 	/// @brief Send a UMessage to the dispatcher over the mocking socket.
 	/// @param[in] message The UMessage to send.
@@ -52,7 +555,6 @@ private:
 	/// @param[in] listener Callback object to unregister.
 	void cleanupListener(CallableConn listener) override;
 
-	struct Impl;
 	std::shared_ptr<Impl> pImpl;
 };
 
@@ -0,0 +1,190 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <system_error>
+
+//
+// Bounded FIFO of outbound messages waiting for a connection. The bytes live
+// in a ring of shared memory mapped twice back to back, so every record is
+// contiguous even where it wraps, and a batch of records goes out in a
+// single sendmsg(). Records carry a deadline so messages whose ttl ran out
+// while waiting are dropped instead of sent. Not thread safe.
+//
+class Spool {
+	struct Record {
+		uint32_t size;
+		uint32_t reserved;
+		// unix time in ms after which the record is dropped, 0 for never
+		uint64_t deadline_ms;
+	};
+
+	static constexpr size_t kAlign = alignof(Record);
+
+public:
+	static constexpr size_t kMaxBatch = 64;
+
+private:
+
+	char* base_ = nullptr;
+	size_t capacity_ = 0;
+	// positions only grow, their difference is the bytes in use
+	uint64_t head_ = 0;
+	uint64_t tail_ = 0;
+	// bytes of the first record that already went out
+	size_t sent_ = 0;
+
+	static size_t footprint(size_t size) {
+		return sizeof(Record) + (size + kAlign - 1) / kAlign * kAlign;
+	}
+
+	Record* at(uint64_t position) const {
+		return reinterpret_cast<Record*>(base_ + position % capacity_);
+	}
+
+	void pop() {
+		head_ += footprint(at(head_)->size);
+		sent_ = 0;
+	}
+
+public:
+	// A capacity of zero keeps nothing. Throws std::system_error if the
+	// memory can't be mapped.
+	explicit Spool(size_t capacity) {
+		if (capacity == 0) {
+			return;
+		}
+		size_t page = sysconf(_SC_PAGESIZE);
+		capacity_ = (capacity + page - 1) / page * page;
+		int fd = memfd_create("spool", MFD_CLOEXEC);
+		if (fd < 0 || ftruncate(fd, capacity_) < 0) {
+			auto error = errno;
+			if (fd >= 0)
+				close(fd);
+			throw std::system_error(error, std::generic_category(), "spool");
+		}
+		// reserve twice the size, then map the same pages into both halves
+		auto reserved = mmap(nullptr, 2 * capacity_, PROT_NONE,
+		                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (reserved == MAP_FAILED) {
+			auto error = errno;
+			close(fd);
+			throw std::system_error(error, std::generic_category(), "spool");
+		}
+		base_ = static_cast<char*>(reserved);
+		for (size_t half = 0; half < 2; half++) {
+			if (mmap(base_ + half * capacity_, capacity_,
+			         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+			         0) == MAP_FAILED) {
+				auto error = errno;
+				close(fd);
+				munmap(base_, 2 * capacity_);
+				throw std::system_error(error, std::generic_category(),
+				                        "spool");
+			}
+		}
+		close(fd);
+	}
+
+	~Spool() {
+		if (base_ != nullptr)
+			munmap(base_, 2 * capacity_);
+	}
+
+	Spool(const Spool&) = delete;
+	Spool& operator=(const Spool&) = delete;
+
+	bool empty() const { return head_ == tail_; }
+
+	size_t bytes() const { return tail_ - head_; }
+
+	// Appends a message, or returns false if it does not fit.
+	bool push(std::string_view data, uint64_t deadline_ms) {
+		auto needed = footprint(data.size());
+		if (data.size() > UINT32_MAX || bytes() + needed > capacity_) {
+			return false;
+		}
+		auto record = at(tail_);
+		record->size = data.size();
+		record->deadline_ms = deadline_ms;
+		memcpy(record + 1, data.data(), data.size());
+		tail_ += needed;
+		return true;
+	}
+
+	// The rest of a partly sent record means nothing on a new connection.
+	void discardPartial() {
+		if (sent_ > 0)
+			pop();
+	}
+
+	// Writes records to fd until it would block or the spool is empty, up
+	// to batch records per call, dropping the ones past their deadline that
+	// haven't been started. Returns false if the connection failed.
+	bool drain(int fd, uint64_t now_ms, uint64_t& expired,
+	           size_t batch = kMaxBatch) {
+		batch = std::min(std::max<size_t>(batch, 1), kMaxBatch);
+		while (!empty()) {
+			iovec iov[kMaxBatch];
+			size_t count = 0;
+			size_t skip = sent_;
+			for (auto position = head_; position != tail_ && count < batch;) {
+				auto record = at(position);
+				position += footprint(record->size);
+				if (skip == 0 && record->deadline_ms != 0 &&
+				    record->deadline_ms < now_ms) {
+					if (count == 0) {
+						pop();
+						expired++;
+						continue;
+					}
+					// end the batch here, it gets dropped once it is first
+					break;
+				}
+				iov[count].iov_base = reinterpret_cast<char*>(record + 1) + skip;
+				iov[count].iov_len = record->size - skip;
+				count++;
+				skip = 0;
+			}
+			if (count == 0)
+				continue;
+			msghdr msg{};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+			auto n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0) {
+				return errno == EAGAIN || errno == EWOULDBLOCK ||
+				       errno == EINTR;
+			}
+			for (size_t i = 0; i < count; i++) {
+				auto rest = iov[i].iov_len;
+				if (size_t(n) < rest) {
+					sent_ += n;
+					return true;
+				}
+				n -= rest;
+				pop();
+			}
+		}
+		return true;
+	}
+};
@@ -0,0 +1,199 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+
+#include "Frame.h"
+#include "TupleOfOptionals.h"
+
+//
+// Listener filters that clients advertise to the dispatcher, so that routed
+// messages are only forwarded to connections with a matching listener.
+//
+// A connection receives every message until it sends kSelective. From then
+// on, routed messages reach it only through its subscriptions. Messages
+// without a routing header still go to everyone.
+//
+// Control frames carry the kControl flag and a body of
+//   u8 op, then for kSubscribe and kUnsubscribe a filter: u8 mask with bit i
+//   set when element i of the key is present, followed by the present
+//   elements in order, each with the width the routing extension uses
+//
+namespace subscription {
+
+using UUriTuple = std::tuple<std::optional<std::string>, std::optional<uint32_t>,
+                             std::optional<uint32_t>, std::optional<uint32_t> >;
+
+// source then sink, with nullopt elements acting as wildcards
+using Key = tuple_cat_t<UUriTuple, UUriTuple>;
+
+enum Op : uint8_t {
+	kSelective = 1,
+	kSubscribe = 2,
+	kUnsubscribe = 3,
+};
+
+//
+// Fill in the four tuple elements for one uuri starting at Offset, leaving
+// wildcard values as nullopt
+//
+template <size_t Offset>
+void setUUriFields(Key& key, std::string_view authority_name, uint32_t ue_id,
+                   uint32_t ue_version_major, uint32_t resource_id) {
+	if (authority_name != "*") {
+		std::get<Offset + 0>(key) = std::string(authority_name);
+	}
+	if (ue_id != 0xffff) {
+		std::get<Offset + 1>(key) = ue_id;
+	}
+	if (ue_version_major != 0xff) {
+		std::get<Offset + 2>(key) = ue_version_major;
+	}
+	if (resource_id != 0xffff) {
+		std::get<Offset + 3>(key) = resource_id;
+	}
+}
+
+inline Key makeKey(const frame::Routing& routing) {
+	Key key;
+	auto& left = routing.source;
+	auto& right = routing.sink;
+	setUUriFields<0>(key, left.authority_name, left.ue_id,
+	                 left.ue_version_major, left.resource_id);
+	setUUriFields<4>(key, right.authority_name, right.ue_id,
+	                 right.ue_version_major, right.resource_id);
+	return key;
+}
+
+//
+// Same for anything with the accessors of uprotocol::v1::UUri, with an absent
+// source or sink matching any
+//
+template <typename UURI>
+Key makeKey(const std::optional<UURI>& source,
+            const std::optional<UURI>& sink) {
+	Key key;
+	if (source) {
+		setUUriFields<0>(key, source->authority_name(), source->ue_id(),
+		                 source->ue_version_major(), source->resource_id());
+	}
+	if (sink) {
+		setUUriFields<4>(key, sink->authority_name(), sink->ue_id(),
+		                 sink->ue_version_major(), sink->resource_id());
+	}
+	return key;
+}
+
+namespace detail {
+
+template <size_t Index, typename T>
+bool putField(std::string& out, const T& value) {
+	using frame::detail::put;
+	if constexpr (Index % 4 == 0) {
+		if (value.size() > 0xff)
+			return false;
+		put<uint8_t>(out, value.size());
+		out.append(value);
+	} else if constexpr (Index % 4 == 1) {
+		put<uint32_t>(out, value);
+	} else if constexpr (Index % 4 == 2) {
+		if (value > 0xff)
+			return false;
+		put<uint8_t>(out, value);
+	} else {
+		if (value > 0xffff)
+			return false;
+		put<uint16_t>(out, value);
+	}
+	return true;
+}
+
+template <size_t Index, typename T>
+bool getField(std::string_view& in, std::optional<T>& field) {
+	using frame::detail::get;
+	if constexpr (Index % 4 == 0) {
+		uint8_t len;
+		if (!get(in, len) || in.size() < len)
+			return false;
+		field = std::string(in.substr(0, len));
+		in.remove_prefix(len);
+		return true;
+	} else {
+		using Wire = std::conditional_t<
+		    Index % 4 == 1, uint32_t,
+		    std::conditional_t<Index % 4 == 2, uint8_t, uint16_t> >;
+		Wire value;
+		if (!get(in, value))
+			return false;
+		field = value;
+		return true;
+	}
+}
+
+}  // namespace detail
+
+// Appends a complete control frame. Returns false, leaving out untouched, if
+// the key holds a value that no routing header could carry. Such a filter
+// can only match messages that are sent without routing, and those reach
+// every connection anyway.
+inline bool appendControl(std::string& out, Op op, const Key* key = nullptr) {
+	std::string body;
+	frame::detail::put<uint8_t>(body, op);
+	if (key) {
+		uint8_t mask = 0;
+		std::string fields;
+		bool ok = true;
+		constexpr_for<0, std::tuple_size_v<Key>, 1>([&](const auto i) {
+			auto& field = std::get<i>(*key);
+			if (field) {
+				mask |= 1 << i;
+				ok = ok && detail::putField<i>(fields, *field);
+			}
+		});
+		if (!ok)
+			return false;
+		frame::detail::put<uint8_t>(body, mask);
+		body.append(fields);
+	}
+	frame::Header header;
+	header.flags = frame::kControl;
+	header.body_len = body.size();
+	frame::appendHeader(out, header);
+	out.append(body);
+	return true;
+}
+
+inline bool parseControl(std::string_view in, Op& op, Key& key) {
+	uint8_t value;
+	if (!frame::detail::get(in, value))
+		return false;
+	op = static_cast<Op>(value);
+	if (op != kSubscribe && op != kUnsubscribe)
+		return op == kSelective;
+	uint8_t mask;
+	if (!frame::detail::get(in, mask))
+		return false;
+	bool ok = true;
+	constexpr_for<0, std::tuple_size_v<Key>, 1>([&](const auto i) {
+		if (ok && (mask >> i) & 1) {
+			ok = detail::getField<i>(in, std::get<i>(key));
+		}
+	});
+	return ok;
+}
+
+}  // namespace subscription
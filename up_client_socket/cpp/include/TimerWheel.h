@@ -0,0 +1,154 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+//
+// Hierarchical timing wheel after Varghese and Lauck. Four levels of 64 slots
+// cover 2^24 ticks; each level's slot is spread over the level below when
+// time reaches it, so scheduling and firing are O(1) however many timers are
+// pending. Later deadlines are held at the top level until they come in
+// range. There is no cancel: owners drop values they no longer care about
+// when they fire. Not thread safe.
+//
+template <typename T>
+class TimerWheel {
+public:
+	using Clock = std::chrono::steady_clock;
+
+private:
+	static constexpr unsigned kBits = 6;
+	static constexpr unsigned kSlots = 1 << kBits;
+	static constexpr unsigned kLevels = 4;
+
+	struct Entry {
+		uint64_t tick;
+		T value;
+	};
+
+	using Slot = std::vector<Entry>;
+
+	Clock::duration tick_;
+	Clock::time_point start_;
+	// every tick up to and including this one has fired
+	uint64_t now_ = 0;
+	size_t size_ = 0;
+	std::array<std::array<Slot, kSlots>, kLevels> levels_;
+	std::array<size_t, kLevels> level_sizes_{};
+
+	uint64_t tickOf(Clock::time_point when) const {
+		if (when <= start_)
+			return 0;
+		// round up, a timer never fires early
+		return (when - start_ + tick_ - Clock::duration(1)) / tick_;
+	}
+
+	void place(Entry&& entry) {
+		auto delta = entry.tick - now_;
+		unsigned level = 0;
+		while (level + 1 < kLevels &&
+		       delta >= (uint64_t(1) << (kBits * (level + 1)))) {
+			level++;
+		}
+		auto max_delta = uint64_t(1) << (kBits * kLevels);
+		// beyond the wheel, park in the top level slot furthest out
+		auto tick = delta < max_delta ? entry.tick : now_ + max_delta - 1;
+		auto slot = (tick >> (kBits * level)) & (kSlots - 1);
+		levels_[level][slot].push_back(std::move(entry));
+		level_sizes_[level]++;
+	}
+
+public:
+	explicit TimerWheel(Clock::duration tick = std::chrono::milliseconds(1),
+	                    Clock::time_point start = Clock::now())
+	    : tick_(tick), start_(start) {}
+
+	size_t size() const { return size_; }
+
+	void schedule(Clock::time_point deadline, T value) {
+		// anything already due fires on the next tick
+		auto tick = std::max(tickOf(deadline), now_ + 1);
+		place(Entry{tick, std::move(value)});
+		size_++;
+	}
+
+	// Calls fn with every value whose deadline is at or before now.
+	template <typename FN>
+	void advance(Clock::time_point now, FN&& fn) {
+		// ticks are whole periods since start, so now itself may be mid-tick
+		auto target = now <= start_ ? 0 : uint64_t((now - start_) / tick_);
+		while (now_ < target && size_ > 0) {
+			now_++;
+			// spread out each higher level slot that time just reached
+			for (unsigned level = 1; level < kLevels; level++) {
+				if ((now_ & ((uint64_t(1) << (kBits * level)) - 1)) != 0)
+					break;
+				auto& slot =
+				    levels_[level][(now_ >> (kBits * level)) & (kSlots - 1)];
+				Slot entries;
+				entries.swap(slot);
+				level_sizes_[level] -= entries.size();
+				for (auto& entry : entries) {
+					place(std::move(entry));
+				}
+			}
+			auto& slot = levels_[0][now_ & (kSlots - 1)];
+			Slot due;
+			due.swap(slot);
+			level_sizes_[0] -= due.size();
+			for (auto& entry : due) {
+				if (entry.tick > now_) {
+					// parked beyond the wheel, still not due
+					place(std::move(entry));
+					continue;
+				}
+				size_--;
+				fn(std::move(entry.value));
+			}
+		}
+		if (size_ == 0 && now_ < target) {
+			now_ = target;
+		}
+	}
+
+	// When advance() next has work to do: the earliest pending deadline, or
+	// the point where a higher level is spread out. nullopt when empty.
+	std::optional<Clock::time_point> nextWakeup() const {
+		if (size_ == 0)
+			return std::nullopt;
+		uint64_t tick = UINT64_MAX;
+		if (level_sizes_[0] > 0) {
+			for (uint64_t i = 1; i <= kSlots; i++) {
+				if (!levels_[0][(now_ + i) & (kSlots - 1)].empty()) {
+					tick = now_ + i;
+					break;
+				}
+			}
+		}
+		for (unsigned level = 1; level < kLevels; level++) {
+			if (level_sizes_[level] > 0) {
+				auto span = uint64_t(1) << (kBits * level);
+				tick = std::min(tick, (now_ / span + 1) * span);
+				break;
+			}
+		}
+		return start_ + tick_ * tick;
+	}
+};
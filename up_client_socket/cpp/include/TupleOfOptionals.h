@@ -13,8 +13,11 @@
 
 #include <iostream>
 #include <optional>
+#include <sstream>
+#include <string>
 #include <tuple>
 #include <type_traits>
+#include <vector>
 
 namespace tuple_of_optionals {
 using namespace std;
@@ -100,6 +103,30 @@ void assign_if(optional<T>& field, size_t& cnt, size_t i, size_t bits) {
 	}
 }
 
+//
+// These two report and clear wildcard (nullopt) elements for the shape
+// helpers below.
+//
+template <typename T>
+bool is_wildcard(const T& field) {
+	return false;
+}
+
+template <typename T>
+bool is_wildcard(const optional<T>& field) {
+	return !field.has_value();
+}
+
+template <typename T>
+void clear_if(T& field, bool clear) {}
+
+template <typename T>
+void clear_if(optional<T>& field, bool clear) {
+	if (clear) {
+		field = nullopt;
+	}
+}
+
 //
 // Bottom part of namespace contains functions for printing.
 //
@@ -159,6 +186,31 @@ std::vector<T> generateOptionals(const T& key) {
 	return ret;
 }
 
+//
+// A shape is a bit mask with bit i set when element i of a key is a wildcard.
+// Matching a concrete key against stored keys only needs one probe per shape
+// in use, rather than one per entry of generateOptionals().
+//
+template <typename T>
+size_t wildcardShape(const T& key) {
+	size_t shape = 0;
+	constexpr_for<0, std::tuple_size_v<T>, 1>([&](const auto i) {
+		if (tuple_of_optionals::is_wildcard(std::get<i>(key))) {
+			shape |= size_t(1) << i;
+		}
+	});
+	return shape;
+}
+
+template <typename T>
+T withShape(const T& key, size_t shape) {
+	auto out = key;
+	constexpr_for<0, std::tuple_size_v<T>, 1>([&](const auto i) {
+		tuple_of_optionals::clear_if(std::get<i>(out), (shape >> i) & 1);
+	});
+	return out;
+}
+
 template <typename... input_t>
 using tuple_cat_t = decltype(std::tuple_cat(std::declval<input_t>()...));
 
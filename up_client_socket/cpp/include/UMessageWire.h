@@ -0,0 +1,234 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <google/protobuf/io/coded_stream.h>
+#include <uprotocol/v1/uattributes.pb.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+//
+// Helpers that look at the protobuf encoding of a UMessage directly, so the
+// receive path can make decisions without a full ParseFromString.
+//
+// Field numbers mirror uprotocol/v1/umessage.proto and uattributes.proto.
+//
+namespace umessage_wire {
+using google::protobuf::io::CodedInputStream;
+
+constexpr uint32_t kMessageAttributes = 1;
+constexpr uint32_t kMessagePayload = 2;
+constexpr uint32_t kAttributesId = 1;
+constexpr uint32_t kUuidMsb = 1;
+constexpr uint32_t kUuidLsb = 2;
+
+enum WireType : uint32_t {
+	kVarint = 0,
+	kFixed64 = 1,
+	kLengthDelimited = 2,
+	kFixed32 = 5,
+};
+
+inline CodedInputStream makeStream(std::string_view data) {
+	return CodedInputStream(reinterpret_cast<const uint8_t*>(data.data()),
+	                        static_cast<int>(data.size()));
+}
+
+// Skip over the value of a field whose tag has just been read.
+inline bool skipField(CodedInputStream& in, uint32_t tag) {
+	switch (tag & 7) {
+		case kVarint: {
+			uint64_t dummy;
+			return in.ReadVarint64(&dummy);
+		}
+		case kFixed64:
+			return in.Skip(8);
+		case kLengthDelimited: {
+			uint32_t len;
+			return in.ReadVarint32(&len) && in.Skip(len);
+		}
+		case kFixed32:
+			return in.Skip(4);
+		default:
+			// groups are not used by any uprotocol message
+			return false;
+	}
+}
+
+// Read a length delimited field and return a view of its bytes within the
+// buffer the stream was created over.
+inline bool readView(CodedInputStream& in, std::string_view data,
+                     std::string_view& out) {
+	uint32_t len;
+	if (!in.ReadVarint32(&len))
+		return false;
+	auto offset = static_cast<size_t>(in.CurrentPosition());
+	if (offset + len > data.size() || !in.Skip(len))
+		return false;
+	out = data.substr(offset, len);
+	return true;
+}
+
+// Find attributes.id without decoding anything else. Returns nullopt when the
+// buffer is malformed or carries no id.
+inline std::optional<std::pair<uint64_t, uint64_t>> peekId(
+    std::string_view data) {
+	uint64_t msb = 0;
+	uint64_t lsb = 0;
+	auto in = makeStream(data);
+	while (auto tag = in.ReadTag()) {
+		if (tag != ((kMessageAttributes << 3) | kLengthDelimited)) {
+			if (!skipField(in, tag))
+				return std::nullopt;
+			continue;
+		}
+		std::string_view attributes;
+		if (!readView(in, data, attributes))
+			return std::nullopt;
+		auto attr_in = makeStream(attributes);
+		while (auto attr_tag = attr_in.ReadTag()) {
+			if (attr_tag != ((kAttributesId << 3) | kLengthDelimited)) {
+				if (!skipField(attr_in, attr_tag))
+					return std::nullopt;
+				continue;
+			}
+			std::string_view id;
+			if (!readView(attr_in, attributes, id))
+				return std::nullopt;
+			auto id_in = makeStream(id);
+			while (auto id_tag = id_in.ReadTag()) {
+				if (id_tag == ((kUuidMsb << 3) | kFixed64)) {
+					if (!id_in.ReadLittleEndian64(&msb))
+						return std::nullopt;
+				} else if (id_tag == ((kUuidLsb << 3) | kFixed64)) {
+					if (!id_in.ReadLittleEndian64(&lsb))
+						return std::nullopt;
+				} else if (!skipField(id_in, id_tag)) {
+					return std::nullopt;
+				}
+			}
+		}
+	}
+	if (msb == 0 && lsb == 0)
+		return std::nullopt;
+	return std::make_pair(msb, lsb);
+}
+
+// Decode only the attributes of a serialized UMessage and locate its payload
+// without copying it. Repeated attributes fields are merged and the last
+// payload wins, as ParseFromString would do.
+inline bool parseAttributes(std::string_view data,
+                            uprotocol::v1::UAttributes& attributes,
+                            std::string_view& payload, bool& has_payload) {
+	has_payload = false;
+	auto in = makeStream(data);
+	while (auto tag = in.ReadTag()) {
+		if (tag == ((kMessageAttributes << 3) | kLengthDelimited)) {
+			std::string_view view;
+			if (!readView(in, data, view))
+				return false;
+			auto attr_in = makeStream(view);
+			if (!attributes.MergeFromCodedStream(&attr_in) ||
+			    !attr_in.ConsumedEntireMessage())
+				return false;
+		} else if (tag == ((kMessagePayload << 3) | kLengthDelimited)) {
+			if (!readView(in, data, payload))
+				return false;
+			has_payload = true;
+		} else if (!skipField(in, tag)) {
+			return false;
+		}
+	}
+	return in.ConsumedEntireMessage();
+}
+
+// Write a varint at out, returning the position after it. out needs room
+// for up to 10 bytes.
+inline char* writeVarint(char* out, uint64_t value) {
+	while (value >= 0x80) {
+		*out++ = static_cast<char>(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = static_cast<char>(value);
+	return out;
+}
+
+inline char* writeTag(char* out, uint32_t field, WireType type) {
+	return writeVarint(out, (field << 3) | type);
+}
+
+inline char* writeFixed64(char* out, uint64_t value) {
+	for (size_t i = 0; i < 8; i++) {
+		*out++ = static_cast<char>(value >> (8 * i));
+	}
+	return out;
+}
+
+// Append a serialized UMessage built from an id, the already serialized
+// remainder of its attributes (everything but the id), and a payload. The
+// result parses the same as if the whole message had been serialized.
+inline void appendMessage(std::string& out, uint64_t msb, uint64_t lsb,
+                          std::string_view attributes_tail,
+                          std::string_view payload) {
+	// two tagged fixed64 fields
+	constexpr size_t uuid_size = 2 * (1 + 8);
+	// the id field: tag, one byte length, then the uuid
+	constexpr size_t id_size = 2 + uuid_size;
+
+	// tag and length of attributes, then the id field
+	char head[1 + 10 + id_size];
+	char* pos = writeTag(head, kMessageAttributes, kLengthDelimited);
+	pos = writeVarint(pos, id_size + attributes_tail.size());
+	pos = writeTag(pos, kAttributesId, kLengthDelimited);
+	pos = writeVarint(pos, uuid_size);
+	pos = writeTag(pos, kUuidMsb, kFixed64);
+	pos = writeFixed64(pos, msb);
+	pos = writeTag(pos, kUuidLsb, kFixed64);
+	pos = writeFixed64(pos, lsb);
+
+	// tag and length of payload
+	char mid[1 + 10];
+	char* mid_end = writeTag(mid, kMessagePayload, kLengthDelimited);
+	mid_end = writeVarint(mid_end, payload.size());
+
+	out.reserve(out.size() + (pos - head) + attributes_tail.size() +
+	            (mid_end - mid) + payload.size());
+	out.append(head, pos - head);
+	out.append(attributes_tail);
+	out.append(mid, mid_end - mid);
+	out.append(payload);
+}
+
+// Append a serialized UMessage made of its serialized attributes and a
+// payload.
+inline void appendMessage(std::string& out, std::string_view attributes,
+                          std::string_view payload) {
+	char head[1 + 10];
+	char* head_end = writeTag(head, kMessageAttributes, kLengthDelimited);
+	head_end = writeVarint(head_end, attributes.size());
+	char mid[1 + 10];
+	char* mid_end = writeTag(mid, kMessagePayload, kLengthDelimited);
+	mid_end = writeVarint(mid_end, payload.size());
+
+	out.reserve(out.size() + (head_end - head) + attributes.size() +
+	            (mid_end - mid) + payload.size());
+	out.append(head, head_end - head);
+	out.append(attributes);
+	out.append(mid, mid_end - mid);
+	out.append(payload);
+}
+
+}  // namespace umessage_wire
@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+//
+// uProtocol message ids are UUIDv8 values whose top 48 bits hold the creation
+// time in milliseconds since the unix epoch.
+//
+namespace uuid_time {
+
+inline std::optional<uint64_t> timestampMs(uint64_t msb) {
+	constexpr uint64_t version = 8;
+	if (((msb >> 12) & 0xf) != version) {
+		return std::nullopt;
+	}
+	return msb >> 16;
+}
+
+inline uint64_t nowMs() {
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(system_clock::now().time_since_epoch())
+	    .count();
+}
+
+// True if a message with this id has outlived its ttl. A ttl of zero, or an
+// id that carries no timestamp, never expires.
+inline bool expired(uint64_t msb, uint32_t ttl_ms, uint64_t now_ms) {
+	if (ttl_ms == 0) {
+		return false;
+	}
+	auto created = timestampMs(msb);
+	return created && (now_ms > *created + ttl_ms);
+}
+
+// Unix time in ms after which a message with this id has expired, or 0 if it
+// never does.
+inline uint64_t deadlineMs(uint64_t msb, uint32_t ttl_ms) {
+	auto created = timestampMs(msb);
+	return ttl_ms > 0 && created ? *created + ttl_ms : 0;
+}
+
+}  // namespace uuid_time
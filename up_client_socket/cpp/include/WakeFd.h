@@ -15,62 +15,154 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "Probes.h"
+
+//
+// Waits on one or more connected sockets plus a pipe that other threads use
+// to wake the waiting thread. A socket can be replaced, or set to -1 to be
+// left out, between waits.
+//
 class WakeFd {
-	int fd_;
+	std::vector<int> fds_;
+	std::vector<struct pollfd> poll_fds_;
+	// reading nothing means closed for streams, an empty datagram otherwise
+	std::vector<bool> streams_;
 	int pair_[2];
+	// the socket to look at first, so one busy socket can't starve the rest
+	size_t next_ = 0;
 	const size_t max_read_bytes = 32768;
 
+	static constexpr char exit_token = 0;
+	static constexpr char notify_token = 1;
+
+	static bool isStream(int fd) {
+		int type = 0;
+		socklen_t len = sizeof(type);
+		return fd >= 0 &&
+		       getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+		       type == SOCK_STREAM;
+	}
+
 public:
-	WakeFd(int fd) : fd_(fd) { auto pret = pipe(pair_); }
+	WakeFd(int fd) : WakeFd(std::vector<int>{fd}) {}
+
+	WakeFd(std::vector<int> fds) : fds_(std::move(fds)) {
+		auto pret = pipe(pair_);
+		poll_fds_.resize(fds_.size() + 1);
+		streams_.resize(fds_.size());
+		for (size_t i = 0; i < fds_.size(); i++) {
+			poll_fds_[i].fd = fds_[i];
+			poll_fds_[i].events = POLLIN;
+			streams_[i] = isStream(fds_[i]);
+		}
+		poll_fds_.back().fd = pair_[0];
+		poll_fds_.back().events = POLLIN;
+	}
 
 	~WakeFd() {
-		close(fd_);
+		for (int fd : fds_) {
+			if (fd >= 0)
+				close(fd);
+		}
 		close(pair_[0]);
 		close(pair_[1]);
 	}
 
-	int fd() { return fd_; }
+	size_t size() const { return fds_.size(); }
+
+	int fd(size_t index = 0) { return fds_[index]; }
+
+	// Closes the socket at index and waits on fd in its place from the next
+	// read() on. Only call from the thread that calls read().
+	void replace(size_t index, int fd) {
+		if (fds_[index] >= 0)
+			close(fds_[index]);
+		fds_[index] = fd;
+		poll_fds_[index].fd = fd;
+		poll_fds_[index].revents = 0;
+		streams_[index] = isStream(fd);
+	}
+
+	// Also wake read() when the socket at index can take more data. Only
+	// call from the thread that calls read().
+	void watchWritable(size_t index, bool on) {
+		poll_fds_[index].events = POLLIN | (on ? POLLOUT : 0);
+	}
+
+	// What the last read() saw happen on the socket at index. POLLHUP is set
+	// once the peer closed it or it failed.
+	short events(size_t index) const { return poll_fds_[index].revents; }
 
 	void wake() {
-		int dummy;
-		auto ret = write(pair_[1], &dummy, sizeof(dummy));
+		char token = exit_token;
+		auto ret = write(pair_[1], &token, sizeof(token));
 	}
 
-	bool read(std::string& data) {
-		struct pollfd fds[2];
-		fds[0].fd = fd_;
-		fds[0].events = POLLIN;
-		fds[0].revents = 0;
-		fds[1].fd = pair_[0];
-		fds[1].events = POLLIN;
-		fds[1].revents = 0;
-		int ret = poll(fds, 2, -1);
-		// wake() called, return false to exit
-		if (fds[1].revents) {
-			return false;
+	// Unlike wake(), makes a pending read() return true with empty data so
+	// the caller can service work queued outside the socket.
+	void notify() {
+		char token = notify_token;
+		[[maybe_unused]] auto ret = write(pair_[1], &token, sizeof(token));
+	}
+
+	// Reads from one ready socket and reports which through index. Returns
+	// true with empty data when it reads nothing, such as when the timeout
+	// in ms passes or a socket is closed, so the caller can check events().
+	bool read(std::string& data, size_t* index = nullptr,
+	          int timeout_ms = -1) {
+		for (auto& poll_fd : poll_fds_) {
+			poll_fd.revents = 0;
 		}
-		// spurious wake, return true to try again
-		if (fds[0].revents == 0) {
+		int ret = poll(poll_fds_.data(), poll_fds_.size(), timeout_ms);
+		// wake() called, return false to exit; notify() returns empty data
+		if (poll_fds_.back().revents) {
+			char token = exit_token;
+			[[maybe_unused]] auto rret =
+			    ::read(pair_[0], &token, sizeof(token));
+			if (token == exit_token)
+				return false;
 			data.resize(0);
 			return true;
 		}
-		data.resize(max_read_bytes);
-		int readSize = ::read(fd_, data.data(), max_read_bytes);
-		if (readSize < 0)
-			return false;
-		data.resize(readSize);
+		for (size_t n = 0; n < fds_.size(); n++) {
+			size_t i = (next_ + n) % fds_.size();
+			if ((poll_fds_[i].revents & POLLIN) == 0)
+				continue;
+			next_ = (i + 1) % fds_.size();
+			data.resize(max_read_bytes);
+			int readSize = ::read(fds_[i], data.data(), max_read_bytes);
+			if (readSize <= 0) {
+				if ((readSize == 0 && streams_[i]) ||
+				    (readSize < 0 && errno != EAGAIN && errno != EINTR)) {
+					// stop waiting on it until the caller replaces it
+					poll_fds_[i].revents |= POLLHUP;
+					poll_fds_[i].fd = -1;
+				}
+				readSize = 0;
+			}
+			data.resize(readSize);
+			if (index)
+				*index = i;
+			UP_PROBE2(wake_read, i, readSize);
+			return true;
+		}
+		// spurious wake, return true to try again
+		data.resize(0);
 		return true;
 	}
 
 	template <typename... Params>
-	int send(Params&&... params) {
-		return ::send(fd_, std::forward<Params>(params)...);
+	int send(size_t index, Params&&... params) {
+		return ::send(fds_[index], std::forward<Params>(params)...);
 	}
 
 	template <typename... Params>
-	int connect(Params&&... params) {
-		return ::connect(fd_, std::forward<Params>(params)...);
+	int connect(size_t index, Params&&... params) {
+		return ::connect(fds_[index], std::forward<Params>(params)...);
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,652 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include "Dispatcher.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spdlog/spdlog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Frame.h"
+#include "MpscQueue.h"
+#include "SafeTupleMap.h"
+#include "Subscription.h"
+
+using namespace std;
+
+namespace {
+
+system_error lastError(const char* what) {
+	return system_error(errno, generic_category(), what);
+}
+
+string peerName(const sockaddr_in& addr) {
+	char ip[INET_ADDRSTRLEN] = {};
+	inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+	return string(ip) + ":" + to_string(ntohs(addr.sin_port));
+}
+
+}  // namespace
+
+struct Dispatcher::Impl {
+	// A message waiting to be written, and the buffer that keeps it alive.
+	struct Slice {
+		shared_ptr<const string> owner;
+		string_view data;
+	};
+
+	using Key = subscription::Key;
+
+	struct Connection {
+		Connection(int fd, string peer) : fd(fd), peer(std::move(peer)) {}
+
+		int fd;
+		string peer;
+		frame::Reader reader;
+		deque<Slice> out;
+		size_t queued_bytes = 0;
+		// messages dropped since the queue last drained
+		uint64_t dropped = 0;
+		// set once the peer asked for routed messages by subscription only
+		bool selective = false;
+		unordered_map<Key, uint32_t, tuple_of_optionals::hash<Key>>
+		    subscriptions;
+		// the last routed message queued here, so overlapping filters of
+		// one connection don't deliver it twice
+		uint64_t last_routed = 0;
+		// set while the connection sits in the dirty_, readable_ or
+		// overflowed_ lists
+		bool dirty = false;
+		bool readable = false;
+		bool overflowed = false;
+		bool closed = false;
+	};
+
+	// Work handed to a worker by the other workers.
+	struct Task {
+		// a connection accepted on worker 0, or -1
+		int fd = -1;
+		string peer;
+		// messages read by another worker, in the order they arrived
+		vector<frame::Frame> frames;
+	};
+
+	// reads per wakeup before a busy sender yields to the other connections
+	static constexpr int max_reads_per_turn = 16;
+	static constexpr size_t read_size = 64 * 1024;
+	static constexpr int max_iov = 64;
+	static constexpr int max_events = 256;
+
+	//
+	// One epoll loop and the connections it owns. Nothing here is touched by
+	// other threads apart from inbox_, wake_pending_ and connection_count_.
+	//
+	struct Worker {
+		Impl& impl_;
+		size_t index_;
+		int epoll_fd_ = -1;
+		int wake_fd_ = -1;
+		MpscQueue<Task> inbox_;
+		// set by the first producer after the inbox was last drained, so a
+		// burst of pushes costs one eventfd write
+		atomic<bool> wake_pending_{false};
+		atomic<size_t> connection_count_{0};
+
+		unordered_set<Connection*> connections_;
+		// connections that still receive every message
+		unordered_set<Connection*> flooded_;
+		SafeTupleMap<Key, unordered_set<Connection*>> subscribers_;
+		uint64_t routed_count_ = 0;
+		// connections with queued output, flushed once per loop iteration so
+		// that everything fanned out in one pass goes out in a single write
+		vector<Connection*> dirty_;
+		// connections that still had data to read when their turn ended
+		vector<Connection*> readable_;
+		// over max_queued_bytes under the disconnect policy
+		vector<Connection*> overflowed_;
+		// closed during the current iteration, freed once no event refers
+		// to them
+		vector<Connection*> closed_;
+		// messages read this iteration, by the worker they are going to
+		vector<vector<frame::Frame>> outgoing_;
+		string scratch_ = string(read_size, '\0');
+
+		Worker(Impl& impl, size_t index) : impl_(impl), index_(index) {
+			try {
+				epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+				if (epoll_fd_ < 0)
+					throw lastError("epoll_create1");
+				wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				if (wake_fd_ < 0)
+					throw lastError("eventfd");
+
+				// the listening socket and wake_fd_ are told apart from
+				// connections by their data.ptr
+				epoll_event ev{};
+				ev.events = EPOLLIN;
+				ev.data.ptr = &wake_fd_;
+				if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) < 0)
+					throw lastError("epoll_ctl");
+				if (index == 0) {
+					ev.events = EPOLLIN | EPOLLET;
+					ev.data.ptr = nullptr;
+					if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, impl.listen_fd_,
+					              &ev) < 0)
+						throw lastError("epoll_ctl");
+				}
+			} catch (...) {
+				closeFds();
+				throw;
+			}
+			outgoing_.resize(impl.options_.threads);
+		}
+
+		~Worker() {
+			for (auto conn : connections_) {
+				::close(conn->fd);
+				delete conn;
+			}
+			for (auto conn : closed_) {
+				delete conn;
+			}
+			Task task;
+			while (inbox_.pop(task)) {
+				if (task.fd >= 0)
+					::close(task.fd);
+			}
+			closeFds();
+		}
+
+		void closeFds() {
+			for (int fd : {epoll_fd_, wake_fd_}) {
+				if (fd >= 0)
+					::close(fd);
+			}
+		}
+
+		// Wake the loop without handing it anything, used by stop().
+		void wake() {
+			uint64_t one = 1;
+			// nothing useful to do if this fails inside a signal handler
+			[[maybe_unused]] auto ret = ::write(wake_fd_, &one, sizeof(one));
+		}
+
+		// Called from other workers.
+		void post(Task&& task) {
+			inbox_.push(std::move(task));
+			if (!wake_pending_.exchange(true, memory_order_acq_rel)) {
+				wake();
+			}
+		}
+
+		void run() {
+			epoll_event events[max_events];
+			while (!impl_.stopping_.load(memory_order_relaxed)) {
+				// don't sleep while a connection is waiting for its next turn
+				int timeout = readable_.empty() ? -1 : 0;
+				int count = epoll_wait(epoll_fd_, events, max_events, timeout);
+				if (count < 0) {
+					if (errno == EINTR)
+						continue;
+					throw lastError("epoll_wait");
+				}
+
+				auto pending = std::move(readable_);
+				readable_.clear();
+				for (auto conn : pending) {
+					conn->readable = false;
+					if (!conn->closed)
+						readAll(conn);
+				}
+
+				for (int i = 0; i < count; i++) {
+					auto ptr = events[i].data.ptr;
+					if (ptr == &wake_fd_) {
+						uint64_t value;
+						[[maybe_unused]] auto ret =
+						    ::read(wake_fd_, &value, sizeof(value));
+						// cleared before the inbox is drained below, so a
+						// push racing with the drain wakes us again. An
+						// exchange, so that it is ordered with the producers'
+						wake_pending_.exchange(false, memory_order_acq_rel);
+						continue;
+					}
+					if (ptr == nullptr) {
+						acceptAll();
+						continue;
+					}
+					auto conn = static_cast<Connection*>(ptr);
+					if (conn->closed)
+						continue;
+					if (events[i].events &
+					    (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+						readAll(conn);
+					if (!conn->closed && (events[i].events & EPOLLOUT))
+						markDirty(conn);
+				}
+
+				drainInbox();
+				handOver();
+
+				for (auto conn : overflowed_) {
+					if (!conn->closed) {
+						spdlog::warn(
+						    "Dispatcher disconnecting slow consumer {} with {} "
+						    "bytes queued",
+						    conn->peer, conn->queued_bytes);
+						close(conn);
+					}
+				}
+				overflowed_.clear();
+
+				for (auto conn : dirty_) {
+					conn->dirty = false;
+					if (!conn->closed)
+						flush(conn);
+				}
+				dirty_.clear();
+
+				for (auto conn : closed_) {
+					delete conn;
+				}
+				closed_.clear();
+			}
+		}
+
+		void acceptAll() {
+			while (true) {
+				sockaddr_in addr{};
+				socklen_t len = sizeof(addr);
+				int fd = accept4(impl_.listen_fd_, (sockaddr*)&addr, &len,
+				                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (fd < 0) {
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+						spdlog::error("Dispatcher accept failed: {}",
+						              strerror(errno));
+					return;
+				}
+				int on = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+				// spread connections over the workers round robin
+				auto& target = *impl_.workers_[impl_.next_worker_++ %
+				                               impl_.workers_.size()];
+				if (&target == this) {
+					adopt(fd, peerName(addr));
+				} else {
+					Task task;
+					task.fd = fd;
+					task.peer = peerName(addr);
+					target.post(std::move(task));
+				}
+			}
+		}
+
+		void adopt(int fd, string peer) {
+			auto conn = new Connection(fd, std::move(peer));
+			epoll_event ev{};
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr = conn;
+			if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+				spdlog::error("Dispatcher epoll_ctl failed: {}",
+				              strerror(errno));
+				::close(fd);
+				delete conn;
+				return;
+			}
+			connections_.insert(conn);
+			flooded_.insert(conn);
+			connection_count_.fetch_add(1, memory_order_relaxed);
+			spdlog::info("accepted conn. {} on worker {}", conn->peer, index_);
+		}
+
+		void drainInbox() {
+			Task task;
+			while (inbox_.pop(task)) {
+				if (task.fd >= 0)
+					adopt(task.fd, std::move(task.peer));
+				for (const auto& frame : task.frames) {
+					routeLocal(frame);
+				}
+			}
+		}
+
+		// Pass this iteration's messages to the other workers, one batch
+		// each, skipping workers that have nobody to deliver to.
+		void handOver() {
+			for (size_t i = 0; i < outgoing_.size(); i++) {
+				auto& frames = outgoing_[i];
+				if (frames.empty())
+					continue;
+				auto& target = *impl_.workers_[i];
+				if (target.connection_count_.load(memory_order_relaxed) == 0) {
+					frames.clear();
+					continue;
+				}
+				Task task;
+				task.frames = std::move(frames);
+				frames.clear();
+				target.post(std::move(task));
+			}
+		}
+
+		// Edge triggered: keep reading until the socket is drained, or hand
+		// the connection to the next iteration once it has had its share.
+		void readAll(Connection* conn) {
+			for (int reads = 0; reads < max_reads_per_turn; reads++) {
+				ssize_t n = ::read(conn->fd, scratch_.data(), scratch_.size());
+				if (n > 0) {
+					// one exactly sized copy, shared by every recipient
+					auto chunk = make_shared<string>(scratch_.data(), n);
+					bool ok = conn->reader.consume(
+					    chunk,
+					    [&](const frame::Frame& frame) { route(conn, frame); });
+					if (!ok) {
+						spdlog::error("Dispatcher bad frame header from {}",
+						              conn->peer);
+						close(conn);
+						return;
+					}
+					continue;
+				}
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return;
+				close(conn);
+				return;
+			}
+			if (!conn->readable) {
+				conn->readable = true;
+				readable_.push_back(conn);
+			}
+		}
+
+		void route(Connection* from, const frame::Frame& frame) {
+			if (frame.flags & frame::kControl) {
+				control(from, frame);
+				return;
+			}
+			routeLocal(frame);
+			for (size_t i = 0; i < outgoing_.size(); i++) {
+				if (i != index_)
+					outgoing_[i].push_back(frame);
+			}
+		}
+
+		// Messages without a usable routing header can't be matched, so they
+		// go to everyone as before.
+		void routeLocal(const frame::Frame& frame) {
+			frame::Routing routing;
+			if (!(frame.flags & frame::kRouting) ||
+			    !frame::parseRouting(frame.ext, routing)) {
+				for (auto conn : connections_) {
+					enqueue(conn, frame);
+				}
+				return;
+			}
+			routed_count_++;
+			for (auto conn : flooded_) {
+				enqueueRouted(conn, frame);
+			}
+			subscribers_.forEachMatch(
+			    subscription::makeKey(routing),
+			    [&](const unordered_set<Connection*>& subscribers) {
+				    for (auto conn : subscribers) {
+					    enqueueRouted(conn, frame);
+				    }
+			    });
+		}
+
+		void control(Connection* conn, const frame::Frame& frame) {
+			subscription::Op op;
+			Key key;
+			if (!subscription::parseControl(frame.body, op, key)) {
+				spdlog::error("Dispatcher bad control message from {}",
+				              conn->peer);
+				return;
+			}
+			switch (op) {
+				case subscription::kSelective:
+					conn->selective = true;
+					flooded_.erase(conn);
+					break;
+				case subscription::kSubscribe:
+					spdlog::debug("Dispatcher {} subscribes to {}", conn->peer,
+					              to_string(key));
+					if (conn->subscriptions[key]++ == 0) {
+						subscribers_.find(key, true)->insert(conn);
+					}
+					break;
+				case subscription::kUnsubscribe: {
+					spdlog::debug("Dispatcher {} unsubscribes from {}",
+					              conn->peer, to_string(key));
+					auto it = conn->subscriptions.find(key);
+					if (it != conn->subscriptions.end() && --it->second == 0) {
+						conn->subscriptions.erase(it);
+						subscribers_.find(key)->erase(conn);
+					}
+					break;
+				}
+			}
+		}
+
+		void enqueueRouted(Connection* conn, const frame::Frame& frame) {
+			if (conn->last_routed != routed_count_) {
+				conn->last_routed = routed_count_;
+				enqueue(conn, frame);
+			}
+		}
+
+		// Applies the slow consumer policy rather than letting one client's
+		// queue grow without bound. Connections are only closed between
+		// fan-outs, so the sets being iterated stay intact.
+		void enqueue(Connection* conn, const frame::Frame& frame) {
+			if (conn->overflowed)
+				return;
+			if (conn->queued_bytes + frame.raw.size() >
+			    impl_.options_.max_queued_bytes) {
+				if (impl_.options_.slow_consumer == SlowConsumer::kDrop) {
+					if (conn->dropped++ == 0) {
+						spdlog::warn(
+						    "Dispatcher dropping messages for slow consumer {}",
+						    conn->peer);
+					}
+				} else {
+					conn->overflowed = true;
+					overflowed_.push_back(conn);
+				}
+				return;
+			}
+			conn->out.push_back(Slice{frame.owner, frame.raw});
+			conn->queued_bytes += frame.raw.size();
+			markDirty(conn);
+		}
+
+		void markDirty(Connection* conn) {
+			if (!conn->dirty) {
+				conn->dirty = true;
+				dirty_.push_back(conn);
+			}
+		}
+
+		// Write as much of the queue as the socket takes. Whatever is left
+		// waits for the next EPOLLOUT edge.
+		void flush(Connection* conn) {
+			iovec iov[max_iov];
+			while (!conn->out.empty()) {
+				int count = 0;
+				for (auto it = conn->out.begin();
+				     it != conn->out.end() && count < max_iov; ++it) {
+					iov[count].iov_base = const_cast<char*>(it->data.data());
+					iov[count].iov_len = it->data.size();
+					count++;
+				}
+				msghdr msg{};
+				msg.msg_iov = iov;
+				msg.msg_iovlen = count;
+				ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					if (errno != EAGAIN && errno != EWOULDBLOCK)
+						close(conn);
+					return;
+				}
+				size_t written = n;
+				conn->queued_bytes -= written;
+				while (written > 0) {
+					auto& front = conn->out.front();
+					if (written < front.data.size()) {
+						front.data.remove_prefix(written);
+						break;
+					}
+					written -= front.data.size();
+					conn->out.pop_front();
+				}
+			}
+			if (conn->dropped > 0 && conn->out.empty()) {
+				spdlog::warn("Dispatcher dropped {} messages for slow consumer {}",
+				             conn->dropped, conn->peer);
+				conn->dropped = 0;
+			}
+		}
+
+		void close(Connection* conn) {
+			spdlog::info("closing socket {}", conn->peer);
+			conn->closed = true;
+			conn->out.clear();
+			if (conn->readable)
+				readable_.erase(find(readable_.begin(), readable_.end(), conn));
+			connections_.erase(conn);
+			flooded_.erase(conn);
+			for (const auto& [key, count] : conn->subscriptions) {
+				subscribers_.find(key)->erase(conn);
+			}
+			connection_count_.fetch_sub(1, memory_order_relaxed);
+			// closing the fd also removes it from the epoll set
+			::close(conn->fd);
+			closed_.push_back(conn);
+		}
+	};
+
+	Options options_;
+	int listen_fd_ = -1;
+	vector<unique_ptr<Worker>> workers_;
+	atomic<bool> stopping_{false};
+	// only used by worker 0, which does all the accepting
+	size_t next_worker_ = 0;
+
+	explicit Impl(const Options& options) : options_(options) {
+		if (options_.threads == 0)
+			options_.threads = 1;
+
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(options.port);
+		if (inet_pton(AF_INET, options.ip.c_str(), &addr.sin_addr) <= 0) {
+			throw system_error(make_error_code(errc::invalid_argument),
+			                   "invalid dispatcher address " + options.ip);
+		}
+
+		try {
+			listen_fd_ =
+			    socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (listen_fd_ < 0)
+				throw lastError("socket");
+			int on = 1;
+			setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) < 0)
+				throw lastError("bind");
+			if (listen(listen_fd_, SOMAXCONN) < 0)
+				throw lastError("listen");
+
+			for (unsigned i = 0; i < options_.threads; i++) {
+				workers_.push_back(make_unique<Worker>(*this, i));
+			}
+		} catch (...) {
+			workers_.clear();
+			if (listen_fd_ >= 0)
+				::close(listen_fd_);
+			throw;
+		}
+
+		spdlog::info("Dispatcher listening on {} with {} worker(s)",
+		             peerName(addr), workers_.size());
+	}
+
+	~Impl() {
+		workers_.clear();
+		::close(listen_fd_);
+	}
+
+	void stop() {
+		stopping_.store(true);
+		for (auto& worker : workers_) {
+			worker->wake();
+		}
+	}
+
+	void run() {
+		vector<thread> threads;
+		for (size_t i = 1; i < workers_.size(); i++) {
+			threads.emplace_back([this, i]() {
+				try {
+					workers_[i]->run();
+				} catch (const system_error& e) {
+					spdlog::error("Dispatcher worker {} failed: {}", i,
+					              e.what());
+					stop();
+				}
+			});
+		}
+		try {
+			workers_[0]->run();
+		} catch (...) {
+			stop();
+			for (auto& t : threads) {
+				t.join();
+			}
+			throw;
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+	}
+};
+
+Dispatcher::Dispatcher(const Options& options)
+    : pImpl(make_unique<Impl>(options)) {}
+
+Dispatcher::~Dispatcher() = default;
+
+void Dispatcher::run() { pImpl->run(); }
+
+void Dispatcher::stop() { pImpl->stop(); }
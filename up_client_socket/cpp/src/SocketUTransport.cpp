@@ -12,27 +12,59 @@
 #include "SocketUTransport.h"
 
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
 #include <spdlog/spdlog.h>
 #include <sys/socket.h>
+#include <up-cpp/datamodel/builder/Uuid.h>
 #include <up-cpp/datamodel/serializer/UUri.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cctype>
+#include <condition_variable>
+#include <deque>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <random>
 #include <set>
 #include <sstream>
+#include <string_view>
 #include <thread>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 
+#include "Allocations.h"
+#include "Compression.h"
+#include "FaultInjection.h"
+#include "FlightRecorder.h"
+#include "Frame.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Probes.h"
+#include "RecentIdSet.h"
 #include "SafeTupleMap.h"
+#include "Spool.h"
+#include "Subscription.h"
+#include "TimerWheel.h"
+#include "UMessageWire.h"
+#include "UuidTime.h"
 #include "WakeFd.h"
 
 using namespace uprotocol::v1;
 using uprotocol::transport::UTransport;
 using namespace std;
 
-string repr(const string& input) {
+// Most lines a log statement on the per-message paths writes a second, so
+// that debug logging can stay on under load and a flood of bad frames can't
+// drown everything else.
+constexpr double kMessageLogsPerSecond = 1000;
+constexpr double kMessageErrorsPerSecond = 10;
+
+string repr(string_view input) {
 	stringstream ss;
 	ss << "'" << setfill('0') << hex;
 	for (auto c : input) {
@@ -52,253 +84,2440 @@ struct SocketUTransport::Impl {
 	struct CallbackData {
 		mutex mtx;  // this is to protect set insertion and deletion
 		set<CallableConn> listeners;
+		set<shared_ptr<ViewListener>> view_listeners;
+		set<shared_ptr<StreamListener>> stream_listeners;
+		// mirror the sizes of the sets so senders can check without the mutex
+		atomic<size_t> listener_count{0};
+		atomic<size_t> stream_listener_count{0};
 		optional<UUri> source_filter;
 	};
 
+	// The connection to one dispatcher. Senders and the dispatcher thread
+	// share it under mtx, and only the dispatcher thread reconnects.
+	struct Link {
+		enum State { kDown, kConnecting, kUp };
+
+		explicit Link(size_t spool_bytes) : spool(spool_bytes) {}
+
+		bool pending() const { return !head.empty() || !spool.empty(); }
+
+		size_t pendingBytes() const {
+			return head.size() + spool.bytes() + delayed_bytes;
+		}
+
+		string name;
+		sockaddr_in address{};
+		mutex mtx;
+		State state = kDown;
+		// a send failed, so the dispatcher thread should reconnect
+		bool broken = false;
+		bool was_up = false;
+		// sends are failing for a full spool, logged once until one fits
+		bool dropping = false;
+		// bytes that go out before the spool: the rest of a partly written
+		// message, or the filters advertised on a new connection
+		string head;
+		Spool spool;
+		chrono::milliseconds backoff{0};
+		chrono::steady_clock::time_point retry_at;
+		// signalled when the dispatcher thread sent some of what was pending
+		condition_variable drained;
+		// what Options::fault_injection does to sends, null unless set, and
+		// the frames it holds back until they are due
+		unique_ptr<fault::Injector> faults;
+		struct Delayed {
+			string bytes;
+			uint64_t deadline_ms;
+		};
+		fault::DelayLine<Delayed> delayed;
+		size_t delayed_bytes = 0;
+	};
+
+	vector<unique_ptr<Link>> links_;
+	minstd_rand jitter_{static_cast<minstd_rand::result_type>(getpid())};
+
+	// dispatcher connections first, then the multicast socket if any
 	unique_ptr<WakeFd> wake_fd_;
+	size_t endpoint_count_ = 0;
 	thread process_thread_;
-	string buffer_;
+	// replaced rather than reused while a listener retains a payload in it
+	shared_ptr<string> buffer_ = make_shared<string>();
+	// one per dispatcher connection, in the order of wake_fd_'s sockets
+	vector<frame::Reader> readers_;
 	UUri default_uuri;
+	Options options_;
+
+	// The dispatcher floods every message back to its sender as well. Ids of
+	// our own sends are remembered so the echo can be dropped before it is
+	// parsed, and sends that local listeners care about are handed to the
+	// dispatcher thread directly through loopback_.
+	RecentIdSet sent_ids_;
+
+	// Looked up once here so the hot paths only pay for the update.
+	metrics::Registry metrics_;
+	metrics::Counter& messages_sent_ = metrics_.counter("messages_sent");
+	metrics::Counter& bytes_sent_ = metrics_.counter("bytes_sent");
+	metrics::Counter& send_failures_ = metrics_.counter("send_failures");
+	metrics::Counter& messages_received_ =
+	    metrics_.counter("messages_received");
+	metrics::Counter& bytes_received_ = metrics_.counter("bytes_received");
+	metrics::Counter& parse_failures_ = metrics_.counter("parse_failures");
+	metrics::Counter& unmatched_ = metrics_.counter("unmatched_messages");
+	metrics::Counter& expired_received_ = metrics_.counter("expired_received");
+	metrics::Counter& expired_sent_ = metrics_.counter("expired_sent");
+	// hash lookups it took to find the listeners of a message
+	metrics::Histogram& match_probes_ = metrics_.histogram("match_probes");
+	metrics::Histogram& callback_ns_ = metrics_.histogram("callback_ns");
+	metrics::Histogram& send_ns_ = metrics_.histogram("send_syscall_ns");
+	// heap allocations per send and per received message, listeners
+	// included, when the program counts them (see Allocations.h)
+	metrics::Histogram* send_allocations_ =
+	    allocationHistogram("send_allocations");
+	metrics::Histogram* send_allocated_bytes_ =
+	    allocationHistogram("send_allocated_bytes");
+	metrics::Histogram* receive_allocations_ =
+	    allocationHistogram("receive_allocations");
+	metrics::Histogram* receive_allocated_bytes_ =
+	    allocationHistogram("receive_allocated_bytes");
+	chrono::steady_clock::time_point next_dump_;
+
+	// Latency histograms per topic, see Options::latency_tracing. Keyed by
+	// the authority and the rest of the source packed into a number, with
+	// an empty key for the topics beyond max_topics. Only used on the
+	// receive thread.
+	using TopicKey = pair<string, uint64_t>;
+	struct TopicLatency {
+		metrics::Histogram* producer = nullptr;
+		metrics::Histogram* callback = nullptr;
+	};
+	map<TopicKey, TopicLatency> topic_latency_;
+	metrics::Counter& latency_outliers_ = metrics_.counter("latency_outliers");
+	chrono::steady_clock::time_point last_outlier_warning_;
+	uint64_t outliers_unreported_ = 0;
+	mutex loopback_mtx_;
+	deque<shared_ptr<const UMessage>> loopback_;
+	// tasks from post(), also under loopback_mtx_
+	deque<function<void()>> posted_;
+	atomic<bool> stopped_{false};
+
+	// compresses what we send if enabled, and decompresses what we receive
+	unique_ptr<compression::Compressor> compressor_;
+	// null unless Options::flight_recording is set
+	unique_ptr<FlightRecorder> recorder_;
 
-	using UUriTuple = tuple<optional<string>, optional<uint32_t>,
-	                        optional<uint32_t>, optional<uint32_t> >;
+	// what Options::fault_injection does to received frames, one per
+	// dispatcher connection and empty unless set, and the frames it holds
+	// back. Only used on the receive thread.
+	vector<fault::Injector> receive_faults_;
+	vector<fault::DelayLine<frame::Frame>> delayed_frames_;
+	metrics::Counter* injected_drops_ = nullptr;
+	metrics::Counter* injected_duplicates_ = nullptr;
 
-	using CallbackKey = tuple_cat_t<UUriTuple, UUriTuple>;
+	int multicast_fd_ = -1;
+	in_addr multicast_interface_{};
+	vector<sockaddr_in> groups_;
+	mutex multicast_mtx_;
+	// listener keys mapping to each group, joined while non-zero
+	vector<uint32_t> group_refs_;
+
+	using CallbackKey = subscription::Key;
 
 	SafeTupleMap<CallbackKey, CallbackData> callback_data_;
 
+	// Keys that have listeners, as advertised to the dispatchers. The mutex
+	// keeps advertisements and their replay on a new connection in order.
+	mutex subscriptions_mtx_;
+	unordered_set<CallbackKey, tuple_of_optionals::hash<CallbackKey>>
+	    subscriptions_;
+
+	struct RequestId {
+		uint64_t msb;
+		uint64_t lsb;
+
+		bool operator==(const RequestId& other) const {
+			return msb == other.msb && lsb == other.lsb;
+		}
+	};
+
+	struct RequestIdHash {
+		size_t operator()(const RequestId& id) const {
+			return id.lsb ^ (id.msb * 0x9e3779b97f4a7c15ULL);
+		}
+	};
+
+	// Calls waiting for a response, sharded so that callers and the
+	// receive thread seldom wait on the same lock.
+	struct PendingShard {
+		mutex mtx;
+		unordered_map<RequestId, RpcCallback, RequestIdHash> calls;
+	};
+
+	// A chunked message being received, see frame::Chunk. Only the
+	// dispatcher thread touches these.
+	struct Inbound {
+		UAttributes attributes;
+		CallbackKey key;
+		size_t link = 0;
+		uint32_t next_seq = 1;
+		uint64_t total = 0;
+		uint64_t received = 0;
+		uint64_t deadline_ms = 0;
+		chrono::steady_clock::time_point last_chunk;
+		// the payload so far, for listeners that want it whole
+		shared_ptr<string> payload;
+	};
+
+	unordered_map<RequestId, Inbound, RequestIdHash> inbound_;
+	size_t reassembly_bytes_ = 0;
+	// when expireInbound() next has something to do
+	chrono::steady_clock::time_point inbound_check_at_ =
+	    chrono::steady_clock::time_point::max();
+	// connections lost since partly received messages were last checked
+	vector<size_t> lost_links_;
+
+	static constexpr size_t kPendingShards = 16;
+	array<PendingShard, kPendingShards> pending_;
+	atomic<size_t> pending_count_{0};
+
+	using TimerClock = TimerWheel<RequestId>::Clock;
+	mutex timers_mtx_;
+	TimerWheel<RequestId> timers_;
+	// when the receive thread next looks at timers_, so callers know
+	// whether an earlier deadline needs to wake it
+	TimerClock::time_point timers_wakeup_ = TimerClock::time_point::max();
+	once_flag rpc_listener_once_;
+	shared_ptr<ViewListener> rpc_listener_;
+
 	//
 	// This function is going to map the protobuf fields for a uuri into a tuple
 	// suitable for compile time expansion
 	//
 	static CallbackKey makeCallbackKey(const optional<UUri>& left,
 	                                   const optional<UUri>& right) {
-		CallbackKey key;
-		if (left) {
-			if (left->authority_name() != "*") {
-				get<0>(key) = left->authority_name();
-			}
-			if (left->ue_id() != 0xffff) {
-				get<1>(key) = left->ue_id();
+		return subscription::makeKey(left, right);
+	}
+
+	static frame::RoutingUUri routingUUri(const UUri& uri) {
+		frame::RoutingUUri ret;
+		ret.authority_name = uri.authority_name();
+		ret.ue_id = uri.ue_id();
+		ret.ue_version_major = uri.ue_version_major();
+		ret.resource_id = uri.resource_id();
+		return ret;
+	}
+
+	Impl(const UUri& default_uuri, const Options& options,
+	     const std::string& dispatcher_ip, int dispatcher_port)
+	    : default_uuri(default_uuri), options_(options),
+	      sent_ids_(max<size_t>(options.echo_ids, 1)) {
+		auto endpoints = options.endpoints;
+		if (endpoints.empty()) {
+			endpoints.push_back(Endpoint{dispatcher_ip, dispatcher_port});
+		}
+		options_.chunk_bytes =
+		    clamp<size_t>(options.chunk_bytes, 1, frame::kMaxBodySize);
+		setUpCompression();
+		setUpRecorder();
+
+		vector<int> fds;
+		for (auto& endpoint : endpoints) {
+			unique_ptr<Link> link;
+			try {
+				link = make_unique<Link>(options.spool_bytes);
+			} catch (const system_error& e) {
+				UP_LOG_ERROR(
+				    "SocketUTransport::SocketUTransport():{},{},{} Spool "
+				    "creation error: {}",
+				    __LINE__, getpid(), default_uuri.authority_name(),
+				    e.what());
+				exit(EXIT_FAILURE);
 			}
-			if (left->ue_version_major() != 0xff) {
-				get<2>(key) = left->ue_version_major();
+			link->name = endpoint.ip + ":" + to_string(endpoint.port);
+			link->backoff = options.reconnect_min;
+			auto& serv_addr = link->address;
+			if (inet_pton(AF_INET, endpoint.ip.c_str(), &serv_addr.sin_addr) <=
+			    0) {
+				UP_LOG_ERROR(
+				    "SocketUTransport::SocketUTransport():{},{},{} Invalid "
+				    "address/ "
+				    "Address not supported",
+				    __LINE__, getpid(), default_uuri.authority_name());
+				exit(EXIT_FAILURE);
 			}
-			if (left->resource_id() != 0xffff) {
-				get<3>(key) = left->resource_id();
+			serv_addr.sin_family = AF_INET;
+			serv_addr.sin_port = htons(endpoint.port);
+
+			int fd;
+			if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+				UP_LOG_ERROR(
+				    "SocketUTransport::SocketUTransport():{},{},{} Socket "
+				    "creation error",
+				    __LINE__, getpid(), default_uuri.authority_name());
+				exit(EXIT_FAILURE);
 			}
+			fds.push_back(fd);
+			links_.push_back(std::move(link));
 		}
-		if (right) {
-			if (right->authority_name() != "*") {
-				get<4>(key) = right->authority_name();
-			}
-			if (right->ue_id() != 0xffff) {
-				get<5>(key) = right->ue_id();
+
+		endpoint_count_ = fds.size();
+		if (options.multicast) {
+			fds.push_back(openMulticast(*options.multicast));
+		}
+		wake_fd_ = make_unique<WakeFd>(fds);
+		readers_.resize(endpoint_count_);
+		setUpFaults();
+
+		// Only the first attempt waits for the connection to be made, later
+		// ones are left to the dispatcher thread.
+		unique_lock<mutex> subscriptions_lock(subscriptions_mtx_);
+		for (size_t i = 0; i < links_.size(); i++) {
+			auto& link = *links_[i];
+			unique_lock<mutex> lock(link.mtx);
+			if (wake_fd_->connect(i, (struct sockaddr*)&link.address,
+			                      sizeof(link.address)) < 0) {
+				UP_LOG_WARN(
+				    "SocketUTransport::SocketUTransport():{},{},{} Socket "
+				    "connection to {} failed, retrying in the background",
+				    __LINE__, getpid(), default_uuri.authority_name(),
+				    link.name);
+				retryLater(i, link);
+				continue;
 			}
-			if (right->ue_version_major() != 0xff) {
-				get<6>(key) = right->ue_version_major();
+			fcntl(wake_fd_->fd(i), F_SETFL,
+			      fcntl(wake_fd_->fd(i), F_GETFL) | O_NONBLOCK);
+			connected(link);
+			if (!drain(i, link)) {
+				disconnect(i, link);
 			}
-			if (right->resource_id() != 0xffff) {
-				get<7>(key) = right->resource_id();
+		}
+		subscriptions_lock.unlock();
+
+		addGauges();
+		process_thread_ = thread([&]() { dispatcher(); });
+	}
+
+	~Impl() {
+		wake_fd_->wake();
+		process_thread_.join();
+		stopped_ = true;
+		runPosted();
+		for (auto& link : links_) {
+			unique_lock<mutex> lock(link->mtx);
+			link->drained.notify_all();
+		}
+
+		UStatus status;
+		status.set_code(UCode::CANCELLED);
+		status.set_message("Transport destroyed before the response.");
+		for (auto& shard : pending_) {
+			for (auto& [id, callback] : shard.calls) {
+				callback(status, nullptr);
 			}
 		}
-		return key;
 	}
 
-	Impl(const UUri& default_uuri, const std::string& dispatcher_ip,
-	     int dispatcher_port)
-	    : default_uuri(default_uuri) {
-		struct sockaddr_in serv_addr;
+	static uint64_t nanosSince(chrono::steady_clock::time_point start) {
+		return chrono::duration_cast<chrono::nanoseconds>(
+		           chrono::steady_clock::now() - start)
+		    .count();
+	}
+
+	void addGauges() {
+		metrics_.gauge("loopback_queue", [this]() {
+			unique_lock<mutex> lock(loopback_mtx_);
+			return loopback_.size();
+		});
+		metrics_.gauge("posted_tasks", [this]() {
+			unique_lock<mutex> lock(loopback_mtx_);
+			return posted_.size();
+		});
+		metrics_.gauge("pending_calls",
+		               [this]() { return pending_count_.load(); });
+		metrics_.gauge("spool_bytes", [this]() {
+			uint64_t bytes = 0;
+			for (auto& link : links_) {
+				unique_lock<mutex> lock(link->mtx);
+				bytes += link->pendingBytes();
+			}
+			return bytes;
+		});
+	}
 
-		if (inet_pton(AF_INET, dispatcher_ip.c_str(), &serv_addr.sin_addr) <=
-		    0) {
-			spdlog::error(
-			    "SocketUTransport::SocketUTransport():{},{},{} Invalid "
-			    "address/ "
-			    "Address not supported",
+	void setUpCompression() {
+		if (!options_.compression) {
+			compressor_ = make_unique<compression::Compressor>(
+			    compression::kZstd, 1, string());
+			return;
+		}
+		auto& config = *options_.compression;
+		auto codec = config.codec == Compression::Codec::kLz4
+		                 ? compression::kLz4
+		                 : compression::kZstd;
+		compressor_ = make_unique<compression::Compressor>(codec, config.level,
+		                                                   config.dictionary);
+		if (!compression::available(codec)) {
+			UP_LOG_ERROR(
+			    "SocketUTransport::SocketUTransport():{},{},{} Compression "
+			    "codec not built in, sending payloads uncompressed",
 			    __LINE__, getpid(), default_uuri.authority_name());
-			exit(EXIT_FAILURE);
+			options_.compression.reset();
 		}
+	}
 
-		int fd;
-		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-			spdlog::error(
-			    "SocketUTransport::SocketUTransport():{},{},{} Socket creation "
-			    "error",
-			    __LINE__, getpid(), default_uuri.authority_name());
-			exit(EXIT_FAILURE);
+	void setUpRecorder() {
+		if (!options_.flight_recording) {
+			return;
+		}
+		auto& config = *options_.flight_recording;
+		try {
+			recorder_ = make_unique<FlightRecorder>(config.path, config.bytes);
+			recorder_->setEnabled(config.enabled);
+		} catch (const system_error& e) {
+			UP_LOG_ERROR(
+			    "SocketUTransport::SocketUTransport():{},{},{} Flight "
+			    "recorder setup failed, not recording: {}",
+			    __LINE__, getpid(), default_uuri.authority_name(), e.what());
 		}
+	}
 
-		wake_fd_ = make_unique<WakeFd>(fd);
+	void setUpFaults() {
+		if (!options_.fault_injection) {
+			return;
+		}
+		auto& config = *options_.fault_injection;
+		auto profile = [](const FaultInjection::Direction& direction,
+		                  double partial) {
+			fault::Profile ret;
+			ret.delay = direction.delay;
+			ret.jitter = direction.jitter;
+			ret.drop = direction.drop;
+			ret.duplicate = direction.duplicate;
+			ret.bytes_per_second = direction.bytes_per_second;
+			ret.partial = partial;
+			return ret;
+		};
+		for (size_t i = 0; i < endpoint_count_; i++) {
+			links_[i]->faults = make_unique<fault::Injector>(
+			    profile(config.send, config.short_writes),
+			    fault::seedFor(config.seed, i, false));
+			receive_faults_.emplace_back(
+			    profile(config.receive, config.short_reads),
+			    fault::seedFor(config.seed, i, true));
+		}
+		delayed_frames_.resize(endpoint_count_);
+		injected_drops_ = &metrics_.counter("injected_drops");
+		injected_duplicates_ = &metrics_.counter("injected_duplicates");
+		UP_LOG_WARN(
+		    "SocketUTransport::SocketUTransport():{},{},{} Injecting faults "
+		    "into the dispatcher connections, seed {}",
+		    __LINE__, getpid(), default_uuri.authority_name(), config.seed);
+	}
 
-		serv_addr.sin_family = AF_INET;
-		serv_addr.sin_port = htons(dispatcher_port);
+	void countInjected(int copies) {
+		if (copies == 0) {
+			injected_drops_->add();
+		} else if (copies > 1) {
+			injected_duplicates_->add();
+		}
+	}
 
-		if (wake_fd_->connect((struct sockaddr*)&serv_addr, sizeof(serv_addr)) <
-		    0) {
-			spdlog::error(
-			    "SocketUTransport::SocketUTransport():{},{},{} Socket "
-			    "connection "
-			    "Failed",
-			    __LINE__, getpid(), default_uuri.authority_name());
+	void record(FlightRecorder::Direction direction, size_t link,
+	            string_view frame) {
+		if (recorder_) {
+			recorder_->append(direction, link, frame);
+		}
+	}
+
+	int openMulticast(const Multicast& config) {
+		auto fail = [&](const char* what) {
+			UP_LOG_ERROR(
+			    "SocketUTransport::SocketUTransport():{},{},{} Multicast "
+			    "setup failed: {}",
+			    __LINE__, getpid(), default_uuri.authority_name(), what);
 			exit(EXIT_FAILURE);
+		};
+		in_addr base;
+		if (config.groups == 0 || config.groups > 20 ||
+		    inet_pton(AF_INET, config.base_group.c_str(), &base) <= 0 ||
+		    inet_pton(AF_INET, config.interface_ip.c_str(),
+		              &multicast_interface_) <= 0) {
+			fail("invalid address");
+		}
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0) {
+			fail("socket");
+		}
+		int on = 1;
+		int off = 0;
+		int rcvbuf = 4 * 1024 * 1024;
+		unsigned char hops = config.hops;
+		unsigned char loop = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		// only deliver the groups this socket joined, rather than every group
+		// joined by any socket on the host
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+		if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &multicast_interface_,
+		               sizeof(multicast_interface_)) < 0) {
+			fail("interface");
 		}
+		sockaddr_in local{};
+		local.sin_family = AF_INET;
+		local.sin_port = htons(config.port);
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (bind(fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+			fail("bind");
+		}
+		for (unsigned i = 0; i < config.groups; i++) {
+			sockaddr_in group{};
+			group.sin_family = AF_INET;
+			group.sin_port = htons(config.port);
+			group.sin_addr.s_addr = htonl(ntohl(base.s_addr) + i);
+			groups_.push_back(group);
+		}
+		group_refs_.resize(config.groups);
+		// WakeFd reads at most 32 KiB at a time
+		options_.multicast->max_datagram =
+		    min<size_t>(config.max_datagram, 32 * 1024);
+		multicast_fd_ = fd;
+		return fd;
+	}
 
-		process_thread_ = thread([&]() { dispatcher(); });
+	size_t groupFor(uint32_t ue_id) const {
+		return (uint64_t(ue_id) * 0x9e3779b97f4a7c15ULL >> 40) % groups_.size();
 	}
 
-	~Impl() {
-		wake_fd_->wake();
-		process_thread_.join();
+	// Join or leave the groups a listener key maps to, keeping count of the
+	// keys that need each one.
+	void updateMembership(const CallbackKey& key, bool join) {
+		if (multicast_fd_ < 0) {
+			return;
+		}
+		auto& ue_id = get<1>(key);
+		size_t first = ue_id ? groupFor(*ue_id) : 0;
+		size_t last = ue_id ? first + 1 : groups_.size();
+		unique_lock<mutex> lock(multicast_mtx_);
+		for (size_t i = first; i < last; i++) {
+			auto& refs = group_refs_[i];
+			if (join ? refs++ > 0 : --refs > 0) {
+				continue;
+			}
+			ip_mreq request{};
+			request.imr_multiaddr = groups_[i].sin_addr;
+			request.imr_interface = multicast_interface_;
+			if (setsockopt(multicast_fd_, IPPROTO_IP,
+			               join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+			               &request, sizeof(request)) < 0) {
+				UP_LOG_ERROR(
+				    "SocketUTransport::registerListener():{},{},{} Failed to "
+				    "update multicast group membership",
+				    __LINE__, getpid(), default_uuri.authority_name());
+			}
+		}
+	}
+
+	metrics::Histogram* allocationHistogram(const string& name) {
+		return allocation::installed() ? &metrics_.histogram(name) : nullptr;
 	}
 
+	// Records what the thread allocated while it was in scope, if the
+	// histograms are there.
+	struct AllocationsTo {
+		metrics::Histogram* allocations;
+		metrics::Histogram* bytes;
+		allocation::Scope scope;
+
+		AllocationsTo(metrics::Histogram* allocations,
+		              metrics::Histogram* bytes)
+		    : allocations(allocations), bytes(bytes) {}
+
+		~AllocationsTo() {
+			if (allocations != nullptr) {
+				auto used = scope.taken();
+				allocations->record(used.allocations);
+				bytes->record(used.bytes);
+			}
+		}
+	};
+
 	UStatus sendImpl(const UMessage& umsg) {
-		spdlog::debug(
+		AllocationsTo allocations{send_allocations_, send_allocated_bytes_};
+		auto& attributes = umsg.attributes();
+		if (expired(attributes)) {
+			return expiredStatus();
+		}
+		UP_LOG_SAMPLED_DEBUG(
+		    kMessageLogsPerSecond,
 		    "SocketUTransport::send():{},{},{} UMessage in string format is : "
 		    "{}",
 		    __LINE__, getpid(), default_uuri.authority_name(),
 		    umsg.ShortDebugString());
 
 		string buf;
-		bool ret = umsg.SerializeToString(&buf);
-		spdlog::debug(
+		if (!serialize(umsg, buf)) {
+			return unframeableStatus();
+		}
+		UP_LOG_SAMPLED_DEBUG(
+		    kMessageLogsPerSecond,
 		    "SocketUTransport::send():{},{},{} Serialized UMessage is {}",
 		    __LINE__, getpid(), default_uuri.authority_name(), repr(buf));
 
+		bool track_echo = trackEcho(attributes.id());
+		auto source_hash = sourceHash(attributes.source());
+		auto status = transmit(
+		    buf, attributes, source_hash,
+		    uuid_time::deadlineMs(attributes.id().msb(), attributes.ttl()));
+		UP_PROBE5(send, attributes.id().msb(), attributes.id().lsb(),
+		          source_hash, buf.size(), int(status.code()));
+		if (status.code() == UCode::OK && track_echo &&
+		    hasListeners(
+		        makeCallbackKey(attributes.source(), attributes.sink()))) {
+			loopback(make_shared<UMessage>(umsg));
+		}
+		return status;
+	}
+
+	UStatus sendTemplate(const MessageTemplate::Encoded& encoded,
+	                     const UUID& id, string_view payload);
+
+	UStatus openStream(const UAttributes& attributes, uint64_t size,
+	                   StreamWriter::State& state);
+	UStatus writeStream(StreamWriter::State& state, string_view data);
+	void abortStream(StreamWriter::State& state);
+	UStatus writeChunk(StreamWriter::State& state, string_view body,
+	                   uint8_t flags, bool wait);
+
+	// A stable hash of a source uuri, for picking the dispatcher a topic is
+	// sent through.
+	static uint64_t sourceHash(const UUri& source) {
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		auto mix = [&](uint64_t byte) {
+			hash = (hash ^ byte) * 0x100000001b3ULL;
+		};
+		for (unsigned char c : source.authority_name()) {
+			mix(c);
+		}
+		for (uint32_t value : {source.ue_id(), source.ue_version_major(),
+		                       source.resource_id()}) {
+			for (int i = 0; i < 4; i++) {
+				mix((value >> (8 * i)) & 0xff);
+			}
+		}
+		return hash;
+	}
+
+	// Jump consistent hash (Lamping and Veach), so that adding an endpoint
+	// at the end of the list only moves the topics that land on it.
+	size_t endpointFor(uint64_t hash) const {
+		int64_t bucket = -1;
+		int64_t next = 0;
+		auto buckets = static_cast<int64_t>(endpoint_count_);
+		while (next < buckets) {
+			bucket = next;
+			hash = hash * 2862933555777941757ULL + 1;
+			next = static_cast<int64_t>((bucket + 1) *
+			                            (double(1LL << 31) /
+			                             double((hash >> 33) + 1)));
+		}
+		return static_cast<size_t>(bucket);
+	}
+
+	// Publish messages small enough for a datagram go out by multicast when
+	// that is enabled, everything else through the dispatcher for the source.
+	UStatus transmit(const string& buf, const UAttributes& attributes,
+	                 uint64_t source_hash, uint64_t deadline_ms) {
+		UStatus status;
+		size_t link;
+		if (multicast_fd_ >= 0 &&
+		    attributes.type() == UMessageType::UMESSAGE_TYPE_PUBLISH &&
+		    buf.size() <= options_.multicast->max_datagram) {
+			link = endpoint_count_;
+			status = sendDatagram(buf, groupFor(attributes.source().ue_id()));
+		} else {
+			link = endpointFor(source_hash);
+			status = write(buf, link, deadline_ms);
+		}
+		if (status.code() == UCode::OK) {
+			messages_sent_.add();
+			bytes_sent_.add(buf.size());
+			record(FlightRecorder::kSent, link, buf);
+		} else {
+			send_failures_.add();
+		}
+		return status;
+	}
+
+	UStatus sendDatagram(const string& buf, size_t group) {
 		UStatus status;
 		status.set_code(UCode::OK);
 		status.set_message("OK");
 
-		if (wake_fd_->send(buf.c_str(), buf.size(), 0) < 0) {
-			spdlog::error(
-			    "SocketUTransport::send():{},{},{} Error sending UMessage",
+		auto start = chrono::steady_clock::now();
+		auto n = sendto(multicast_fd_, buf.data(), buf.size(),
+		                MSG_NOSIGNAL | MSG_DONTWAIT,
+		                (struct sockaddr*)&groups_[group],
+		                sizeof(groups_[group]));
+		auto ns = nanosSince(start);
+		send_ns_.record(ns);
+		UP_PROBE3(send_syscall, endpoint_count_, buf.size(), ns);
+		if (n < 0) {
+			UP_LOG_SAMPLED_ERROR(
+			    kMessageErrorsPerSecond,
+			    "SocketUTransport::send():{},{},{} Error sending multicast "
+			    "datagram",
 			    __LINE__, getpid(), default_uuri.authority_name());
 			status.set_code(UCode::INTERNAL);
-			status.set_message("Sending data in socket failed.");
-			return status;
+			status.set_message("Sending multicast datagram failed.");
 		}
+		return status;
+	}
+
+	UStatus write(const string& buf, size_t endpoint,
+	              uint64_t deadline_ms = 0) {
+		auto& link = *links_[endpoint];
+		unique_lock<mutex> lock(link.mtx);
+		return writeLocked(link, endpoint, buf, deadline_ms);
+	}
 
+	// Never blocks. What the socket doesn't take right away waits in the
+	// spool for the dispatcher thread to send it. With fault injection, the
+	// frame may be lost, doubled or held back first; control frames are
+	// never lost, as the dispatcher relies on them.
+	UStatus writeLocked(Link& link, size_t endpoint, string_view buf,
+	                    uint64_t deadline_ms, bool control = false) {
+		if (!link.faults) {
+			return writeNow(link, endpoint, buf, deadline_ms);
+		}
+		int copies = control ? 1 : link.faults->copies();
+		countInjected(copies);
+		UStatus status;
+		status.set_code(UCode::OK);
+		status.set_message("OK");
+		for (int i = 0; i < copies; i++) {
+			if (!link.faults->delays()) {
+				status = writeNow(link, endpoint, buf, deadline_ms);
+				continue;
+			}
+			// held back like the spool holds what the socket doesn't take
+			if (link.delayed_bytes + buf.size() > options_.spool_bytes) {
+				status.set_code(UCode::UNAVAILABLE);
+				status.set_message("Dispatcher unavailable and spool full.");
+				break;
+			}
+			bool was_empty = link.delayed.empty();
+			link.delayed.push(
+			    link.faults->arrival(buf.size(), chrono::steady_clock::now()),
+			    Link::Delayed{string(buf), deadline_ms});
+			link.delayed_bytes += buf.size();
+			if (was_empty) {
+				// have the dispatcher thread wait for it to be due
+				wake_fd_->notify();
+			}
+		}
 		return status;
 	}
 
-	void dispatcher() {
-		while (true) {
-			try {
-				if (wake_fd_->read(buffer_) == false)
-					break;
-				spdlog::debug(
-				    "SocketUTransport::dispatcher:{},{},{} Received {}",
-				    __LINE__, getpid(), default_uuri.authority_name(),
-				    repr(buffer_));
-
-				UMessage umsg;
-				try {
-					if (!umsg.ParseFromString(buffer_)) {
-						spdlog::error(
-						    "SocketUTransport::dispatcher:{},{},{} Error "
-						    "parsing UMessage",
-						    __LINE__, getpid(), default_uuri.authority_name());
-						continue;
-					}
-				} catch (const google::protobuf::FatalException& e) {
-					spdlog::error(
-					    "SocketUTransport::dispatcher:{},{},{} Protobuf "
-					    "exception: {}",
-					    __LINE__, getpid(), default_uuri.authority_name(),
-					    e.what());
-					continue;
-				}
+	UStatus writeNow(Link& link, size_t endpoint, string_view buf,
+	                 uint64_t deadline_ms) {
+		UStatus status;
+		status.set_code(UCode::OK);
+		status.set_message("OK");
 
-				spdlog::debug(
-				    "SocketUTransport::dispatcher:{},{},{} Received "
-				    "uMessage:{}",
+		bool was_pending = link.pending();
+		if (link.state == Link::kUp && !link.broken && !was_pending) {
+			// a short write from fault injection leaves the rest to the head
+			auto length =
+			    link.faults ? link.faults->partial(buf.size()) : buf.size();
+			auto start = chrono::steady_clock::now();
+			auto n = wake_fd_->send(endpoint, buf.data(), length,
+			                        MSG_NOSIGNAL | MSG_DONTWAIT);
+			auto ns = nanosSince(start);
+			send_ns_.record(ns);
+			UP_PROBE3(send_syscall, endpoint, buf.size(), ns);
+			if (n == static_cast<ssize_t>(buf.size())) {
+				return status;
+			}
+			if (n > 0) {
+				// the rest has to follow before anything else on the stream
+				link.head.assign(buf.substr(n));
+				wake_fd_->notify();
+				return status;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				UP_LOG_SAMPLED_ERROR(
+				    kMessageErrorsPerSecond,
+				    "SocketUTransport::send():{},{},{} Error sending UMessage",
+				    __LINE__, getpid(), default_uuri.authority_name());
+				link.broken = true;
+			}
+		}
+
+		if (!link.spool.push(buf, deadline_ms)) {
+			if (!link.dropping) {
+				UP_LOG_WARN(
+				    "SocketUTransport::send():{},{},{} Spool for {} is full, "
+				    "dropping messages",
 				    __LINE__, getpid(), default_uuri.authority_name(),
-				    umsg.ShortDebugString());
-
-				auto& attributes = umsg.attributes();
-				auto key =
-				    makeCallbackKey(attributes.source(), attributes.sink());
-				auto patterns = generateOptionals(key);
-				size_t match_count = 0;
-				for (const auto& pattern : patterns) {
-					auto ptr = callback_data_.find(pattern);
-					if (ptr != nullptr) {
-						spdlog::debug(
-						    "SocketUTransport::dispatcher:{},{},{} Matched {} "
-						    "to {}",
-						    __LINE__, getpid(), default_uuri.authority_name(),
-						    to_string(key), to_string(pattern));
-						unique_lock<mutex> lock(ptr->mtx);
-						for (auto callback : ptr->listeners) {
-							callback(umsg);
-							match_count++;
-						}
-					}
-				}
-				if (match_count == 0) {
-					spdlog::debug(
-					    "SocketUTransport::dispatcher:{},{},{} Failed to match against {}",
-					    __LINE__, getpid(), default_uuri.authority_name(),
-					    to_string(key));
-					for (const auto& pattern : patterns) {
-						spdlog::debug(
-						    "SocketUTransport::dispatcher: Attempted {}", to_string(pattern));
-					}
-				}
+				    link.name);
+				link.dropping = true;
+			}
+			status.set_code(UCode::UNAVAILABLE);
+			status.set_message("Dispatcher unavailable and spool full.");
+			return status;
+		}
+		link.dropping = false;
+		if (!was_pending && link.state == Link::kUp) {
+			// have the dispatcher thread wait for room in the socket
+			wake_fd_->notify();
+		}
+		return status;
+	}
 
-			} catch (const system_error& e) {
-				if (e.code() == errc::io_error) {
-					spdlog::error(
-					    "SocketUTransport::dispatcher:{},{},{} I/O error: {}",
-					    __LINE__, getpid(), default_uuri.authority_name(),
-					    e.what());
-				} else {
-					throw;  // rethrow the exception if it's not an I/O error
-				}
+	// Sends what waits for a connection that is up, until the socket takes
+	// no more. Returns false if the connection failed. Called with link.mtx
+	// held.
+	bool drain(size_t index, Link& link) {
+		while (!link.head.empty()) {
+			auto n = wake_fd_->send(index, link.head.data(), link.head.size(),
+			                        MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0) {
+				return errno == EAGAIN || errno == EWOULDBLOCK ||
+				       errno == EINTR;
 			}
+			link.head.erase(0, n);
 		}
+		uint64_t expired = 0;
+		// peers reading bare messages need each one in a write of its own
+		bool ok = link.spool.drain(
+		    wake_fd_->fd(index), uuid_time::nowMs(), expired,
+		    options_.routing_header ? Spool::kMaxBatch : 1);
+		expired_sent_.add(expired);
+		return ok;
 	}
 
-	UStatus registerListenerImpl(CallableConn& listener,
-	                             const UUri& source_filter,
-	                             optional<UUri>& sink_filter) {
-		UStatus retval;
-		retval.set_code(UCode::OK);
-		auto key = makeCallbackKey(source_filter, sink_filter);
-		spdlog::debug(
-		    "SocketUTransport::dispatcher:{},{},{} registerListenerImpl "
-		    "inserting {}",
-		    __LINE__, getpid(), default_uuri.authority_name(), to_string(key));
-		auto ptr = callback_data_.find(key, true);
-		unique_lock<mutex> lock(ptr->mtx);
-		ptr->listeners.insert(listener);
-		return retval;
+	// Called with subscriptions_mtx_ and link.mtx held.
+	void connected(Link& link) {
+		if (link.was_up) {
+			UP_LOG_INFO(
+			    "SocketUTransport::dispatcher:{},{},{} Reconnected to {}",
+			    __LINE__, getpid(), default_uuri.authority_name(), link.name);
+		}
+		link.state = Link::kUp;
+		link.was_up = true;
+		link.backoff = options_.reconnect_min;
+		// a new connection knows nothing of our listeners
+		if (options_.routing_header) {
+			subscription::appendControl(link.head, subscription::kSelective);
+			for (auto& key : subscriptions_) {
+				subscription::appendControl(link.head, subscription::kSubscribe,
+				                            &key);
+			}
+		}
 	}
 
-	void cleanupListener(CallableConn listener) {
-		callback_data_.erase([&](shared_ptr<CallbackData> ptr) {
-			unique_lock<mutex> lock(ptr->mtx);
-			ptr->listeners.erase(listener);
+	void disconnect(size_t index, Link& link) {
+		UP_LOG_WARN(
+		    "SocketUTransport::dispatcher:{},{},{} Lost connection to {}, "
+		    "reconnecting",
+		    __LINE__, getpid(), default_uuri.authority_name(), link.name);
+		retryLater(index, link);
+	}
+
+	// Closes the connection and schedules the next attempt, backing off
+	// exponentially with some jitter so clients don't all come back at once
+	// after a dispatcher restart.
+	void retryLater(size_t index, Link& link) {
+		wake_fd_->replace(index, -1);
+		link.state = Link::kDown;
+		link.broken = false;
+		link.head.clear();
+		link.spool.discardPartial();
+		// stream writers waiting for room stop waiting on this connection
+		link.drained.notify_all();
+		readers_[index] = frame::Reader();
+		lost_links_.push_back(index);
+		uniform_real_distribution<double> jitter(0.75, 1.25);
+		link.retry_at = chrono::steady_clock::now() +
+		                chrono::duration_cast<chrono::milliseconds>(
+		                    link.backoff * jitter(jitter_));
+		link.backoff = min(link.backoff * 2, options_.reconnect_max);
+	}
+
+	void startConnect(size_t index, Link& link) {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		wake_fd_->replace(index, fd);
+		if (fd < 0) {
+			retryLater(index, link);
+		} else if (connect(fd, (struct sockaddr*)&link.address,
+		                   sizeof(link.address)) == 0) {
+			connected(link);
+		} else if (errno == EINPROGRESS) {
+			link.state = Link::kConnecting;
+		} else {
+			retryLater(index, link);
+		}
+	}
+
+	void finishConnect(size_t index, Link& link, short events) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		// read() may already have taken the error, leaving only the hangup
+		if ((events & (POLLHUP | POLLERR)) ||
+		    getsockopt(wake_fd_->fd(index), SOL_SOCKET, SO_ERROR, &error,
+		               &len) < 0 ||
+		    error != 0) {
+			retryLater(index, link);
+		} else {
+			connected(link);
+		}
+	}
+
+	// Runs on the dispatcher thread before each wait and returns how many ms
+	// it may last, or -1 for no limit.
+	int waitTimeout() {
+		auto links = serviceLinks();
+		auto frames = releaseDelayedFrames();
+		dropLostInbound();
+		auto inbound = expireInbound();
+		auto calls = expireCalls();
+		runPosted();
+		int timeout = -1;
+		for (int t : {links, frames, inbound, calls, dumpMetrics()}) {
+			if (t >= 0 && (timeout < 0 || t < timeout)) {
+				timeout = t;
+			}
+		}
+		return timeout;
+	}
+
+	// Logs the metrics every metrics_interval. Returns how many ms until the
+	// next time, or -1 when turned off.
+	int dumpMetrics() {
+		if (options_.metrics_interval.count() <= 0) {
+			return -1;
+		}
+		auto now = chrono::steady_clock::now();
+		if (now >= next_dump_) {
+			if (next_dump_ != chrono::steady_clock::time_point{}) {
+				UP_LOG_INFO("SocketUTransport::metrics:{},{},{}\n{}", __LINE__,
+				            getpid(), default_uuri.authority_name(),
+				            metrics_.snapshot().text());
+			}
+			next_dump_ = now + options_.metrics_interval;
+		}
+		return chrono::ceil<chrono::milliseconds>(next_dump_ - now).count();
+	}
+
+	// Runs on the dispatcher thread before each wait. Completes connection
+	// attempts, closes failed connections, starts new attempts once their
+	// backoff ran out and sends what waits in the spools. Returns how many
+	// ms the wait may last.
+	int serviceLinks() {
+		auto now = chrono::steady_clock::now();
+		int timeout = -1;
+		unique_lock<mutex> subscriptions_lock(subscriptions_mtx_);
+		for (size_t i = 0; i < links_.size(); i++) {
+			auto& link = *links_[i];
+			unique_lock<mutex> lock(link.mtx);
+			auto events = wake_fd_->events(i);
+			if (link.state == Link::kConnecting && events != 0) {
+				finishConnect(i, link, events);
+			} else if (link.state == Link::kUp &&
+			           (link.broken || (events & (POLLHUP | POLLERR)))) {
+				disconnect(i, link);
+			}
+			if (link.state == Link::kDown && now >= link.retry_at) {
+				startConnect(i, link);
+			}
+			releaseDelayed(i, link, now);
+			if (link.state == Link::kUp && link.pending()) {
+				if (!drain(i, link)) {
+					disconnect(i, link);
+				}
+				link.drained.notify_all();
+			}
+			wake_fd_->watchWritable(
+			    i, link.state == Link::kConnecting ||
+			           (link.state == Link::kUp && link.pending()));
+			if (link.state == Link::kDown) {
+				auto wait = chrono::ceil<chrono::milliseconds>(link.retry_at -
+				                                               now)
+				                .count();
+				wait = max<decltype(wait)>(wait, 0);
+				timeout = timeout < 0 ? wait : min<decltype(wait)>(timeout, wait);
+			}
+			int delayed = link.delayed.timeoutMs(now);
+			if (delayed >= 0 && (timeout < 0 || delayed < timeout)) {
+				timeout = delayed;
+			}
+		}
+		return timeout;
+	}
+
+	// Passes on the sends that fault injection held back once they are due.
+	// Called with link.mtx held.
+	void releaseDelayed(size_t index, Link& link,
+	                    chrono::steady_clock::time_point now) {
+		if (link.delayed.empty()) {
+			return;
+		}
+		link.delayed.release(now, [&](Link::Delayed&& delayed) {
+			link.delayed_bytes -= delayed.bytes.size();
+			writeNow(link, index, delayed.bytes, delayed.deadline_ms);
 		});
+		link.drained.notify_all();
 	}
-};
 
-SocketUTransport::SocketUTransport(const UUri& default_uuri,
-                                   const std::string& dispatcher_ip,
-                                   int dispatcher_port)
-    : UTransport(default_uuri),
-      pImpl(new Impl(default_uuri, dispatcher_ip, dispatcher_port)) {}
+	// Delivers the received frames that fault injection held back once
+	// they are due, and returns how many ms until the next one.
+	int releaseDelayedFrames() {
+		auto now = chrono::steady_clock::now();
+		int timeout = -1;
+		for (size_t i = 0; i < delayed_frames_.size(); i++) {
+			auto& frames = delayed_frames_[i];
+			frames.release(now,
+			               [&](frame::Frame&& frame) { receive(frame, i); });
+			int wait = frames.timeoutMs(now);
+			if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+				timeout = wait;
+			}
+		}
+		return timeout;
+	}
 
-UStatus SocketUTransport::sendImpl(const UMessage& umsg) {
-	return pImpl->sendImpl(umsg);
-}
+	static bool expired(const UAttributes& attributes) {
+		return attributes.ttl() > 0 &&
+		       uuid_time::expired(attributes.id().msb(), attributes.ttl(),
+		                          uuid_time::nowMs());
+	}
 
-UStatus SocketUTransport::registerListenerImpl(CallableConn&& listener,
-                                               const UUri& source_filter,
-                                               optional<UUri>&& sink_filter) {
-	return pImpl->registerListenerImpl(listener, source_filter, sink_filter);
-}
+	UStatus unframeableStatus() {
+		send_failures_.add();
+		UP_LOG_SAMPLED_ERROR(
+		    kMessageErrorsPerSecond,
+		    "SocketUTransport::send():{},{},{} Message doesn't fit in a frame",
+		    __LINE__, getpid(), default_uuri.authority_name());
+		UStatus status;
+		status.set_code(UCode::INVALID_ARGUMENT);
+		status.set_message(
+		    "Message too large for a frame, or its addresses too long for a "
+		    "routing header.");
+		return status;
+	}
 
-void SocketUTransport::cleanupListener(CallableConn listener) {
-	pImpl->cleanupListener(listener);
+	UStatus expiredStatus() {
+		expired_sent_.add();
+		UP_LOG_SAMPLED_DEBUG(
+		    kMessageLogsPerSecond,
+		    "SocketUTransport::send():{},{},{} Message expired before sending",
+		    __LINE__, getpid(), default_uuri.authority_name());
+		UStatus status;
+		status.set_code(UCode::DEADLINE_EXCEEDED);
+		status.set_message("Message ttl expired before sending.");
+		return status;
+	}
+
+	// Remember the id of an outgoing message so its echo can be dropped.
+	// Without an id the echo can't be recognized, so it will be delivered
+	// the usual way when it comes back from the dispatcher.
+	bool trackEcho(const UUID& id) {
+		if (id.msb() == 0 && id.lsb() == 0) {
+			return false;
+		}
+		sent_ids_.insert(id.msb(), id.lsb());
+		return true;
+	}
+
+	// Hand a sent message to local listeners on the dispatcher thread.
+	void loopback(shared_ptr<const UMessage> umsg) {
+		unique_lock<mutex> lock(loopback_mtx_);
+		bool was_empty = loopback_.empty();
+		loopback_.push_back(std::move(umsg));
+		if (was_empty) {
+			wake_fd_->notify();
+		}
+	}
+
+	void post(function<void()>&& task) {
+		if (stopped_) {
+			// nothing else will run it
+			task();
+			return;
+		}
+		unique_lock<mutex> lock(loopback_mtx_);
+		bool was_empty = posted_.empty();
+		posted_.push_back(std::move(task));
+		// the receive thread runs its own posts before it waits again
+		if (was_empty && this_thread::get_id() != process_thread_.get_id()) {
+			wake_fd_->notify();
+		}
+	}
+
+	void runPosted() {
+		while (true) {
+			deque<function<void()>> tasks;
+			{
+				unique_lock<mutex> lock(loopback_mtx_);
+				if (posted_.empty()) {
+					return;
+				}
+				tasks.swap(posted_);
+			}
+			for (auto& task : tasks) {
+				task();
+			}
+		}
+	}
+
+	//
+	// Produce the bytes to write for a message: a bare serialized UMessage,
+	// or a frame with a routing header when that option is enabled. Returns
+	// false for a message that doesn't fit in a frame, as a bare one among
+	// frames would throw the receiver's parser off.
+	//
+	bool serialize(const UMessage& umsg, string& buf) {
+		if (!options_.routing_header) {
+			return umsg.SerializeToString(&buf);
+		}
+		if (shouldCompress(umsg) && serializeCompressed(umsg, buf)) {
+			return true;
+		}
+		auto body_len = umsg.ByteSizeLong();
+		buf.assign(frame::kHeaderSize, '\0');
+		if (body_len > frame::kMaxBodySize ||
+		    !appendRouting(buf, umsg.attributes())) {
+			return false;
+		}
+		frame::Header header;
+		header.flags = frame::kRouting;
+		header.ext_len = buf.size() - frame::kHeaderSize;
+		header.body_len = body_len;
+		frame::writeHeader(buf, header);
+		auto offset = buf.size();
+		buf.resize(offset + body_len);
+		return umsg.SerializeToArray(buf.data() + offset, body_len);
+	}
+
+	bool shouldCompress(const UMessage& umsg) const {
+		if (!options_.compression || !umsg.has_payload()) {
+			return false;
+		}
+		auto& config = *options_.compression;
+		auto format = umsg.attributes().payload_format();
+		return umsg.payload().size() >= config.min_bytes &&
+		       umsg.payload().size() <= frame::kMaxBodySize &&
+		       find(config.formats.begin(), config.formats.end(), format) !=
+		           config.formats.end();
+	}
+
+	// A frame whose body holds the message with its payload compressed.
+	// Returns false, to send the message as usual, if that doesn't pay off.
+	bool serializeCompressed(const UMessage& umsg, string& buf) {
+		auto& payload = umsg.payload();
+		bool with_dictionary =
+		    payload.size() < options_.compression->dictionary_below;
+		thread_local string packed;
+		if (!compressor_->compress(payload, with_dictionary, packed)) {
+			return false;
+		}
+		buf.assign(frame::kHeaderSize, '\0');
+		if (!appendRouting(buf, umsg.attributes())) {
+			return false;
+		}
+		frame::Compressed compressed;
+		compressed.codec = compressor_->codec();
+		compressed.dictionary_id =
+		    with_dictionary ? compressor_->dictionaryId() : 0;
+		compressed.size = payload.size();
+		frame::appendCompressed(buf, compressed);
+		frame::Header header;
+		header.flags = frame::kRouting | frame::kCompressed;
+		header.ext_len = buf.size() - frame::kHeaderSize;
+		auto offset = buf.size();
+		umessage_wire::appendMessage(buf, umsg.attributes().SerializeAsString(),
+		                             packed);
+		header.body_len = buf.size() - offset;
+		frame::writeHeader(buf, header);
+		return true;
+	}
+
+	static bool appendRouting(string& buf, const UAttributes& attributes) {
+		frame::Routing routing;
+		routing.type = attributes.type();
+		routing.priority = attributes.priority();
+		routing.source = routingUUri(attributes.source());
+		routing.sink = routingUUri(attributes.sink());
+		return frame::appendRouting(buf, routing);
+	}
+
+	MessageTemplate makeTemplate(const UAttributes& attributes);
+
+	bool hasListeners(const CallbackKey& key) {
+		return callback_data_.anyMatch(key, [](const CallbackData& data) {
+			return data.listener_count > 0;
+		});
+	}
+
+	void drainLoopback() {
+		deque<shared_ptr<const UMessage>> pending;
+		{
+			unique_lock<mutex> lock(loopback_mtx_);
+			pending.swap(loopback_);
+		}
+		for (const auto& umsg : pending) {
+			if (expired(umsg->attributes())) {
+				expired_received_.add();
+				continue;
+			}
+			MessageView view;
+			view.attributes_ = &umsg->attributes();
+			view.payload_ = umsg->payload();
+			view.has_payload_ = umsg->has_payload();
+			view.buffer_ = shared_ptr<const string>(umsg, &umsg->payload());
+			view.full_ = umsg.get();
+			deliver(view);
+		}
+	}
+
+	// Stream listeners get the payload as a single chunk, unless they had
+	// it chunk by chunk already.
+	void deliver(const MessageView& view, bool streams = true) {
+		auto dispatched = chrono::steady_clock::now();
+		auto& attributes = view.attributes();
+		auto key = makeCallbackKey(attributes.source(), attributes.sink());
+		size_t match_count = 0;
+		size_t probes = 0;
+		auto matches = callback_data_.findMatches(key, &probes);
+		match_probes_.record(probes);
+		UP_PROBE5(match, attributes.id().msb(), attributes.id().lsb(),
+		          sourceHash(attributes.source()), probes, matches.size());
+		for (const auto& ptr : matches) {
+			UP_LOG_SAMPLED_DEBUG(
+			    kMessageLogsPerSecond,
+			    "SocketUTransport::dispatcher:{},{},{} Matched {}",
+			    __LINE__, getpid(), default_uuri.authority_name(),
+			    to_string(key));
+			unique_lock<mutex> lock(ptr->mtx);
+			for (const auto& listener : ptr->view_listeners) {
+				auto start = chrono::steady_clock::now();
+				(*listener)(view);
+				auto ns = nanosSince(start);
+				callback_ns_.record(ns);
+				UP_PROBE4(callback, attributes.id().msb(),
+				          attributes.id().lsb(), 0, ns);
+				match_count++;
+			}
+			for (auto callback : ptr->listeners) {
+				auto start = chrono::steady_clock::now();
+				callback(view.message());
+				auto ns = nanosSince(start);
+				callback_ns_.record(ns);
+				UP_PROBE4(callback, attributes.id().msb(),
+				          attributes.id().lsb(), 1, ns);
+				match_count++;
+			}
+			if (streams && !ptr->stream_listeners.empty()) {
+				ChunkView chunk;
+				chunk.attributes_ = view.attributes_;
+				chunk.total_ = view.payload_.size();
+				chunk.data_ = view.payload_;
+				chunk.buffer_ = view.buffer_;
+				for (const auto& listener : ptr->stream_listeners) {
+					auto start = chrono::steady_clock::now();
+					(*listener)(chunk);
+					auto ns = nanosSince(start);
+					callback_ns_.record(ns);
+					UP_PROBE4(callback, attributes.id().msb(),
+					          attributes.id().lsb(), 2, ns);
+					match_count++;
+				}
+			}
+		}
+		if (match_count == 0) {
+			unmatched_.add();
+			UP_LOG_SAMPLED_DEBUG(
+			    kMessageLogsPerSecond,
+			    "SocketUTransport::dispatcher:{},{},{} Failed to match against {}",
+			    __LINE__, getpid(), default_uuri.authority_name(),
+			    to_string(key));
+		} else if (options_.latency_tracing) {
+			traceLatency(attributes, dispatched);
+		}
+	}
+
+	// Records, under the topic of a message, how long it took from the
+	// creation time in its id to being dispatched here, and from there until
+	// its listeners were done with it. Only called on the receive thread.
+	void traceLatency(const UAttributes& attributes,
+	                  chrono::steady_clock::time_point dispatched) {
+		auto done = chrono::steady_clock::now();
+		auto created_ms = uuid_time::timestampMs(attributes.id().msb());
+		if (!created_ms) {
+			return;
+		}
+		int64_t callback_ns =
+		    chrono::duration_cast<chrono::nanoseconds>(done - dispatched)
+		        .count();
+		// back to when it was dispatched, on the clock the producer used
+		int64_t now_ns = chrono::duration_cast<chrono::nanoseconds>(
+		                     chrono::system_clock::now().time_since_epoch())
+		                     .count() -
+		                 callback_ns;
+		// a producer with its clock ahead makes it look negative
+		uint64_t producer_ns =
+		    max<int64_t>(now_ns - int64_t(*created_ms) * 1000000, 0);
+
+		auto& source = attributes.source();
+		auto& latency = topicLatency(source);
+		latency.producer->record(producer_ns);
+		latency.callback->record(callback_ns);
+
+		auto& tracing = *options_.latency_tracing;
+		auto outlier = chrono::duration_cast<chrono::nanoseconds>(
+		                   tracing.outlier)
+		                   .count();
+		if (producer_ns + callback_ns < uint64_t(outlier)) {
+			return;
+		}
+		latency_outliers_.add();
+		// at most one warning a second, however bad things get
+		if (done - last_outlier_warning_ < chrono::seconds(1)) {
+			outliers_unreported_++;
+			return;
+		}
+		last_outlier_warning_ = done;
+		UP_LOG_WARN(
+		    "SocketUTransport::dispatcher:{},{},{} Slow message from {} id "
+		    "{:016x}{:016x}: {} us from producer to dispatch, {} us in "
+		    "listeners, {} more not reported",
+		    __LINE__, getpid(), default_uuri.authority_name(),
+		    uprotocol::datamodel::serializer::uri::AsString::serialize(source),
+		    attributes.id().msb(), attributes.id().lsb(), producer_ns / 1000,
+		    callback_ns / 1000, std::exchange(outliers_unreported_, 0));
+	}
+
+	TopicLatency& topicLatency(const UUri& source) {
+		TopicKey key{source.authority_name(),
+		             (uint64_t(source.ue_id()) << 24) |
+		                 (uint64_t(source.ue_version_major() & 0xff) << 16) |
+		                 (source.resource_id() & 0xffff)};
+		auto it = topic_latency_.find(key);
+		if (it != topic_latency_.end()) {
+			return it->second;
+		}
+		// past the limit, topics share a pair of histograms
+		string topic = "other";
+		if (topic_latency_.size() < options_.latency_tracing->max_topics) {
+			topic = uprotocol::datamodel::serializer::uri::AsString::serialize(
+			    source);
+		} else {
+			key = TopicKey{};
+			if (auto other = topic_latency_.find(key);
+			    other != topic_latency_.end()) {
+				return other->second;
+			}
+		}
+		TopicLatency latency;
+		latency.producer = &metrics_.histogram(
+		    "producer_latency_ns{topic=\"" + topic + "\"}");
+		latency.callback = &metrics_.histogram(
+		    "dispatch_latency_ns{topic=\"" + topic + "\"}");
+		return topic_latency_.emplace(std::move(key), latency).first->second;
+	}
+
+	void deliverChunk(const CallbackKey& key, const ChunkView& chunk) {
+		for (const auto& ptr : callback_data_.findMatches(key)) {
+			unique_lock<mutex> lock(ptr->mtx);
+			for (const auto& listener : ptr->stream_listeners) {
+				auto start = chrono::steady_clock::now();
+				(*listener)(chunk);
+				auto ns = nanosSince(start);
+				callback_ns_.record(ns);
+				UP_PROBE4(callback, chunk.attributes().id().msb(),
+				          chunk.attributes().id().lsb(), 2, ns);
+			}
+		}
+	}
+
+	// Whether a message needs reassembling for listeners of other kinds.
+	bool wantsWhole(const CallbackKey& key) {
+		return callback_data_.anyMatch(key, [](const CallbackData& data) {
+			return data.listener_count > data.stream_listener_count;
+		});
+	}
+
+	void receiveChunk(const frame::Frame& frame, size_t link) {
+		frame::Chunk chunk;
+		if (!frame::parseChunk(frame.ext, chunk)) {
+			parse_failures_.add();
+			UP_LOG_SAMPLED_ERROR(
+			    kMessageErrorsPerSecond,
+			    "SocketUTransport::dispatcher:{},{},{} Error parsing chunk "
+			    "header",
+			    __LINE__, getpid(), default_uuri.authority_name());
+			return;
+		}
+		if (chunk.seq == 0) {
+			startInbound(frame, chunk, link);
+			return;
+		}
+		auto it = inbound_.find({chunk.msb, chunk.lsb});
+		if (it == inbound_.end()) {
+			// started before we listened, or given up on already
+			return;
+		}
+		auto& inbound = it->second;
+		if (chunk.flags & frame::kAbort) {
+			dropInbound(it, "aborted by the sender");
+			return;
+		}
+		if (chunk.seq != inbound.next_seq ||
+		    frame.body.size() > inbound.total - inbound.received) {
+			dropInbound(it, "missing a chunk");
+			return;
+		}
+		if (inbound.deadline_ms != 0 &&
+		    inbound.deadline_ms < uuid_time::nowMs()) {
+			expired_received_.add();
+			dropInbound(it, "expired");
+			return;
+		}
+		inbound.next_seq++;
+		inbound.last_chunk = chrono::steady_clock::now();
+		ChunkView view;
+		view.attributes_ = &inbound.attributes;
+		view.offset_ = inbound.received;
+		view.total_ = inbound.total;
+		view.data_ = frame.body;
+		view.buffer_ = frame.owner;
+		inbound.received += frame.body.size();
+		if (inbound.payload) {
+			inbound.payload->append(frame.body);
+		}
+		deliverChunk(inbound.key, view);
+		if (inbound.received == inbound.total) {
+			finishInbound(it);
+		}
+	}
+
+	void startInbound(const frame::Frame& frame, const frame::Chunk& chunk,
+	                  size_t link) {
+		Inbound inbound;
+		string_view payload;
+		bool has_payload;
+		try {
+			if (!umessage_wire::parseAttributes(frame.body, inbound.attributes,
+			                                    payload, has_payload)) {
+				parse_failures_.add();
+				UP_LOG_SAMPLED_ERROR(
+				    kMessageErrorsPerSecond,
+				    "SocketUTransport::dispatcher:{},{},{} Error parsing "
+				    "chunked UMessage",
+				    __LINE__, getpid(), default_uuri.authority_name());
+				return;
+			}
+		} catch (const google::protobuf::FatalException& e) {
+			parse_failures_.add();
+			UP_LOG_SAMPLED_ERROR(
+			    kMessageErrorsPerSecond,
+			    "SocketUTransport::dispatcher:{},{},{} Protobuf "
+			    "exception: {}",
+			    __LINE__, getpid(), default_uuri.authority_name(), e.what());
+			return;
+		}
+		if (expired(inbound.attributes)) {
+			expired_received_.add();
+			return;
+		}
+		auto& attributes = inbound.attributes;
+		inbound.key = makeCallbackKey(attributes.source(), attributes.sink());
+		inbound.link = link;
+		inbound.total = chunk.total;
+		inbound.deadline_ms =
+		    uuid_time::deadlineMs(attributes.id().msb(), attributes.ttl());
+		inbound.last_chunk = chrono::steady_clock::now();
+		inbound_check_at_ = min(inbound_check_at_,
+		                        inbound.last_chunk + options_.stream_idle);
+		if (inbound.deadline_ms != 0) {
+			inbound_check_at_ = min(
+			    inbound_check_at_,
+			    inbound.last_chunk + chrono::milliseconds(inbound.deadline_ms -
+			                                              uuid_time::nowMs()));
+		}
+		if (wantsWhole(inbound.key)) {
+			if (chunk.total <= options_.reassembly_bytes - reassembly_bytes_) {
+				inbound.payload = make_shared<string>();
+				inbound.payload->reserve(chunk.total);
+				reassembly_bytes_ += chunk.total;
+			} else {
+				UP_LOG_WARN(
+				    "SocketUTransport::dispatcher:{},{},{} No room to "
+				    "reassemble a message of {} bytes, passing it to stream "
+				    "listeners only",
+				    __LINE__, getpid(), default_uuri.authority_name(),
+				    chunk.total);
+			}
+		}
+
+		RequestId id{chunk.msb, chunk.lsb};
+		if (auto it = inbound_.find(id); it != inbound_.end()) {
+			dropInbound(it, "started over");
+		}
+		auto it = inbound_.emplace(id, std::move(inbound)).first;
+		if (chunk.total == 0) {
+			ChunkView view;
+			view.attributes_ = &it->second.attributes;
+			deliverChunk(it->second.key, view);
+			finishInbound(it);
+		}
+	}
+
+	void finishInbound(decltype(inbound_)::iterator it) {
+		auto inbound = std::move(it->second);
+		inbound_.erase(it);
+		if (!inbound.payload) {
+			return;
+		}
+		reassembly_bytes_ -= inbound.total;
+		MessageView view;
+		view.attributes_ = &inbound.attributes;
+		view.payload_ = *inbound.payload;
+		view.has_payload_ = true;
+		view.buffer_ = std::move(inbound.payload);
+		deliver(view, false);
+	}
+
+	void dropInbound(decltype(inbound_)::iterator it, const char* reason) {
+		UP_LOG_SAMPLED_DEBUG(
+		    kMessageLogsPerSecond,
+		    "SocketUTransport::dispatcher:{},{},{} Dropped chunked message, "
+		    "{}",
+		    __LINE__, getpid(), default_uuri.authority_name(), reason);
+		auto inbound = std::move(it->second);
+		inbound_.erase(it);
+		if (inbound.payload) {
+			reassembly_bytes_ -= inbound.total;
+		}
+		ChunkView view;
+		view.attributes_ = &inbound.attributes;
+		view.offset_ = inbound.received;
+		view.total_ = inbound.total;
+		view.aborted_ = true;
+		deliverChunk(inbound.key, view);
+	}
+
+	// Drops the partly received messages whose ttl ran out, or whose sender
+	// went quiet for stream_idle, such as one that went away mid-message
+	// without aborting. Returns how many ms until the next may be due, or
+	// -1 for none.
+	int expireInbound() {
+		auto now = chrono::steady_clock::now();
+		if (now < inbound_check_at_) {
+			return inbound_check_at_ == chrono::steady_clock::time_point::max()
+			           ? -1
+			           : chrono::ceil<chrono::milliseconds>(inbound_check_at_ -
+			                                                now)
+			                 .count();
+		}
+		auto now_ms = uuid_time::nowMs();
+		inbound_check_at_ = chrono::steady_clock::time_point::max();
+		for (auto it = inbound_.begin(); it != inbound_.end();) {
+			auto next = std::next(it);
+			auto& inbound = it->second;
+			auto idle_at = inbound.last_chunk + options_.stream_idle;
+			if (inbound.deadline_ms != 0 && inbound.deadline_ms <= now_ms) {
+				expired_received_.add();
+				dropInbound(it, "expired");
+			} else if (idle_at <= now) {
+				dropInbound(it, "no chunk for too long");
+			} else {
+				inbound_check_at_ = min(inbound_check_at_, idle_at);
+				if (inbound.deadline_ms != 0) {
+					inbound_check_at_ =
+					    min(inbound_check_at_,
+					        now + chrono::milliseconds(inbound.deadline_ms -
+					                                   now_ms));
+				}
+			}
+			it = next;
+		}
+		if (inbound_check_at_ == chrono::steady_clock::time_point::max()) {
+			return -1;
+		}
+		return chrono::ceil<chrono::milliseconds>(inbound_check_at_ - now)
+		    .count();
+	}
+
+	// The rest of a message can't come over a new connection.
+	void dropLostInbound() {
+		for (auto link : lost_links_) {
+			for (auto it = inbound_.begin(); it != inbound_.end();) {
+				auto next = std::next(it);
+				if (it->second.link == link) {
+					dropInbound(it, "connection lost");
+				}
+				it = next;
+			}
+		}
+		lost_links_.clear();
+	}
+
+	// Swaps the payload of a view for its decompressed bytes.
+	bool decompress(const frame::Frame& frame, MessageView& view) {
+		frame::Compressed compressed;
+		auto payload = make_shared<string>();
+		if (!frame::parseCompressed(frame.ext, compressed) ||
+		    !compressor_->decompress(
+		        static_cast<compression::Codec>(compressed.codec),
+		        compressed.dictionary_id, view.payload_, compressed.size,
+		        *payload)) {
+			parse_failures_.add();
+			UP_LOG_SAMPLED_ERROR(
+			    kMessageErrorsPerSecond,
+			    "SocketUTransport::dispatcher:{},{},{} Error decompressing "
+			    "payload",
+			    __LINE__, getpid(), default_uuri.authority_name());
+			return false;
+		}
+		view.payload_ = *payload;
+		view.buffer_ = std::move(payload);
+		return true;
+	}
+
+	void receive(const frame::Frame& frame, size_t link) {
+		AllocationsTo allocations{receive_allocations_,
+		                          receive_allocated_bytes_};
+		UP_LOG_SAMPLED_DEBUG(
+		    kMessageLogsPerSecond,
+		    "SocketUTransport::dispatcher:{},{},{} Received {}", __LINE__,
+		    getpid(), default_uuri.authority_name(), repr(frame.body));
+
+		if (frame.flags & frame::kControl) {
+			// meant for the dispatcher, only relayed here by one that floods
+			return;
+		}
+		messages_received_.add();
+		bytes_received_.add(frame.raw.size());
+		UP_PROBE3(receive, frame.flags, frame.raw.size(), link);
+		record(FlightRecorder::kReceived, link, frame.raw);
+
+		if (frame.flags & frame::kRouting) {
+			frame::Routing routing;
+			if (!frame::parseRouting(frame.ext, routing)) {
+				parse_failures_.add();
+				UP_LOG_SAMPLED_ERROR(
+				    kMessageErrorsPerSecond,
+				    "SocketUTransport::dispatcher:{},{},{} Error parsing "
+				    "routing header",
+				    __LINE__, getpid(), default_uuri.authority_name());
+				return;
+			}
+			auto key = subscription::makeKey(routing);
+			if (!hasListeners(key)) {
+				unmatched_.add();
+				UP_LOG_SAMPLED_DEBUG(
+				    kMessageLogsPerSecond,
+				    "SocketUTransport::dispatcher:{},{},{} No listener for {}, "
+				    "skipped parsing",
+				    __LINE__, getpid(), default_uuri.authority_name(),
+				    to_string(key));
+				return;
+			}
+			if (frame.flags & frame::kChunk) {
+				receiveChunk(frame, link);
+				return;
+			}
+		}
+
+		if (auto id = umessage_wire::peekId(frame.body)) {
+			if (sent_ids_.consume(id->first, id->second)) {
+				UP_LOG_SAMPLED_DEBUG(
+				    kMessageLogsPerSecond,
+				    "SocketUTransport::dispatcher:{},{},{} Dropped echo "
+				    "of own message",
+				    __LINE__, getpid(), default_uuri.authority_name());
+				return;
+			}
+		}
+
+		// Only the attributes are decoded here; the payload stays in the
+		// receive buffer until a listener asks for a full UMessage.
+		UAttributes attributes;
+		MessageView view;
+		try {
+			if (!umessage_wire::parseAttributes(frame.body, attributes,
+			                                    view.payload_,
+			                                    view.has_payload_)) {
+				parse_failures_.add();
+				UP_LOG_SAMPLED_ERROR(
+				    kMessageErrorsPerSecond,
+				    "SocketUTransport::dispatcher:{},{},{} Error "
+				    "parsing UMessage",
+				    __LINE__, getpid(), default_uuri.authority_name());
+				return;
+			}
+		} catch (const google::protobuf::FatalException& e) {
+			parse_failures_.add();
+			UP_LOG_SAMPLED_ERROR(
+			    kMessageErrorsPerSecond,
+			    "SocketUTransport::dispatcher:{},{},{} Protobuf "
+			    "exception: {}",
+			    __LINE__, getpid(), default_uuri.authority_name(), e.what());
+			return;
+		}
+
+		// After a stall the socket may hold a backlog that is no longer of
+		// use to anyone.
+		if (expired(attributes)) {
+			expired_received_.add();
+			UP_LOG_SAMPLED_DEBUG(
+			    kMessageLogsPerSecond,
+			    "SocketUTransport::dispatcher:{},{},{} Dropped expired message",
+			    __LINE__, getpid(), default_uuri.authority_name());
+			return;
+		}
+
+		view.attributes_ = &attributes;
+		view.buffer_ = frame.owner;
+		if ((frame.flags & frame::kCompressed) && !decompress(frame, view)) {
+			return;
+		}
+
+		UP_LOG_SAMPLED_DEBUG(
+		    kMessageLogsPerSecond,
+		    "SocketUTransport::dispatcher:{},{},{} Received "
+		    "attributes:{} payload:{} bytes",
+		    __LINE__, getpid(), default_uuri.authority_name(),
+		    attributes.ShortDebugString(), view.payload_.size());
+
+		deliver(view);
+	}
+
+	// Parses what was just read into frames and receives them, through
+	// fault injection if that is set.
+	bool consume(frame::Reader& reader, size_t link) {
+		if (receive_faults_.empty() || link >= endpoint_count_) {
+			return reader.consume(buffer_, [&](const frame::Frame& frame) {
+				receive(frame, link);
+			});
+		}
+		auto& faults = receive_faults_[link];
+		auto receiveWithFaults = [&](const frame::Frame& frame) {
+			// control frames are meant for the dispatcher, so never lost
+			int copies =
+			    (frame.flags & frame::kControl) ? 1 : faults.copies();
+			countInjected(copies);
+			for (int i = 0; i < copies; i++) {
+				if (faults.delays()) {
+					delayed_frames_[link].push(
+					    faults.arrival(frame.raw.size(),
+					                   chrono::steady_clock::now()),
+					    frame);
+				} else {
+					receive(frame, link);
+				}
+			}
+		};
+		// short reads hand the parser a piece at a time
+		string_view data = *buffer_;
+		bool ok = true;
+		for (size_t pos = 0; pos < data.size();) {
+			auto n = faults.partial(data.size() - pos);
+			auto piece = n == data.size()
+			                 ? buffer_
+			                 : make_shared<string>(data.substr(pos, n));
+			ok = reader.consume(piece, receiveWithFaults) && ok;
+			pos += n;
+		}
+		return ok;
+	}
+
+	void dispatcher() {
+		while (true) {
+			try {
+				if (buffer_.use_count() > 1) {
+					buffer_ = make_shared<string>();
+				}
+				size_t link = 0;
+				if (wake_fd_->read(*buffer_, &link, waitTimeout()) == false)
+					break;
+				drainLoopback();
+				if (buffer_->empty())
+					continue;
+				// every datagram holds exactly one message
+				frame::Reader datagram;
+				auto& reader =
+				    link < endpoint_count_ ? readers_[link] : datagram;
+				if (!consume(reader, link)) {
+					parse_failures_.add();
+					UP_LOG_SAMPLED_ERROR(
+					    kMessageErrorsPerSecond,
+					    "SocketUTransport::dispatcher:{},{},{} Unrecognized "
+					    "frame, discarding buffered data",
+					    __LINE__, getpid(), default_uuri.authority_name());
+				}
+
+			} catch (const system_error& e) {
+				if (e.code() == errc::io_error) {
+					UP_LOG_ERROR(
+					    "SocketUTransport::dispatcher:{},{},{} I/O error: {}",
+					    __LINE__, getpid(), default_uuri.authority_name(),
+					    e.what());
+				} else {
+					throw;  // rethrow the exception if it's not an I/O error
+				}
+			}
+		}
+	}
+
+	UStatus registerListenerImpl(CallableConn& listener,
+	                             const UUri& source_filter,
+	                             optional<UUri>& sink_filter) {
+		UStatus retval;
+		retval.set_code(UCode::OK);
+		auto key = makeCallbackKey(source_filter, sink_filter);
+		UP_LOG_DEBUG(
+		    "SocketUTransport::dispatcher:{},{},{} registerListenerImpl "
+		    "inserting {}",
+		    __LINE__, getpid(), default_uuri.authority_name(), to_string(key));
+		auto ptr = callback_data_.find(key, true);
+		unique_lock<mutex> lock(ptr->mtx);
+		ptr->listeners.insert(listener);
+		updateCount(key, *ptr);
+		return retval;
+	}
+
+	void cleanupListener(CallableConn listener) {
+		callback_data_.erase(
+		    [&](const CallbackKey& key, shared_ptr<CallbackData> ptr) {
+			    unique_lock<mutex> lock(ptr->mtx);
+			    ptr->listeners.erase(listener);
+			    updateCount(key, *ptr);
+		    });
+	}
+
+	shared_ptr<ViewListener> registerViewListener(ViewListener&& listener,
+	                                              const UUri& source_filter,
+	                                              optional<UUri>& sink_filter) {
+		auto key = makeCallbackKey(source_filter, sink_filter);
+		UP_LOG_DEBUG(
+		    "SocketUTransport::dispatcher:{},{},{} registerViewListener "
+		    "inserting {}",
+		    __LINE__, getpid(), default_uuri.authority_name(), to_string(key));
+		auto ret = make_shared<ViewListener>(std::move(listener));
+		auto ptr = callback_data_.find(key, true);
+		unique_lock<mutex> lock(ptr->mtx);
+		ptr->view_listeners.insert(ret);
+		updateCount(key, *ptr);
+		return ret;
+	}
+
+	void cleanupViewListener(const shared_ptr<ViewListener>& listener) {
+		callback_data_.erase(
+		    [&](const CallbackKey& key, shared_ptr<CallbackData> ptr) {
+			    unique_lock<mutex> lock(ptr->mtx);
+			    ptr->view_listeners.erase(listener);
+			    updateCount(key, *ptr);
+		    });
+	}
+
+	shared_ptr<StreamListener> registerStreamListener(
+	    StreamListener&& listener, const UUri& source_filter,
+	    optional<UUri>& sink_filter) {
+		auto key = makeCallbackKey(source_filter, sink_filter);
+		UP_LOG_DEBUG(
+		    "SocketUTransport::dispatcher:{},{},{} registerStreamListener "
+		    "inserting {}",
+		    __LINE__, getpid(), default_uuri.authority_name(), to_string(key));
+		auto ret = make_shared<StreamListener>(std::move(listener));
+		auto ptr = callback_data_.find(key, true);
+		unique_lock<mutex> lock(ptr->mtx);
+		ptr->stream_listeners.insert(ret);
+		updateCount(key, *ptr);
+		return ret;
+	}
+
+	void cleanupStreamListener(const shared_ptr<StreamListener>& listener) {
+		callback_data_.erase(
+		    [&](const CallbackKey& key, shared_ptr<CallbackData> ptr) {
+			    unique_lock<mutex> lock(ptr->mtx);
+			    ptr->stream_listeners.erase(listener);
+			    updateCount(key, *ptr);
+		    });
+	}
+
+	// Refresh listener_count after the sets changed, and tell the dispatcher
+	// when a filter gains its first listener or loses its last one. Called
+	// with data.mtx held, which keeps the advertisements for a key in order.
+	void updateCount(const CallbackKey& key, CallbackData& data) {
+		size_t before = data.listener_count;
+		size_t after = data.listeners.size() + data.view_listeners.size() +
+		               data.stream_listeners.size();
+		data.stream_listener_count = data.stream_listeners.size();
+		data.listener_count = after;
+		unique_lock<mutex> lock(subscriptions_mtx_);
+		if (before == 0 && after > 0) {
+			subscriptions_.insert(key);
+			advertise(subscription::kSubscribe, &key);
+			updateMembership(key, true);
+		} else if (before > 0 && after == 0) {
+			subscriptions_.erase(key);
+			advertise(subscription::kUnsubscribe, &key);
+			updateMembership(key, false);
+		}
+	}
+
+	UUri responseUri() const {
+		auto uri = default_uuri;
+		uri.set_resource_id(0);
+		return uri;
+	}
+
+	UStatus invokeMethod(const UUri& method, string_view payload,
+	                     const RpcOptions& options, RpcCallback&& callback) {
+		UStatus status;
+		if (options.ttl.count() <= 0 || options.ttl.count() > UINT32_MAX) {
+			status.set_code(UCode::INVALID_ARGUMENT);
+			status.set_message("Calls need a ttl that fits in 32 bits.");
+			return status;
+		}
+		call_once(rpc_listener_once_, [this]() { listenForResponses(); });
+
+		UMessage request;
+		auto& attributes = *request.mutable_attributes();
+		attributes.set_type(UMessageType::UMESSAGE_TYPE_REQUEST);
+		*attributes.mutable_id() =
+		    uprotocol::datamodel::builder::UuidBuilder::getBuilder().build();
+		*attributes.mutable_source() = responseUri();
+		*attributes.mutable_sink() = method;
+		attributes.set_priority(
+		    max(options.priority, UPriority::UPRIORITY_CS4));
+		attributes.set_ttl(options.ttl.count());
+		attributes.set_payload_format(options.format);
+		request.set_payload(payload.data(), payload.size());
+
+		// registered before sending, so the response can't arrive first
+		RequestId id{attributes.id().msb(), attributes.id().lsb()};
+		{
+			auto& shard = shardFor(id);
+			unique_lock<mutex> lock(shard.mtx);
+			shard.calls.emplace(id, std::move(callback));
+		}
+		pending_count_++;
+		auto deadline = TimerClock::now() + options.ttl;
+
+		status = sendImpl(request);
+		if (status.code() != UCode::OK) {
+			if (takeCall(id)) {
+				return status;
+			}
+			// the callback ran already, so it has the outcome
+			status.set_code(UCode::OK);
+			status.set_message("OK");
+			return status;
+		}
+		// only started once the request went out, so a failed send is
+		// never reported to the callback as well
+		bool wake = false;
+		{
+			unique_lock<mutex> lock(timers_mtx_);
+			timers_.schedule(deadline, id);
+			if (deadline < timers_wakeup_) {
+				timers_wakeup_ = deadline;
+				wake = true;
+			}
+		}
+		if (wake) {
+			wake_fd_->notify();
+		}
+		return status;
+	}
+
+	PendingShard& shardFor(const RequestId& id) {
+		return pending_[RequestIdHash()(id) % kPendingShards];
+	}
+
+	RpcCallback takeCall(const RequestId& id) {
+		auto& shard = shardFor(id);
+		unique_lock<mutex> lock(shard.mtx);
+		auto it = shard.calls.find(id);
+		if (it == shard.calls.end()) {
+			return nullptr;
+		}
+		auto callback = std::move(it->second);
+		shard.calls.erase(it);
+		pending_count_--;
+		return callback;
+	}
+
+	void listenForResponses() {
+		UUri any;
+		any.set_authority_name("*");
+		any.set_ue_id(0xffff);
+		any.set_ue_version_major(0xff);
+		any.set_resource_id(0xffff);
+		optional<UUri> sink = responseUri();
+		rpc_listener_ = registerViewListener(
+		    [this](const MessageView& view) { onResponse(view); }, any, sink);
+	}
+
+	void onResponse(const MessageView& view) {
+		auto& attributes = view.attributes();
+		if (attributes.type() != UMessageType::UMESSAGE_TYPE_RESPONSE) {
+			return;
+		}
+		auto callback =
+		    takeCall({attributes.reqid().msb(), attributes.reqid().lsb()});
+		if (!callback) {
+			// timed out already, or a call made by someone else
+			return;
+		}
+		UStatus status;
+		status.set_code(attributes.commstatus());
+		status.set_message(attributes.commstatus() == UCode::OK
+		                       ? "OK"
+		                       : "Response carried an error status.");
+		callback(status, &view);
+	}
+
+	// Fails the calls whose ttl ran out. Returns how many ms the receive
+	// thread may wait before the next one is due, or -1 for no limit.
+	int expireCalls() {
+		vector<RequestId> expired;
+		int timeout = -1;
+		{
+			unique_lock<mutex> lock(timers_mtx_);
+			auto now = TimerClock::now();
+			timers_.advance(now, [&](RequestId id) { expired.push_back(id); });
+			auto next = timers_.nextWakeup();
+			timers_wakeup_ = next.value_or(TimerClock::time_point::max());
+			if (next) {
+				timeout = max<int64_t>(
+				    chrono::ceil<chrono::milliseconds>(*next - now).count(), 0);
+			}
+		}
+		for (auto& id : expired) {
+			if (auto callback = takeCall(id)) {
+				UStatus status;
+				status.set_code(UCode::DEADLINE_EXCEEDED);
+				status.set_message("No response before the ttl ran out.");
+				callback(status, nullptr);
+			}
+		}
+		return timeout;
+	}
+
+	// Control messages are only understood by peers that handle framing, so
+	// they are sent under the same option as the routing header.
+	void advertise(subscription::Op op, const CallbackKey* key = nullptr) {
+		string buf;
+		if (!options_.routing_header ||
+		    !subscription::appendControl(buf, op, key)) {
+			return;
+		}
+		for (size_t i = 0; i < endpoint_count_; i++) {
+			auto& link = *links_[i];
+			unique_lock<mutex> lock(link.mtx);
+			// the others get every filter once they connect
+			if (link.state == Link::kUp) {
+				writeLocked(link, i, buf, 0, true);
+			}
+		}
+	}
+};
+
+struct SocketUTransport::MessageTemplate::Encoded {
+	UAttributes attributes;
+	// serialized attributes with the id left out
+	string attributes_tail;
+	// routing extension for framed sends, empty when sending bare
+	string routing;
+	Impl::CallbackKey key;
+	uint64_t source_hash = 0;
+};
+
+SocketUTransport::MessageTemplate SocketUTransport::Impl::makeTemplate(
+    const UAttributes& attributes) {
+	auto encoded = make_shared<MessageTemplate::Encoded>();
+	encoded->attributes = attributes;
+	encoded->attributes.clear_id();
+	encoded->attributes.SerializeToString(&encoded->attributes_tail);
+	if (options_.routing_header) {
+		appendRouting(encoded->routing, encoded->attributes);
+	}
+	encoded->key = makeCallbackKey(attributes.source(), attributes.sink());
+	encoded->source_hash = sourceHash(attributes.source());
+	MessageTemplate ret;
+	ret.encoded_ = std::move(encoded);
+	return ret;
+}
+
+UStatus SocketUTransport::Impl::sendTemplate(
+    const MessageTemplate::Encoded& encoded, const UUID& id,
+    string_view payload) {
+	AllocationsTo allocations{send_allocations_, send_allocated_bytes_};
+	if (encoded.attributes.ttl() > 0 &&
+	    uuid_time::expired(id.msb(), encoded.attributes.ttl(),
+	                       uuid_time::nowMs())) {
+		return expiredStatus();
+	}
+	bool framed = options_.routing_header;
+	if (framed && encoded.routing.empty()) {
+		// makeTemplate() couldn't fit the attributes in a routing header
+		return unframeableStatus();
+	}
+	static thread_local string buf;
+	buf.clear();
+	if (framed) {
+		buf.assign(frame::kHeaderSize, '\0');
+		buf.append(encoded.routing);
+	}
+	auto offset = buf.size();
+	umessage_wire::appendMessage(buf, id.msb(), id.lsb(),
+	                             encoded.attributes_tail, payload);
+	if (framed && buf.size() - offset > frame::kMaxBodySize) {
+		return unframeableStatus();
+	} else if (framed) {
+		frame::Header header;
+		header.flags = frame::kRouting;
+		header.ext_len = encoded.routing.size();
+		header.body_len = buf.size() - offset;
+		frame::writeHeader(buf, header);
+	}
+	UP_LOG_SAMPLED_DEBUG(
+	    kMessageLogsPerSecond,
+	    "SocketUTransport::send():{},{},{} Serialized UMessage is {}", __LINE__,
+	    getpid(), default_uuri.authority_name(), repr(buf));
+
+	bool track_echo = trackEcho(id);
+	auto status =
+	    transmit(buf, encoded.attributes, encoded.source_hash,
+	             uuid_time::deadlineMs(id.msb(), encoded.attributes.ttl()));
+	if (status.code() == UCode::OK && track_echo && hasListeners(encoded.key)) {
+		auto umsg = make_shared<UMessage>();
+		*umsg->mutable_attributes() = encoded.attributes;
+		*umsg->mutable_attributes()->mutable_id() = id;
+		umsg->set_payload(payload.data(), payload.size());
+		loopback(std::move(umsg));
+	}
+	return status;
+}
+
+struct SocketUTransport::StreamWriter::State {
+	// routing extension every chunk carries
+	string routing;
+	frame::Chunk chunk;
+	uint64_t written = 0;
+	size_t endpoint = 0;
+	uint64_t deadline_ms = 0;
+	bool finished = false;
+};
+
+UStatus SocketUTransport::Impl::openStream(const UAttributes& attributes,
+                                           uint64_t size,
+                                           StreamWriter::State& state) {
+	UStatus status;
+	if (!options_.routing_header) {
+		status.set_code(UCode::FAILED_PRECONDITION);
+		status.set_message("Chunked messages need the routing header.");
+		return status;
+	}
+	UMessage umsg;
+	*umsg.mutable_attributes() = attributes;
+	auto& id = *umsg.mutable_attributes()->mutable_id();
+	if (id.msb() == 0 && id.lsb() == 0) {
+		id = uprotocol::datamodel::builder::UuidBuilder::getBuilder().build();
+	}
+	if (expired(umsg.attributes())) {
+		return expiredStatus();
+	}
+	if (!appendRouting(state.routing, umsg.attributes())) {
+		status.set_code(UCode::INVALID_ARGUMENT);
+		status.set_message("Attributes don't fit in a routing header.");
+		return status;
+	}
+	state.chunk.msb = id.msb();
+	state.chunk.lsb = id.lsb();
+	state.chunk.total = size;
+	state.endpoint = endpointFor(sourceHash(attributes.source()));
+	state.deadline_ms = uuid_time::deadlineMs(id.msb(), attributes.ttl());
+	status = writeChunk(state, umsg.SerializeAsString(), 0, true);
+	state.finished = status.code() != UCode::OK || size == 0;
+	return status;
+}
+
+UStatus SocketUTransport::Impl::writeStream(StreamWriter::State& state,
+                                            string_view data) {
+	UStatus status;
+	if (state.finished) {
+		status.set_code(UCode::FAILED_PRECONDITION);
+		status.set_message("Stream already finished.");
+		return status;
+	}
+	if (data.size() > state.chunk.total - state.written) {
+		status.set_code(UCode::INVALID_ARGUMENT);
+		status.set_message("More data than the size given to openStream().");
+		return status;
+	}
+	status.set_code(UCode::OK);
+	status.set_message("OK");
+	while (!data.empty()) {
+		auto piece = data.substr(0, options_.chunk_bytes);
+		status = writeChunk(state, piece, 0, true);
+		if (status.code() != UCode::OK) {
+			return status;
+		}
+		state.written += piece.size();
+		data.remove_prefix(piece.size());
+	}
+	state.finished = state.written == state.chunk.total;
+	return status;
+}
+
+void SocketUTransport::Impl::abortStream(StreamWriter::State& state) {
+	if (!state.finished) {
+		state.finished = true;
+		(void)writeChunk(state, {}, frame::kAbort, false);
+	}
+}
+
+// Frames one chunk and hands it to the link of the stream, first waiting for
+// the link to get the stream's window worth of queued bytes out.
+UStatus SocketUTransport::Impl::writeChunk(StreamWriter::State& state,
+                                           string_view body, uint8_t flags,
+                                           bool wait) {
+	string buf(frame::kHeaderSize, '\0');
+	buf.append(state.routing);
+	state.chunk.flags = flags;
+	frame::appendChunk(buf, state.chunk);
+	frame::Header header;
+	header.flags = frame::kRouting | frame::kChunk;
+	header.ext_len = buf.size() - frame::kHeaderSize;
+	header.body_len = body.size();
+	frame::writeHeader(buf, header);
+	buf.append(body);
+
+	auto& link = *links_[state.endpoint];
+	unique_lock<mutex> lock(link.mtx);
+	// the receive thread is the one that would make room
+	wait = wait && this_thread::get_id() != process_thread_.get_id();
+	// while the dispatcher is unreachable, the spool holds what it can
+	auto stalled_at = chrono::steady_clock::now() + options_.stream_stall;
+	auto pending = link.pendingBytes();
+	while (wait && link.state == Link::kUp && !stopped_ &&
+	       link.pendingBytes() > 0 &&
+	       link.pendingBytes() + buf.size() > options_.stream_window) {
+		auto now = chrono::steady_clock::now();
+		if (link.pendingBytes() < pending) {
+			pending = link.pendingBytes();
+			stalled_at = now + options_.stream_stall;
+		} else if (now >= stalled_at) {
+			UStatus status;
+			status.set_code(UCode::UNAVAILABLE);
+			status.set_message("Dispatcher stopped taking stream data.");
+			return status;
+		}
+		auto until = stalled_at;
+		if (state.deadline_ms != 0) {
+			auto now_ms = uuid_time::nowMs();
+			if (now_ms >= state.deadline_ms) {
+				return expiredStatus();
+			}
+			until = min(until,
+			            now + chrono::milliseconds(state.deadline_ms - now_ms));
+		}
+		link.drained.wait_until(lock, until);
+	}
+	auto status = writeLocked(link, state.endpoint, buf, state.deadline_ms);
+	if (status.code() == UCode::OK) {
+		state.chunk.seq++;
+		bytes_sent_.add(buf.size());
+		record(FlightRecorder::kSent, state.endpoint, buf);
+	}
+	return status;
+}
+
+const UAttributes& SocketUTransport::MessageTemplate::attributes() const {
+	return encoded_->attributes;
+}
+
+const UMessage& SocketUTransport::MessageView::message() const {
+	if (full_ != nullptr) {
+		return *full_;
+	}
+	if (!materialized_) {
+		materialized_.emplace();
+		*materialized_->mutable_attributes() = *attributes_;
+		if (has_payload_) {
+			materialized_->set_payload(payload_.data(), payload_.size());
+		}
+	}
+	return *materialized_;
+}
+
+SocketUTransport::ViewListenerHandle&
+SocketUTransport::ViewListenerHandle::operator=(
+    ViewListenerHandle&& other) noexcept {
+	if (this != &other) {
+		reset();
+		transport_ = std::move(other.transport_);
+		listener_ = std::move(other.listener_);
+		stream_listener_ = std::move(other.stream_listener_);
+	}
+	return *this;
+}
+
+void SocketUTransport::ViewListenerHandle::reset() {
+	if (auto transport = transport_.lock()) {
+		if (listener_) {
+			transport->cleanupViewListener(listener_);
+		}
+		if (stream_listener_) {
+			transport->cleanupStreamListener(stream_listener_);
+		}
+	}
+	transport_.reset();
+	listener_.reset();
+	stream_listener_.reset();
+}
+
+SocketUTransport::StreamWriter& SocketUTransport::StreamWriter::operator=(
+    StreamWriter&& other) noexcept {
+	if (this != &other) {
+		abort();
+		transport_ = std::move(other.transport_);
+		state_ = std::move(other.state_);
+	}
+	return *this;
+}
+
+UStatus SocketUTransport::StreamWriter::write(string_view data) {
+	auto transport = transport_.lock();
+	if (!transport || !state_) {
+		UStatus status;
+		status.set_code(UCode::FAILED_PRECONDITION);
+		status.set_message("Stream not open.");
+		return status;
+	}
+	return transport->writeStream(*state_, data);
+}
+
+uint64_t SocketUTransport::StreamWriter::remaining() const {
+	return state_ ? state_->chunk.total - state_->written : 0;
+}
+
+void SocketUTransport::StreamWriter::abort() {
+	if (auto transport = transport_.lock(); transport && state_) {
+		transport->abortStream(*state_);
+	}
+}
+
+SocketUTransport::SocketUTransport(const UUri& default_uuri,
+                                   const std::string& dispatcher_ip,
+                                   int dispatcher_port)
+    : SocketUTransport(default_uuri, Options(), dispatcher_ip,
+                       dispatcher_port) {}
+
+SocketUTransport::SocketUTransport(const UUri& default_uuri,
+                                   const Options& options,
+                                   const std::string& dispatcher_ip,
+                                   int dispatcher_port)
+    : UTransport(default_uuri),
+      pImpl(new Impl(default_uuri, options, dispatcher_ip, dispatcher_port)) {
+}
+
+UStatus SocketUTransport::sendImpl(const UMessage& umsg) {
+	return pImpl->sendImpl(umsg);
+}
+
+UStatus SocketUTransport::registerListenerImpl(CallableConn&& listener,
+                                               const UUri& source_filter,
+                                               optional<UUri>&& sink_filter) {
+	return pImpl->registerListenerImpl(listener, source_filter, sink_filter);
+}
+
+void SocketUTransport::cleanupListener(CallableConn listener) {
+	pImpl->cleanupListener(listener);
+}
+
+SocketUTransport::MessageTemplate SocketUTransport::makeTemplate(
+    const UAttributes& attributes) const {
+	return pImpl->makeTemplate(attributes);
+}
+
+UStatus SocketUTransport::send(const MessageTemplate& message_template,
+                               const UUID& id, string_view payload) {
+	if (message_template.encoded_ == nullptr) {
+		UStatus status;
+		status.set_code(UCode::INVALID_ARGUMENT);
+		status.set_message("Template was not made by makeTemplate().");
+		return status;
+	}
+	return pImpl->sendTemplate(*message_template.encoded_, id, payload);
+}
+
+UStatus SocketUTransport::openStream(const UAttributes& attributes,
+                                     uint64_t size, StreamWriter& writer) {
+	auto state = make_shared<StreamWriter::State>();
+	auto status = pImpl->openStream(attributes, size, *state);
+	if (status.code() == UCode::OK) {
+		writer = StreamWriter();
+		writer.transport_ = pImpl;
+		writer.state_ = std::move(state);
+	}
+	return status;
+}
+
+SocketUTransport::ExpiryCounters SocketUTransport::expiryCounters() const {
+	ExpiryCounters counters;
+	counters.received = pImpl->expired_received_.value();
+	counters.sent = pImpl->expired_sent_.value();
+	return counters;
+}
+
+metrics::Snapshot SocketUTransport::metrics() const {
+	return pImpl->metrics_.snapshot();
+}
+
+bool SocketUTransport::setFlightRecording(bool enabled) {
+	if (!pImpl->recorder_) {
+		return false;
+	}
+	pImpl->recorder_->setEnabled(enabled);
+	return true;
+}
+
+UStatus SocketUTransport::invokeMethod(const UUri& method,
+                                       string_view payload,
+                                       const RpcOptions& options,
+                                       RpcCallback&& callback) {
+	return pImpl->invokeMethod(method, payload, options, std::move(callback));
+}
+
+size_t SocketUTransport::pendingCalls() const { return pImpl->pending_count_; }
+
+void SocketUTransport::post(function<void()> task) {
+	pImpl->post(std::move(task));
+}
+
+SocketUTransport::ViewListenerHandle SocketUTransport::registerViewListener(
+    ViewListener&& listener, const UUri& source_filter,
+    optional<UUri>&& sink_filter) {
+	ViewListenerHandle handle;
+	handle.transport_ = pImpl;
+	handle.listener_ = pImpl->registerViewListener(std::move(listener),
+	                                               source_filter, sink_filter);
+	return handle;
+}
+
+SocketUTransport::ViewListenerHandle SocketUTransport::registerStreamListener(
+    StreamListener&& listener, const UUri& source_filter,
+    optional<UUri>&& sink_filter) {
+	ViewListenerHandle handle;
+	handle.transport_ = pImpl;
+	handle.stream_listener_ = pImpl->registerStreamListener(
+	    std::move(listener), source_filter, sink_filter);
+	return handle;
 }
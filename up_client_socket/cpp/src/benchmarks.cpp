@@ -0,0 +1,343 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// Microbenchmarks of listener matching, key hashing, message encoding and
+// the receive path, for tracking regressions between releases:
+//
+//     benchmarks --benchmark_out=results.json
+//
+// writes the results as JSON, with the version of this library in the
+// context, for comparing two runs with tools/compare.py of Google Benchmark.
+// Built with allocation accounting (see Allocations.h), the send and receive
+// benchmarks also report heap allocations and bytes per message.
+//
+
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spdlog/spdlog.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <uprotocol/v1/umessage.pb.h>
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Allocations.h"
+#include "Frame.h"
+#include "SafeTupleMap.h"
+#include "SocketUTransport.h"
+#include "Subscription.h"
+#include "TupleOfOptionals.h"
+
+#ifndef UP_CLIENT_SOCKET_VERSION
+#define UP_CLIENT_SOCKET_VERSION "unknown"
+#endif
+
+using namespace std;
+using namespace uprotocol::v1;
+
+static UUri uri(const string& authority, uint32_t ue_id,
+                uint32_t resource_id) {
+	UUri ret;
+	ret.set_authority_name(authority);
+	ret.set_ue_id(ue_id);
+	ret.set_ue_version_major(1);
+	ret.set_resource_id(resource_id);
+	return ret;
+}
+
+static UMessage message(size_t payload_size) {
+	UMessage ret;
+	auto* attributes = ret.mutable_attributes();
+	attributes->set_type(UMESSAGE_TYPE_PUBLISH);
+	attributes->mutable_id()->set_msb(0x0190a1b2c3d47000);
+	attributes->mutable_id()->set_lsb(0x8000000000000001);
+	*attributes->mutable_source() = uri("vehicle.local", 0x10001, 0x8001);
+	attributes->set_payload_format(UPAYLOAD_FORMAT_RAW);
+	ret.set_payload(string(payload_size, 'x'));
+	return ret;
+}
+
+static subscription::Key key(uint32_t ue_id) {
+	return subscription::makeKey(
+	    optional<UUri>(uri("vehicle.local", ue_id, 0x8001)),
+	    optional<UUri>());
+}
+
+static void BM_MakeCallbackKey(benchmark::State& state) {
+	auto attributes = message(0).attributes();
+	for (auto _ : state) {
+		auto key =
+		    subscription::makeKey(optional<UUri>(attributes.source()),
+		                          optional<UUri>(attributes.sink()));
+		benchmark::DoNotOptimize(key);
+	}
+}
+BENCHMARK(BM_MakeCallbackKey);
+
+static void BM_GenerateOptionals(benchmark::State& state) {
+	auto concrete = key(0x10001);
+	for (auto _ : state) {
+		auto keys = generateOptionals(concrete);
+		benchmark::DoNotOptimize(keys);
+	}
+}
+BENCHMARK(BM_GenerateOptionals);
+
+static void BM_KeyHash(benchmark::State& state) {
+	auto concrete = key(0x10001);
+	tuple_of_optionals::hash<subscription::Key> hash;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(hash(concrete));
+	}
+}
+BENCHMARK(BM_KeyHash);
+
+// Heap allocations and bytes per item, when the build counts them.
+static void reportAllocations(benchmark::State& state,
+                              const allocation::Counts& used, size_t items) {
+	if (!allocation::installed() || items == 0)
+		return;
+	state.counters["allocs_per_item"] = double(used.allocations) / items;
+	state.counters["bytes_per_item"] = double(used.bytes) / items;
+}
+
+// One map shared by every thread of a run, so the threads fight over its
+// mutex.
+static void BM_SafeTupleMapFind(benchmark::State& state) {
+	constexpr uint32_t kKeys = 1024;
+	static SafeTupleMap<subscription::Key, int> map;
+	static vector<subscription::Key> keys;
+	if (state.thread_index() == 0 && keys.empty()) {
+		for (uint32_t i = 0; i < kKeys; i++) {
+			keys.push_back(key(i));
+			map.find(keys.back(), true);
+		}
+	}
+	// the other threads wait for the first to fill the map
+	static atomic<bool> ready{false};
+	if (state.thread_index() == 0)
+		ready = true;
+	while (!ready) {
+		this_thread::yield();
+	}
+	uint32_t i = state.thread_index();
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(map.find(keys[i++ % kKeys]));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SafeTupleMapFind)->ThreadRange(1, 16)->UseRealTime();
+
+static void BM_SerializeUMessage(benchmark::State& state) {
+	auto msg = message(state.range(0));
+	string out;
+	for (auto _ : state) {
+		msg.SerializeToString(&out);
+		benchmark::DoNotOptimize(out.data());
+	}
+	state.SetBytesProcessed(state.iterations() * out.size());
+}
+BENCHMARK(BM_SerializeUMessage)->RangeMultiplier(8)->Range(16, 1 << 20);
+
+static void BM_ParseUMessage(benchmark::State& state) {
+	auto encoded = message(state.range(0)).SerializeAsString();
+	UMessage msg;
+	for (auto _ : state) {
+		if (!msg.ParseFromString(encoded))
+			state.SkipWithError("parse failed");
+		benchmark::DoNotOptimize(msg.payload().data());
+	}
+	state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_ParseUMessage)->RangeMultiplier(8)->Range(16, 1 << 20);
+
+//
+// Stands in for the dispatcher: accepts one transport and lets the benchmark
+// write frames straight into its connection, throwing away what the
+// transport sends.
+//
+class FakeDispatcher {
+	int listen_fd_ = -1;
+	int fd_ = -1;
+	int port_ = 0;
+	thread drain_;
+
+public:
+	FakeDispatcher() {
+		listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (listen_fd_ < 0 ||
+		    bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+		    listen(listen_fd_, 1) < 0 ||
+		    getsockname(listen_fd_, (sockaddr*)&addr, &len) < 0) {
+			throw runtime_error("can't listen on the loopback interface");
+		}
+		port_ = ntohs(addr.sin_port);
+	}
+
+	~FakeDispatcher() {
+		if (fd_ >= 0) {
+			shutdown(fd_, SHUT_RDWR);
+			drain_.join();
+			close(fd_);
+		}
+		close(listen_fd_);
+	}
+
+	int port() const { return port_; }
+
+	void accept() {
+		fd_ = ::accept(listen_fd_, nullptr, nullptr);
+		if (fd_ < 0)
+			throw runtime_error("accept failed");
+		int on = 1;
+		setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		drain_ = thread([this]() {
+			char buf[64 * 1024];
+			while (::read(fd_, buf, sizeof(buf)) > 0) {
+			}
+		});
+	}
+
+	void write(const string& data) {
+		size_t offset = 0;
+		while (offset < data.size()) {
+			auto n = send(fd_, data.data() + offset, data.size() - offset,
+			              MSG_NOSIGNAL);
+			if (n <= 0)
+				throw runtime_error("send failed");
+			offset += n;
+		}
+	}
+};
+
+//
+// A transport with a given number of listeners, one of which matches the
+// frames the benchmark feeds it. Kept from one run of a benchmark to the
+// next, as registering 100k listeners takes a while.
+//
+struct DispatchFixture {
+	static constexpr size_t kBatch = 64;
+
+	FakeDispatcher dispatcher;
+	// dropped after the transport, so they needn't unregister one by one
+	vector<SocketUTransport::ViewListenerHandle> handles;
+	shared_ptr<SocketUTransport> transport;
+	atomic<uint64_t> delivered{0};
+	string batch;
+
+	explicit DispatchFixture(size_t listeners) {
+		SocketUTransport::Options options;
+		options.routing_header = true;
+		transport = make_shared<SocketUTransport>(
+		    uri("bench", 1, 0), options, "127.0.0.1", dispatcher.port());
+		dispatcher.accept();
+		for (size_t i = 0; i < listeners; i++) {
+			handles.push_back(transport->registerViewListener(
+			    [this](const SocketUTransport::MessageView& view) {
+				    benchmark::DoNotOptimize(view.payload().data());
+				    delivered.fetch_add(1, memory_order_relaxed);
+			    },
+			    uri("vehicle.local", 0x10001 + i, 0x8001)));
+		}
+
+		auto msg = message(64);
+		auto& source = msg.attributes().source();
+		frame::Routing routing;
+		routing.type = msg.attributes().type();
+		routing.source.authority_name = source.authority_name();
+		routing.source.ue_id = source.ue_id();
+		routing.source.ue_version_major = source.ue_version_major();
+		routing.source.resource_id = source.resource_id();
+		string one(frame::kHeaderSize, '\0');
+		frame::appendRouting(one, routing);
+		auto body = msg.SerializeAsString();
+		frame::Header header;
+		header.flags = frame::kRouting;
+		header.ext_len = one.size() - frame::kHeaderSize;
+		header.body_len = body.size();
+		frame::writeHeader(one, header);
+		one += body;
+		for (size_t i = 0; i < kBatch; i++) {
+			batch += one;
+		}
+	}
+};
+
+// From the bytes of a frame arriving on the socket to the listener, with
+// 1 to 100k listeners registered.
+static void BM_Dispatch(benchmark::State& state) {
+	static unique_ptr<DispatchFixture> fixture;
+	static size_t listeners = 0;
+	if (!fixture || listeners != size_t(state.range(0))) {
+		fixture.reset();
+		listeners = state.range(0);
+		fixture = make_unique<DispatchFixture>(listeners);
+	}
+	// messages are received on the transport's thread, which keeps count
+	auto received = [&]() {
+		auto histograms = fixture->transport->metrics().histograms;
+		auto& count = histograms["receive_allocations"];
+		auto& bytes = histograms["receive_allocated_bytes"];
+		return allocation::Counts{count.sum(), bytes.sum()};
+	};
+	auto before = received();
+	for (auto _ : state) {
+		auto target = fixture->delivered.load() + DispatchFixture::kBatch;
+		fixture->dispatcher.write(fixture->batch);
+		while (fixture->delivered.load(memory_order_relaxed) < target) {
+			this_thread::yield();
+		}
+	}
+	size_t items = state.iterations() * DispatchFixture::kBatch;
+	state.SetItemsProcessed(items);
+	reportAllocations(state, received() - before, items);
+}
+BENCHMARK(BM_Dispatch)->RangeMultiplier(10)->Range(1, 100000)->UseRealTime();
+
+// From send() to the bytes handed to the socket.
+static void BM_Send(benchmark::State& state) {
+	static DispatchFixture fixture(0);
+	auto msg = message(state.range(0));
+	allocation::Scope scope;
+	for (auto _ : state) {
+		if (fixture.transport->send(msg).code() != UCode::OK)
+			state.SkipWithError("send failed");
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(state.iterations() * msg.payload().size());
+	reportAllocations(state, scope.taken(), state.iterations());
+}
+BENCHMARK(BM_Send)->RangeMultiplier(64)->Range(16, 1 << 16);
+
+int main(int argc, char** argv) {
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::AddCustomContext("up_client_socket_version",
+	                            UP_CLIENT_SOCKET_VERSION);
+	spdlog::set_level(spdlog::level::warn);
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
@@ -0,0 +1,225 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// What payload compression costs and saves per message, for each codec with
+// and without a dictionary, over payloads of several sizes. The payloads are
+// JSON telemetry made up on the spot, or the files named on the command
+// line. The dictionary is trained on a separate set, the way a deployment
+// would train it ahead of time, and can be written out with -d for use as
+// SocketUTransport::Compression::dictionary.
+//
+
+#include <getopt.h>
+#include <zdict.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Compression.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct Config {
+	vector<size_t> sizes = {128, 512, 2048, 16384, 131072};
+	size_t samples = 2000;
+	size_t dictionary_size = 64 * 1024;
+	string dictionary_out;
+	vector<string> files;
+};
+
+// One JSON object of about target bytes, with the field names and value
+// ranges repeating from message to message as real telemetry does.
+static string makePayload(minstd_rand& random, size_t target) {
+	static const char* names[] = {"speed",    "rpm",      "fuel_level",
+	                              "latitude", "longitude", "heading",
+	                              "odometer", "battery",  "coolant_temp"};
+	uniform_int_distribution<int> name(0, std::size(names) - 1);
+	uniform_real_distribution<double> value(0, 1000);
+	string out = "{\"vin\":\"WVWZZZ1JZXW000001\",\"signals\":[";
+	while (out.size() < target) {
+		char entry[128];
+		snprintf(entry, sizeof(entry),
+		         "{\"name\":\"%s\",\"value\":%.3f,\"unit\":\"si\"},",
+		         names[name(random)], value(random));
+		out += entry;
+	}
+	out.back() = ']';
+	out += "}";
+	return out;
+}
+
+static string readFile(const string& path) {
+	ifstream in(path, ios::binary);
+	return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static string train(const vector<string>& samples, size_t capacity) {
+	string joined;
+	vector<size_t> sizes;
+	for (auto& sample : samples) {
+		joined += sample;
+		sizes.push_back(sample.size());
+	}
+	string dictionary(capacity, '\0');
+	auto n = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(),
+	                               joined.data(), sizes.data(), sizes.size());
+	if (ZDICT_isError(n)) {
+		fprintf(stderr, "dictionary training failed: %s\n",
+		        ZDICT_getErrorName(n));
+		return string();
+	}
+	dictionary.resize(n);
+	return dictionary;
+}
+
+static void measure(const char* name, compression::Codec codec,
+                    const string& dictionary, bool with_dictionary,
+                    const vector<string>& payloads) {
+	if (payloads.empty()) {
+		return;
+	}
+	compression::Compressor compressor(codec, 1, dictionary);
+	uint32_t dictionary_id = with_dictionary ? compressor.dictionaryId() : 0;
+	vector<string> packed(payloads.size());
+	size_t in_bytes = 0;
+	size_t out_bytes = 0;
+	auto start = Clock::now();
+	for (size_t i = 0; i < payloads.size(); i++) {
+		if (!compressor.compress(payloads[i], with_dictionary, packed[i])) {
+			// sent as it is
+			packed[i].clear();
+		}
+	}
+	auto packed_at = Clock::now();
+	string out;
+	size_t failures = 0;
+	for (size_t i = 0; i < payloads.size(); i++) {
+		in_bytes += payloads[i].size();
+		if (packed[i].empty()) {
+			out_bytes += payloads[i].size();
+			continue;
+		}
+		out_bytes += packed[i].size();
+		if (!compressor.decompress(codec, dictionary_id, packed[i],
+		                           payloads[i].size(), out) ||
+		    out != payloads[i]) {
+			failures++;
+		}
+	}
+	auto unpacked_at = Clock::now();
+	auto per_message = [&](Clock::duration d) {
+		return chrono::duration<double, nano>(d).count() / payloads.size();
+	};
+	printf("%-12s %-5s %8.0f %8.3f %10.0f %10.0f %8zu\n", name,
+	       with_dictionary ? "yes" : "no", double(in_bytes) / payloads.size(),
+	       in_bytes ? double(out_bytes) / in_bytes : 1.0,
+	       per_message(packed_at - start),
+	       per_message(unpacked_at - packed_at), failures);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+	        "usage: %s [-s size,...] [-n samples] [-D dictionary bytes]\n"
+	        "       [-d dictionary file to write] [payload files...]\n",
+	        name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+	Config config;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:n:D:d:h")) != -1) {
+		switch (opt) {
+			case 's': {
+				config.sizes.clear();
+				string list = optarg;
+				size_t pos = 0;
+				while (pos < list.size()) {
+					auto end = list.find(',', pos);
+					if (end == string::npos)
+						end = list.size();
+					config.sizes.push_back(
+					    strtoul(list.substr(pos, end - pos).c_str(), nullptr,
+					            10));
+					pos = end + 1;
+				}
+				break;
+			}
+			case 'n':
+				config.samples = strtoul(optarg, nullptr, 10);
+				break;
+			case 'D':
+				config.dictionary_size = strtoul(optarg, nullptr, 10);
+				break;
+			case 'd':
+				config.dictionary_out = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	for (int i = optind; i < argc; i++) {
+		config.files.push_back(argv[i]);
+	}
+
+	// buckets of payloads to measure, and one training set for them all
+	vector<pair<string, vector<string>>> buckets;
+	vector<string> training;
+	minstd_rand random(1);
+	if (config.files.empty()) {
+		for (auto size : config.sizes) {
+			vector<string> payloads;
+			for (size_t i = 0; i < config.samples; i++) {
+				payloads.push_back(makePayload(random, size));
+				training.push_back(makePayload(random, size));
+			}
+			buckets.emplace_back(to_string(size), std::move(payloads));
+		}
+	} else {
+		// every other file trains the dictionary, the rest are measured;
+		// a single file does both, flattering the dictionary
+		vector<string> payloads;
+		for (size_t i = 0; i < config.files.size(); i++) {
+			(i % 2 ? payloads : training).push_back(readFile(config.files[i]));
+		}
+		if (payloads.empty()) {
+			payloads = training;
+		}
+		buckets.emplace_back("files", std::move(payloads));
+	}
+
+	auto dictionary = train(training, config.dictionary_size);
+	if (!config.dictionary_out.empty()) {
+		ofstream(config.dictionary_out, ios::binary) << dictionary;
+	}
+	printf("dictionary %zu bytes\n\n", dictionary.size());
+
+	for (auto& [label, payloads] : buckets) {
+		printf("payloads %s\n", label.c_str());
+		printf("%-12s %-5s %8s %8s %10s %10s %8s\n", "codec", "dict", "bytes",
+		       "ratio", "pack ns", "unpack ns", "failed");
+		for (bool with_dictionary : {false, true}) {
+			measure("lz4", compression::kLz4, dictionary, with_dictionary,
+			        payloads);
+			measure("zstd", compression::kZstd, dictionary, with_dictionary,
+			        payloads);
+		}
+		printf("\n");
+	}
+}
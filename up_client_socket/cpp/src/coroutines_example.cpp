@@ -0,0 +1,133 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// SocketCoroutines.h at work, built as C++20: a service coroutine answers
+// the requests it takes from a MessageStream, and a client coroutine calls
+// it a few times in a row with co_await invoke(). Both share one transport,
+// whose sends reach its own listeners even while no dispatcher is running.
+//
+//     coroutines_example [calls [ip [port]]]
+//
+// exits with 0 once every call got the response it expected.
+//
+
+#include <spdlog/spdlog.h>
+#include <up-cpp/datamodel/builder/Uuid.h>
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <string>
+
+#include "SocketCoroutines.h"
+
+using namespace std;
+using namespace uprotocol::v1;
+
+static UUri uri(uint32_t ue_id, uint32_t resource_id) {
+	UUri ret;
+	ret.set_authority_name("coro");
+	ret.set_ue_id(ue_id);
+	ret.set_ue_version_major(1);
+	ret.set_resource_id(resource_id);
+	return ret;
+}
+
+// Echoes each request back in upper case until the stream is closed.
+static coro::Task<void> serve(SocketUTransport& transport,
+                              coro::MessageStream& requests) {
+	while (auto request = co_await requests.next()) {
+		auto& attributes = request->attributes;
+		UMessage response;
+		auto& response_attributes = *response.mutable_attributes();
+		response_attributes.set_type(UMESSAGE_TYPE_RESPONSE);
+		*response_attributes.mutable_id() =
+		    uprotocol::datamodel::builder::UuidBuilder::getBuilder().build();
+		*response_attributes.mutable_source() = attributes.sink();
+		*response_attributes.mutable_sink() = attributes.source();
+		*response_attributes.mutable_reqid() = attributes.id();
+		response_attributes.set_priority(attributes.priority());
+		response_attributes.set_commstatus(UCode::OK);
+		string payload(request->payload.data);
+		for (auto& c : payload) {
+			c = toupper(c);
+		}
+		response.set_payload(payload);
+		auto status = co_await coro::send(transport, response);
+		if (status.code() != UCode::OK) {
+			fprintf(stderr, "response not sent: %s\n",
+			        status.message().c_str());
+		}
+	}
+}
+
+// Makes the calls one after the other and reports how many came back
+// right.
+static coro::Task<int> call(SocketUTransport& transport, const UUri& method,
+                            int calls) {
+	SocketUTransport::RpcOptions options;
+	options.ttl = chrono::milliseconds(2000);
+	int good = 0;
+	for (int i = 0; i < calls; i++) {
+		auto payload = "call " + to_string(i);
+		auto response =
+		    co_await coro::invoke(transport, method, payload, options);
+		if (!response.ok() || !response.message) {
+			fprintf(stderr, "call %d failed: %s\n", i,
+			        response.status.message().c_str());
+			continue;
+		}
+		auto expected = "CALL " + to_string(i);
+		good += response.message->payload.data == expected;
+	}
+	co_return good;
+}
+
+static coro::Task<void> run(SocketUTransport& transport,
+                            coro::MessageStream& requests, const UUri& method,
+                            int calls, promise<int>& done) {
+	int good = co_await call(transport, method, calls);
+	requests.close();
+	done.set_value(good);
+}
+
+int main(int argc, char* argv[]) {
+	int calls = argc > 1 ? atoi(argv[1]) : 10;
+	string ip = argc > 2 ? argv[2] : SocketUTransport::default_dispatcher_ip;
+	int port = argc > 3 ? atoi(argv[3])
+	                    : SocketUTransport::default_dispatcher_port;
+	spdlog::set_level(spdlog::level::warn);
+
+	SocketUTransport transport(uri(0x100, 0), SocketUTransport::Options(),
+	                           ip, port);
+	auto method = uri(0x200, 1);
+	UUri any;
+	any.set_authority_name("*");
+	any.set_ue_id(0xffff);
+	any.set_ue_version_major(0xff);
+	any.set_resource_id(0xffff);
+	coro::MessageStream requests(transport, any, method);
+
+	promise<int> done;
+	auto result = done.get_future();
+	coro::spawn(serve(transport, requests));
+	coro::spawn(run(transport, requests, method, calls, done));
+	if (result.wait_for(chrono::seconds(10)) != future_status::ready) {
+		fprintf(stderr, "calls did not finish\n");
+		return EXIT_FAILURE;
+	}
+	int good = result.get();
+	printf("%d of %d calls answered as expected\n", good, calls);
+	return good == calls ? EXIT_SUCCESS : EXIT_FAILURE;
+}
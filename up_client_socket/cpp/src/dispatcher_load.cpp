@@ -0,0 +1,229 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// Raw frame load for the dispatcher alone, with no protobuf or transport
+// cost on the client side. Publishers write routed frames as fast as the
+// dispatcher takes them and subscribers count what they receive.
+//
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Frame.h"
+#include "Subscription.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct Config {
+	string ip = "127.0.0.1";
+	int port = 44444;
+	unsigned publishers = 4;
+	unsigned subscribers = 4;
+	size_t size = 64;
+	unsigned batch = 64;
+	double seconds = 5;
+};
+
+static int connectTo(const Config& config) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config.port);
+	if (fd < 0 || inet_pton(AF_INET, config.ip.c_str(), &addr.sin_addr) <= 0 ||
+	    connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	// lets both sides notice the deadline while the dispatcher is busy
+	timeval timeout{0, 100000};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+static bool writeAll(int fd, const string& data) {
+	size_t offset = 0;
+	while (offset < data.size()) {
+		auto n = send(fd, data.data() + offset, data.size() - offset,
+		              MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			// a partly written frame has to be finished, or the stream breaks
+			if (offset == 0)
+				return false;
+			continue;
+		}
+		if (n <= 0)
+			return false;
+		offset += n;
+	}
+	return true;
+}
+
+static string routedFrame(unsigned publisher, size_t size) {
+	frame::Routing routing;
+	routing.type = 1;
+	routing.source.authority_name = "load";
+	routing.source.ue_id = publisher;
+	routing.source.ue_version_major = 1;
+	routing.source.resource_id = 0x8000;
+	string out(frame::kHeaderSize, '\0');
+	frame::appendRouting(out, routing);
+	frame::Header header;
+	header.flags = frame::kRouting;
+	header.ext_len = out.size() - frame::kHeaderSize;
+	header.body_len = size;
+	frame::writeHeader(out, header);
+	out.append(size, 'x');
+	return out;
+}
+
+int main(int argc, char* argv[]) {
+	Config config;
+	static const option long_options[] = {
+	    {"publishers", required_argument, nullptr, 'p'},
+	    {"subscribers", required_argument, nullptr, 's'},
+	    {"size", required_argument, nullptr, 'b'},
+	    {"batch", required_argument, nullptr, 'n'},
+	    {"seconds", required_argument, nullptr, 'd'},
+	    {nullptr, 0, nullptr, 0}};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "p:s:b:n:d:", long_options,
+	                          nullptr)) != -1) {
+		switch (opt) {
+			case 'p':
+				config.publishers = strtoul(optarg, nullptr, 10);
+				break;
+			case 's':
+				config.subscribers = strtoul(optarg, nullptr, 10);
+				break;
+			case 'b':
+				config.size = strtoull(optarg, nullptr, 10);
+				break;
+			case 'n':
+				config.batch = strtoul(optarg, nullptr, 10);
+				break;
+			case 'd':
+				config.seconds = strtod(optarg, nullptr);
+				break;
+			default:
+				fprintf(stderr,
+				        "usage: %s [--publishers N] [--subscribers N] "
+				        "[--size BYTES] [--batch FRAMES] [--seconds S] "
+				        "[ip [port]]\n",
+				        argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		config.ip = argv[optind++];
+	if (optind < argc)
+		config.port = atoi(argv[optind++]);
+
+	atomic<uint64_t> published{0};
+	atomic<uint64_t> delivered{0};
+	atomic<unsigned> disconnected{0};
+
+	vector<int> subscriber_fds;
+	for (unsigned i = 0; i < config.subscribers; i++) {
+		subscriber_fds.push_back(connectTo(config));
+	}
+	vector<int> publisher_fds;
+	for (unsigned i = 0; i < config.publishers; i++) {
+		int fd = connectTo(config);
+		// publishers only send, so opt out of receiving anything routed
+		string hello;
+		subscription::appendControl(hello, subscription::kSelective);
+		writeAll(fd, hello);
+		publisher_fds.push_back(fd);
+	}
+	// give the dispatcher a moment to take in every connection
+	this_thread::sleep_for(chrono::milliseconds(200));
+
+	auto start = Clock::now();
+	auto deadline =
+	    start + chrono::duration_cast<Clock::duration>(
+	                chrono::duration<double>(config.seconds));
+	vector<thread> threads;
+	for (int fd : subscriber_fds) {
+		threads.emplace_back([&, fd]() {
+			frame::Reader reader;
+			uint64_t count = 0;
+			string buffer(64 * 1024, '\0');
+			while (Clock::now() < deadline) {
+				auto n = ::read(fd, buffer.data(), buffer.size());
+				if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+					disconnected++;
+					break;
+				}
+				if (n < 0)
+					continue;
+				reader.consume(make_shared<string>(buffer.data(), n),
+				               [&](const frame::Frame&) { count++; });
+			}
+			delivered += count;
+		});
+	}
+	for (unsigned i = 0; i < config.publishers; i++) {
+		threads.emplace_back([&, i]() {
+			string one = routedFrame(i, config.size);
+			string batch;
+			for (unsigned j = 0; j < config.batch; j++) {
+				batch.append(one);
+			}
+			uint64_t count = 0;
+			while (Clock::now() < deadline) {
+				if (!writeAll(publisher_fds[i], batch))
+					continue;
+				count += config.batch;
+			}
+			published += count;
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	double elapsed = chrono::duration<double>(deadline - start).count();
+
+	double expected = double(published) * config.subscribers;
+	printf(
+	    "publishers %u subscribers %u size %zu: published %.3f M msg/s, "
+	    "delivered %.3f M msg/s (%.1f%% of published x subscribers), "
+	    "%u subscriber(s) disconnected\n",
+	    config.publishers, config.subscribers, config.size,
+	    published / elapsed / 1e6, delivered / elapsed / 1e6,
+	    expected > 0 ? 100.0 * delivered / expected : 0.0,
+	    disconnected.load());
+
+	for (int fd : subscriber_fds) {
+		::close(fd);
+	}
+	for (int fd : publisher_fds) {
+		::close(fd);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <getopt.h>
+#include <spdlog/spdlog.h>
+
+#include <csignal>
+#include <cstdlib>
+#include <string>
+#include <system_error>
+
+#include "Dispatcher.h"
+
+using namespace std;
+
+static Dispatcher* running = nullptr;
+
+static void onSignal(int) {
+	if (running)
+		running->stop();
+}
+
+static void usage(const char* name) {
+	spdlog::error(
+	    "usage: {} [--threads N] [--max-queued-bytes N] "
+	    "[--slow-consumer disconnect|drop] [ip [port]]",
+	    name);
+}
+
+int main(int argc, char* argv[]) {
+	Dispatcher::Options options;
+
+	static const option long_options[] = {
+	    {"threads", required_argument, nullptr, 't'},
+	    {"max-queued-bytes", required_argument, nullptr, 'q'},
+	    {"slow-consumer", required_argument, nullptr, 's'},
+	    {nullptr, 0, nullptr, 0}};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "t:q:s:", long_options, nullptr)) !=
+	       -1) {
+		switch (opt) {
+			case 't':
+				options.threads = strtoul(optarg, nullptr, 10);
+				break;
+			case 'q':
+				options.max_queued_bytes = strtoull(optarg, nullptr, 10);
+				break;
+			case 's':
+				if (string(optarg) == "drop") {
+					options.slow_consumer = Dispatcher::SlowConsumer::kDrop;
+				} else if (string(optarg) == "disconnect") {
+					options.slow_consumer =
+					    Dispatcher::SlowConsumer::kDisconnect;
+				} else {
+					usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		options.ip = argv[optind++];
+	if (optind < argc)
+		options.port = atoi(argv[optind++]);
+
+	try {
+		Dispatcher dispatcher(options);
+		running = &dispatcher;
+		signal(SIGINT, onSignal);
+		signal(SIGTERM, onSignal);
+		dispatcher.run();
+		running = nullptr;
+	} catch (const system_error& e) {
+		spdlog::error("dispatcher: {}", e.what());
+		return EXIT_FAILURE;
+	}
+	spdlog::info("Dispatcher closed!");
+	return EXIT_SUCCESS;
+}
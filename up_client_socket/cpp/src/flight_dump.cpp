@@ -0,0 +1,216 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// Prints a flight recording made with SocketUTransport::FlightRecording,
+// oldest frame first, as protobuf text or as one JSON object per line. Each
+// frame is decoded back into the UMessage it carried; pieces of a chunked
+// message after the first are shown by their place in it only, and
+// compressed payloads are expanded when no dictionary was used.
+//
+
+#include <getopt.h>
+#include <google/protobuf/util/json_util.h>
+#include <uprotocol/v1/umessage.pb.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <string>
+
+#include "Compression.h"
+#include "FlightRecorder.h"
+#include "Frame.h"
+
+using namespace std;
+using namespace uprotocol::v1;
+
+struct Config {
+	bool json = false;
+	string path;
+};
+
+struct Decoded {
+	// empty when the frame holds no UMessage
+	unique_ptr<UMessage> message;
+	string note;
+};
+
+static Decoded decode(const frame::Frame& frame) {
+	Decoded out;
+	if (frame.flags & frame::kControl) {
+		out.note = "dispatcher control message";
+		return out;
+	}
+	if (frame.flags & frame::kChunk) {
+		frame::Chunk chunk;
+		if (!frame::parseChunk(frame.ext, chunk)) {
+			out.note = "bad chunk header";
+			return out;
+		}
+		if (chunk.seq != 0) {
+			out.note = "chunk " + to_string(chunk.seq) + " of a message of " +
+			           to_string(chunk.total) + " bytes, " +
+			           to_string(frame.body.size()) + " bytes" +
+			           (chunk.flags & frame::kAbort ? ", aborted" : "");
+			return out;
+		}
+		out.note = "first chunk of a message of " + to_string(chunk.total) +
+		           " bytes";
+	}
+	out.message = make_unique<UMessage>();
+	if (!out.message->ParseFromArray(frame.body.data(), frame.body.size())) {
+		out.message.reset();
+		out.note = "not a UMessage";
+		return out;
+	}
+	if (frame.flags & frame::kCompressed) {
+		frame::Compressed compressed;
+		compression::Compressor compressor(compression::kZstd, 1, string());
+		string payload;
+		if (frame::parseCompressed(frame.ext, compressed) &&
+		    compressor.decompress(
+		        static_cast<compression::Codec>(compressed.codec),
+		        compressed.dictionary_id, out.message->payload(),
+		        compressed.size, payload)) {
+			out.message->set_payload(std::move(payload));
+		} else {
+			out.note = "payload compressed with a dictionary or a codec not "
+			           "built in";
+		}
+	}
+	return out;
+}
+
+static string timestamp(uint64_t time_ns) {
+	time_t seconds = time_ns / 1000000000;
+	struct tm utc;
+	gmtime_r(&seconds, &utc);
+	char buf[64];
+	auto n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &utc);
+	snprintf(buf + n, sizeof(buf) - n, ".%09lluZ",
+	         static_cast<unsigned long long>(time_ns % 1000000000));
+	return buf;
+}
+
+static string quote(const string& in) {
+	string out = "\"";
+	for (unsigned char c : in) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+static void print(const Config& config, const FlightRecorder::Entry& entry,
+                  const frame::Frame* frame) {
+	const char* direction =
+	    entry.direction == FlightRecorder::kSent ? "sent" : "received";
+	Decoded decoded;
+	if (entry.frame.size() < entry.length) {
+		decoded.note = "cut short at " + to_string(entry.frame.size()) +
+		               " bytes";
+	} else if (frame != nullptr) {
+		decoded = decode(*frame);
+	} else {
+		decoded.note = "not a frame";
+	}
+	uint16_t flags = frame != nullptr ? frame->flags : 0;
+
+	if (!config.json) {
+		printf("# %s %s link %u flags 0x%x %u bytes%s%s\n",
+		       timestamp(entry.time_ns).c_str(), direction, entry.link, flags,
+		       entry.length, decoded.note.empty() ? "" : ", ",
+		       decoded.note.c_str());
+		if (decoded.message) {
+			printf("%s", decoded.message->DebugString().c_str());
+		}
+		printf("\n");
+		return;
+	}
+
+	string line = "{\"time\":" + quote(timestamp(entry.time_ns)) +
+	              ",\"time_ns\":" + to_string(entry.time_ns) +
+	              ",\"direction\":\"" + direction +
+	              "\",\"link\":" + to_string(entry.link) +
+	              ",\"flags\":" + to_string(flags) +
+	              ",\"bytes\":" + to_string(entry.length);
+	if (!decoded.note.empty()) {
+		line += ",\"note\":" + quote(decoded.note);
+	}
+	if (decoded.message) {
+		string message;
+		if (google::protobuf::util::MessageToJsonString(*decoded.message,
+		                                                &message)
+		        .ok()) {
+			line += ",\"message\":" + message;
+		}
+	}
+	printf("%s}\n", line.c_str());
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-j] recording\n  -j  JSON, one object a line\n",
+	        name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+	Config config;
+	int opt;
+	while ((opt = getopt(argc, argv, "jh")) != -1) {
+		switch (opt) {
+			case 'j':
+				config.json = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	config.path = argv[optind];
+
+	size_t records = 0;
+	bool ok = FlightRecorder::load(
+	    config.path, [&](const FlightRecorder::Entry& entry) {
+		    records++;
+		    if (entry.frame.size() < entry.length) {
+			    print(config, entry, nullptr);
+			    return;
+		    }
+		    // a record holds exactly one frame, or one bare message
+		    frame::Reader reader;
+		    bool printed = false;
+		    reader.consume(make_shared<string>(entry.frame),
+		                   [&](const frame::Frame& frame) {
+			                   print(config, entry, &frame);
+			                   printed = true;
+		                   });
+		    if (!printed) {
+			    print(config, entry, nullptr);
+		    }
+	    });
+	if (!ok) {
+		fprintf(stderr, "%s is not a flight recording\n", config.path.c_str());
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%zu records\n", records);
+}
@@ -0,0 +1,457 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// Replays a flight recording made with SocketUTransport::FlightRecording as
+// load. The messages the recording process sent, or with --received those it
+// received, are sent again through a number of SocketUTransports, each with
+// its own dispatcher connection, keeping the gaps between them as recorded
+// or as fast as possible. Messages of one source always go through the same
+// connection in their recorded order. Receiving transports listen for
+// everything, which tells the throughput, how many messages were lost and
+// how long each took from send() to a listener.
+//
+// Each replayed message gets a new id, so its ttl counts from when it is
+// replayed, with the connection and number of the message in the low half
+// for the receivers to match it up with when it was sent.
+//
+
+#include <getopt.h>
+#include <up-cpp/datamodel/builder/Uuid.h>
+#include <uprotocol/v1/umessage.pb.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Compression.h"
+#include "FlightRecorder.h"
+#include "Frame.h"
+#include "Metrics.h"
+#include "SocketUTransport.h"
+
+using namespace std;
+using namespace uprotocol::v1;
+using Clock = chrono::steady_clock;
+
+struct Config {
+	string path;
+	string ip = SocketUTransport::default_dispatcher_ip;
+	int port = SocketUTransport::default_dispatcher_port;
+	unsigned connections = 4;
+	unsigned receivers = 1;
+	// 0 for as fast as possible
+	double speed = 1;
+	unsigned loops = 1;
+	bool received = false;
+	bool routing_header = false;
+	chrono::milliseconds drain{2000};
+};
+
+// A message as recorded, with when it was sent or received.
+struct Recorded {
+	uint64_t time_ns = 0;
+	UMessage message;
+	// payload bytes of a chunked message, until all of them are there
+	uint64_t total = 0;
+	bool complete = true;
+};
+
+// Ids of replayed messages carry the RFC 4122 variant in their top two bits,
+// then the connection, then the number of the message on that connection.
+constexpr unsigned kSeqBits = 40;
+constexpr unsigned kConnectionBits = 62 - kSeqBits;
+constexpr uint64_t kVariant = uint64_t(2) << 62;
+
+static uint64_t tag(unsigned connection, uint64_t seq) {
+	return kVariant | uint64_t(connection) << kSeqBits | seq;
+}
+
+static int64_t nowNs() {
+	return chrono::duration_cast<chrono::nanoseconds>(
+	           Clock::now().time_since_epoch())
+	    .count();
+}
+
+// Turns the frames of a recording back into messages. A chunked message is
+// put together again and replayed whole at the time of its first chunk.
+// Returns false if the file isn't a recording.
+static bool load(const Config& config, vector<Recorded>& out,
+                 size_t& skipped) {
+	auto wanted =
+	    config.received ? FlightRecorder::kReceived : FlightRecorder::kSent;
+	// chunked messages still missing pieces, by id
+	map<pair<uint64_t, uint64_t>, size_t> partial;
+	compression::Compressor compressor(compression::kZstd, 1, string());
+
+	auto add = [&](const FlightRecorder::Entry& entry,
+	               const frame::Frame& frame) {
+		if (frame.flags & frame::kControl)
+			return;
+		frame::Chunk chunk;
+		bool chunked = frame.flags & frame::kChunk;
+		if (chunked && !frame::parseChunk(frame.ext, chunk)) {
+			skipped++;
+			return;
+		}
+		if (chunked && chunk.seq != 0) {
+			auto it = partial.find({chunk.msb, chunk.lsb});
+			if (it == partial.end()) {
+				// the first piece was overwritten or not recorded
+				return;
+			}
+			auto& message = out[it->second];
+			if (chunk.flags & frame::kAbort) {
+				partial.erase(it);
+				return;
+			}
+			message.message.mutable_payload()->append(frame.body);
+			if (message.message.payload().size() >= message.total) {
+				message.complete = true;
+				partial.erase(it);
+			}
+			return;
+		}
+		Recorded recorded;
+		recorded.time_ns = entry.time_ns;
+		if (!recorded.message.ParseFromArray(frame.body.data(),
+		                                     frame.body.size())) {
+			skipped++;
+			return;
+		}
+		if (frame.flags & frame::kCompressed) {
+			frame::Compressed compressed;
+			string payload;
+			if (!frame::parseCompressed(frame.ext, compressed) ||
+			    !compressor.decompress(
+			        static_cast<compression::Codec>(compressed.codec),
+			        compressed.dictionary_id, recorded.message.payload(),
+			        compressed.size, payload)) {
+				skipped++;
+				return;
+			}
+			recorded.message.set_payload(std::move(payload));
+		}
+		if (chunked && chunk.total > 0) {
+			recorded.total = chunk.total;
+			recorded.complete = false;
+			partial[{chunk.msb, chunk.lsb}] = out.size();
+		}
+		out.push_back(std::move(recorded));
+	};
+
+	bool ok = FlightRecorder::load(
+	    config.path, [&](const FlightRecorder::Entry& entry) {
+		    if (entry.direction != wanted)
+			    return;
+		    if (entry.frame.size() < entry.length) {
+			    skipped++;
+			    return;
+		    }
+		    frame::Reader reader;
+		    reader.consume(
+		        make_shared<string>(entry.frame),
+		        [&](const frame::Frame& frame) { add(entry, frame); });
+	    });
+	skipped += count_if(out.begin(), out.end(),
+	                    [](const Recorded& r) { return !r.complete; });
+	out.erase(remove_if(out.begin(), out.end(),
+	                    [](const Recorded& r) { return !r.complete; }),
+	          out.end());
+	return ok;
+}
+
+struct Connection {
+	shared_ptr<SocketUTransport> transport;
+	vector<Recorded> messages;
+	// number of messages replayed, over all loops
+	uint64_t count = 0;
+	// steady clock ns each was sent at, 0 until then
+	unique_ptr<atomic<int64_t>[]> sent_ns;
+	uint64_t sent = 0;
+	uint64_t failed = 0;
+	uint64_t bytes = 0;
+};
+
+static UUri uri(const string& authority, uint32_t ue_id) {
+	UUri ret;
+	ret.set_authority_name(authority);
+	ret.set_ue_id(ue_id);
+	ret.set_ue_version_major(1);
+	ret.set_resource_id(0);
+	return ret;
+}
+
+static void printPercentiles(const char* name,
+                             const metrics::HistogramSnapshot& histogram) {
+	printf("%s us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", name,
+	       histogram.percentile(0.5) / 1e3, histogram.percentile(0.9) / 1e3,
+	       histogram.percentile(0.99) / 1e3, histogram.percentile(0.999) / 1e3,
+	       histogram.max() / 1e3);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+	        "usage: %s [--connections N] [--receivers N] [--speed X | "
+	        "--fast] [--loops N] [--received] [--routing-header] "
+	        "[--drain MS] recording [ip [port]]\n",
+	        name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	Config config;
+	static const option long_options[] = {
+	    {"connections", required_argument, nullptr, 'c'},
+	    {"receivers", required_argument, nullptr, 'r'},
+	    {"speed", required_argument, nullptr, 's'},
+	    {"fast", no_argument, nullptr, 'f'},
+	    {"loops", required_argument, nullptr, 'l'},
+	    {"received", no_argument, nullptr, 'R'},
+	    {"routing-header", no_argument, nullptr, 'H'},
+	    {"drain", required_argument, nullptr, 'd'},
+	    {nullptr, 0, nullptr, 0}};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:r:s:fl:RHd:", long_options,
+	                          nullptr)) != -1) {
+		switch (opt) {
+			case 'c':
+				config.connections = strtoul(optarg, nullptr, 10);
+				break;
+			case 'r':
+				config.receivers = strtoul(optarg, nullptr, 10);
+				break;
+			case 's':
+				config.speed = strtod(optarg, nullptr);
+				break;
+			case 'f':
+				config.speed = 0;
+				break;
+			case 'l':
+				config.loops = strtoul(optarg, nullptr, 10);
+				break;
+			case 'R':
+				config.received = true;
+				break;
+			case 'H':
+				config.routing_header = true;
+				break;
+			case 'd':
+				config.drain =
+				    chrono::milliseconds(strtoul(optarg, nullptr, 10));
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc || config.connections == 0 ||
+	    config.connections >= (1u << kConnectionBits) ||
+	    config.speed < 0) {
+		usage(argv[0]);
+	}
+	config.path = argv[optind++];
+	if (optind < argc)
+		config.ip = argv[optind++];
+	if (optind < argc)
+		config.port = atoi(argv[optind++]);
+
+	vector<Recorded> recorded;
+	size_t skipped = 0;
+	if (!load(config, recorded, skipped)) {
+		fprintf(stderr, "%s is not a flight recording\n", config.path.c_str());
+		return EXIT_FAILURE;
+	}
+	if (recorded.empty()) {
+		fprintf(stderr, "no %s messages in %s\n",
+		        config.received ? "received" : "sent", config.path.c_str());
+		return EXIT_FAILURE;
+	}
+	uint64_t first_ns = recorded.front().time_ns;
+	uint64_t last_ns = first_ns;
+	for (auto& r : recorded) {
+		first_ns = min(first_ns, r.time_ns);
+		last_ns = max(last_ns, r.time_ns);
+	}
+	// loops follow each other as if the recording went on
+	uint64_t span_ns = last_ns - first_ns + 1;
+	size_t messages = recorded.size();
+
+	SocketUTransport::Options options;
+	options.routing_header = config.routing_header;
+	vector<Connection> connections(config.connections);
+	for (auto& r : recorded) {
+		auto source = r.message.attributes().source().SerializeAsString();
+		auto& connection = connections[hash<string>()(source) %
+		                               connections.size()];
+		connection.messages.push_back(std::move(r));
+	}
+	recorded.clear();
+	for (unsigned c = 0; c < connections.size(); c++) {
+		auto& connection = connections[c];
+		connection.count = uint64_t(config.loops) * connection.messages.size();
+		connection.sent_ns =
+		    make_unique<atomic<int64_t>[]>(max<uint64_t>(connection.count, 1));
+		connection.transport = make_shared<SocketUTransport>(
+		    uri("replay", 0x7000 + c), options, config.ip, config.port);
+	}
+
+	metrics::Histogram latency;
+	atomic<uint64_t> received{0};
+	atomic<uint64_t> stray{0};
+	atomic<int64_t> last_received_ns{0};
+	UUri any;
+	any.set_authority_name("*");
+	any.set_ue_id(0xffff);
+	any.set_ue_version_major(0xff);
+	any.set_resource_id(0xffff);
+	vector<shared_ptr<SocketUTransport>> receivers;
+	vector<SocketUTransport::ViewListenerHandle> handles;
+	for (unsigned i = 0; i < config.receivers; i++) {
+		auto transport = make_shared<SocketUTransport>(
+		    uri("replay_sink", 0x7800 + i), options, config.ip, config.port);
+		handles.push_back(transport->registerViewListener(
+		    [&](const SocketUTransport::MessageView& view) {
+			    auto now = nowNs();
+			    auto lsb = view.attributes().id().lsb();
+			    auto c = (lsb >> kSeqBits) & ((1u << kConnectionBits) - 1);
+			    auto seq = lsb & ((uint64_t(1) << kSeqBits) - 1);
+			    int64_t sent = 0;
+			    if ((lsb & (uint64_t(3) << 62)) == kVariant &&
+			        c < connections.size() && seq < connections[c].count) {
+				    sent = connections[c].sent_ns[seq].load(
+				        memory_order_acquire);
+			    }
+			    if (sent == 0) {
+				    // not one of ours, or from an earlier run
+				    stray++;
+				    return;
+			    }
+			    latency.record(now - sent);
+			    received++;
+			    auto last = last_received_ns.load(memory_order_relaxed);
+			    while (last < now && !last_received_ns.compare_exchange_weak(
+			                             last, now, memory_order_relaxed)) {
+			    }
+		    },
+		    any));
+		receivers.push_back(std::move(transport));
+	}
+	// give the dispatcher a moment to take in every connection
+	this_thread::sleep_for(chrono::milliseconds(200));
+
+	metrics::Histogram lag;
+	auto start = Clock::now();
+	vector<thread> threads;
+	for (unsigned c = 0; c < connections.size(); c++) {
+		threads.emplace_back([&, c]() {
+			auto& connection = connections[c];
+			uint64_t seq = 0;
+			for (unsigned loop = 0; loop < config.loops; loop++) {
+				for (auto& r : connection.messages) {
+					if (config.speed > 0) {
+						auto offset = (loop * span_ns + r.time_ns - first_ns) /
+						              config.speed;
+						auto due = start + chrono::nanoseconds(
+						                       static_cast<int64_t>(offset));
+						this_thread::sleep_until(due);
+						auto late = Clock::now() - due;
+						lag.record(max<int64_t>(
+						    chrono::nanoseconds(late).count(), 0));
+					}
+					auto& message = r.message;
+					auto* id = message.mutable_attributes()->mutable_id();
+					*id = uprotocol::datamodel::builder::UuidBuilder::
+					    getBuilder()
+					        .build();
+					id->set_lsb(tag(c, seq));
+					connection.sent_ns[seq].store(nowNs(),
+					                              memory_order_release);
+					auto status = connection.transport->send(message);
+					if (status.code() == UCode::OK) {
+						connection.sent++;
+						connection.bytes += message.payload().size();
+					} else {
+						connection.failed++;
+					}
+					seq++;
+				}
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	auto sent_elapsed = chrono::duration<double>(Clock::now() - start).count();
+
+	uint64_t sent = 0;
+	uint64_t failed = 0;
+	uint64_t bytes = 0;
+	for (auto& connection : connections) {
+		sent += connection.sent;
+		failed += connection.failed;
+		bytes += connection.bytes;
+	}
+	uint64_t expected = sent * config.receivers;
+	// wait for stragglers until all are in or none came for a while
+	auto last_progress = Clock::now();
+	uint64_t seen = received;
+	while (seen < expected && Clock::now() - last_progress < config.drain) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+		if (received != seen) {
+			seen = received;
+			last_progress = Clock::now();
+		}
+	}
+	auto receive_elapsed =
+	    max(last_received_ns.load() -
+	            chrono::duration_cast<chrono::nanoseconds>(
+	                start.time_since_epoch())
+	                .count(),
+	        int64_t(1)) /
+	    1e9;
+
+	printf("%s: %zu messages of %.3f s, %zu skipped, %u loop(s) over %u "
+	       "connection(s) to %u receiver(s), ",
+	       config.path.c_str(), messages, span_ns / 1e9, skipped,
+	       config.loops, config.connections, config.receivers);
+	if (config.speed > 0) {
+		printf("at %gx the recorded pace\n", config.speed);
+	} else {
+		printf("as fast as possible\n");
+	}
+	printf("sent %llu in %.3f s, %.0f msg/s, %.2f MB/s of payload, "
+	       "%llu send(s) failed\n",
+	       (unsigned long long)sent, sent_elapsed, sent / sent_elapsed,
+	       bytes / sent_elapsed / 1e6, (unsigned long long)failed);
+	printf("received %llu of %llu in %.3f s, %.0f msg/s, %.3f%% lost, "
+	       "%llu stray\n",
+	       (unsigned long long)received.load(), (unsigned long long)expected,
+	       receive_elapsed, received / receive_elapsed,
+	       expected ? 100.0 * (expected - min(received.load(), expected)) /
+	                      expected
+	                : 0.0,
+	       (unsigned long long)stray.load());
+	printPercentiles("latency", latency.snapshot());
+	if (config.speed > 0) {
+		printPercentiles("behind schedule", lag.snapshot());
+	}
+	handles.clear();
+	return EXIT_SUCCESS;
+}
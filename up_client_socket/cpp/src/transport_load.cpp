@@ -0,0 +1,429 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// Publish/subscribe load through SocketUTransport and a local dispatcher.
+// Each publisher has a transport of its own and sends at a fixed rate; each
+// subscriber has a transport of its own and listens to every publisher.
+//
+// Sends are scheduled ahead of time, one every 1/rate seconds, and latency
+// is taken from when a message was due rather than when it went out. A
+// publisher held up by a stall then sends its backlog late instead of
+// quietly sending less, and the messages it should have sent during the
+// stall count with the latency they would have seen, which is what a client
+// of the real system would see (the "coordinated omission" of a load
+// generator that waits for the system before sending more). Latency from
+// the actual send is reported alongside for comparison.
+//
+// The fault options degrade the publishers' connections, and short reads
+// the subscribers', through SocketUTransport::Options::fault_injection.
+//
+// Built with allocation accounting (see Allocations.h), --send-allocations
+// holds each send after the warmup to a budget, and the run fails when one
+// goes over it.
+//
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <up-cpp/datamodel/builder/Uuid.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Allocations.h"
+#include "FaultInjection.h"
+#include "Metrics.h"
+#include "SocketUTransport.h"
+
+using namespace std;
+using namespace uprotocol::v1;
+using Clock = chrono::steady_clock;
+
+struct Config {
+	string ip = SocketUTransport::default_dispatcher_ip;
+	int port = SocketUTransport::default_dispatcher_port;
+	unsigned publishers = 4;
+	unsigned subscribers = 4;
+	// per publisher, 0 for as fast as possible
+	double rate = 1000;
+	size_t size = 64;
+	double seconds = 10;
+	double warmup = 1;
+	bool routing_header = false;
+	SocketUTransport::FaultInjection faults;
+	bool inject = false;
+	// heap allocations each send may take
+	uint64_t send_allocations = UINT64_MAX;
+};
+
+// Payloads start with when the message was due and when it was sent, as
+// steady clock ns; the rest is filler up to the payload size.
+struct Stamp {
+	int64_t due_ns;
+	int64_t sent_ns;
+};
+
+static int64_t ns(Clock::time_point t) {
+	return chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch())
+	    .count();
+}
+
+static UUri uri(uint32_t ue_id, uint32_t version, uint32_t resource_id) {
+	UUri ret;
+	ret.set_authority_name("load");
+	ret.set_ue_id(ue_id);
+	ret.set_ue_version_major(version);
+	ret.set_resource_id(resource_id);
+	return ret;
+}
+
+static double cpuSeconds() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	auto seconds = [](const timeval& t) { return t.tv_sec + t.tv_usec / 1e6; };
+	return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+static void printPercentiles(const char* name,
+                             const metrics::HistogramSnapshot& histogram) {
+	printf("latency us %s: p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n", name,
+	       histogram.percentile(0.5) / 1e3, histogram.percentile(0.99) / 1e3,
+	       histogram.percentile(0.999) / 1e3, histogram.max() / 1e3);
+}
+
+// Mean heap allocations and bytes per message over every transport, warmup
+// included.
+static void printAllocations(
+    const char* what, const string& path,
+    const vector<shared_ptr<SocketUTransport>>& transports) {
+	double count = 0, allocations = 0, bytes = 0;
+	for (auto& transport : transports) {
+		auto histograms = transport->metrics().histograms;
+		auto& per_message = histograms[path + "_allocations"];
+		count += per_message.count();
+		allocations += per_message.sum();
+		bytes += histograms[path + "_allocated_bytes"].sum();
+	}
+	printf("heap %.1f allocations of %.0f bytes per %s\n",
+	       count ? allocations / count : 0.0, count ? bytes / count : 0.0,
+	       what);
+}
+
+int main(int argc, char* argv[]) {
+	Config config;
+	static const option long_options[] = {
+	    {"publishers", required_argument, nullptr, 'p'},
+	    {"subscribers", required_argument, nullptr, 's'},
+	    {"rate", required_argument, nullptr, 'r'},
+	    {"size", required_argument, nullptr, 'b'},
+	    {"seconds", required_argument, nullptr, 'd'},
+	    {"warmup", required_argument, nullptr, 'w'},
+	    {"routing-header", no_argument, nullptr, 'H'},
+	    {"delay-us", required_argument, nullptr, 'D'},
+	    {"jitter-us", required_argument, nullptr, 'J'},
+	    {"drop", required_argument, nullptr, 'x'},
+	    {"duplicate", required_argument, nullptr, 'u'},
+	    {"bandwidth", required_argument, nullptr, 'B'},
+	    {"short-io", required_argument, nullptr, 'S'},
+	    {"seed", required_argument, nullptr, 'e'},
+	    {"send-allocations", required_argument, nullptr, 'A'},
+	    {nullptr, 0, nullptr, 0}};
+	auto& faults = config.faults;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "p:s:r:b:d:w:HD:J:x:u:B:S:e:A:",
+	                          long_options, nullptr)) != -1) {
+		config.inject = config.inject || strchr("DJxuBSe", opt) != nullptr;
+		switch (opt) {
+			case 'p':
+				config.publishers = strtoul(optarg, nullptr, 10);
+				break;
+			case 's':
+				config.subscribers = strtoul(optarg, nullptr, 10);
+				break;
+			case 'r':
+				config.rate = strtod(optarg, nullptr);
+				break;
+			case 'b':
+				config.size = strtoull(optarg, nullptr, 10);
+				break;
+			case 'd':
+				config.seconds = strtod(optarg, nullptr);
+				break;
+			case 'w':
+				config.warmup = strtod(optarg, nullptr);
+				break;
+			case 'H':
+				config.routing_header = true;
+				break;
+			case 'D':
+				faults.send.delay = chrono::microseconds(atoll(optarg));
+				break;
+			case 'J':
+				faults.send.jitter = chrono::microseconds(atoll(optarg));
+				break;
+			case 'x':
+				faults.send.drop = strtod(optarg, nullptr);
+				break;
+			case 'u':
+				faults.send.duplicate = strtod(optarg, nullptr);
+				break;
+			case 'B':
+				faults.send.bytes_per_second = strtoull(optarg, nullptr, 10);
+				break;
+			case 'S':
+				faults.short_writes = strtod(optarg, nullptr);
+				faults.short_reads = faults.short_writes;
+				break;
+			case 'e':
+				faults.seed = strtoull(optarg, nullptr, 10);
+				break;
+			case 'A':
+				config.send_allocations = strtoull(optarg, nullptr, 10);
+				break;
+			default:
+				fprintf(stderr,
+				        "usage: %s [--publishers N] [--subscribers N] "
+				        "[--rate MSG_PER_S] [--size BYTES] [--seconds S] "
+				        "[--warmup S] [--routing-header] [--delay-us US] "
+				        "[--jitter-us US] [--drop P] [--duplicate P] "
+				        "[--bandwidth BYTES_PER_S] [--short-io P] [--seed N] "
+				        "[--send-allocations N] [ip [port]]\n",
+				        argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		config.ip = argv[optind++];
+	if (optind < argc)
+		config.port = atoi(argv[optind++]);
+	config.size = max(config.size, sizeof(Stamp));
+
+	SocketUTransport::Options options;
+	options.routing_header = config.routing_header;
+	// Each transport draws its faults from a seed of its own, derived from
+	// --seed and its index, or they would all see the same faults at once.
+	auto optionsFor = [&](unsigned i, bool subscriber) {
+		auto ret = options;
+		if (!config.inject) {
+			return ret;
+		}
+		SocketUTransport::FaultInjection injection;
+		if (subscriber) {
+			// subscribers only get their reads cut short
+			injection.short_reads = faults.short_reads;
+		} else {
+			injection = faults;
+		}
+		injection.seed = fault::seedFor(faults.seed, i, subscriber);
+		ret.fault_injection = injection;
+		return ret;
+	};
+
+	// latency from when each message was due, and from when it was sent
+	metrics::Histogram from_due;
+	metrics::Histogram from_sent;
+	atomic<uint64_t> delivered{0};
+	atomic<uint64_t> measured{0};
+	atomic<int64_t> measure_from_ns{INT64_MAX};
+
+	vector<shared_ptr<SocketUTransport>> subscribers;
+	vector<SocketUTransport::ViewListenerHandle> handles;
+	for (unsigned i = 0; i < config.subscribers; i++) {
+		auto transport = make_shared<SocketUTransport>(
+		    uri(0x2000 + i, 1, 0), optionsFor(i, true), config.ip,
+		    config.port);
+		handles.push_back(transport->registerViewListener(
+		    [&](const SocketUTransport::MessageView& view) {
+			    auto now = ns(Clock::now());
+			    delivered.fetch_add(1, memory_order_relaxed);
+			    Stamp stamp;
+			    if (view.payload().size() < sizeof(stamp))
+				    return;
+			    memcpy(&stamp, view.payload().data(), sizeof(stamp));
+			    if (stamp.due_ns < measure_from_ns.load(memory_order_relaxed))
+				    return;
+			    from_due.record(max<int64_t>(now - stamp.due_ns, 0));
+			    from_sent.record(max<int64_t>(now - stamp.sent_ns, 0));
+			    measured.fetch_add(1, memory_order_relaxed);
+		    },
+		    uri(0xffff, 0xff, 0xffff)));
+		subscribers.push_back(std::move(transport));
+	}
+	vector<shared_ptr<SocketUTransport>> publishers;
+	for (unsigned i = 0; i < config.publishers; i++) {
+		publishers.push_back(make_shared<SocketUTransport>(
+		    uri(0x1000 + i, 1, 0), optionsFor(i, false), config.ip,
+		    config.port));
+	}
+	// give the dispatcher a moment to take in every connection
+	this_thread::sleep_for(chrono::milliseconds(200));
+
+	auto start = Clock::now() + chrono::milliseconds(10);
+	auto seconds = [](double s) {
+		return chrono::duration_cast<Clock::duration>(
+		    chrono::duration<double>(s));
+	};
+	auto measure_from = start + seconds(config.warmup);
+	auto deadline = measure_from + seconds(config.seconds);
+	measure_from_ns = ns(measure_from);
+
+	// sends after the warmup that allocated more than allowed
+	atomic<uint64_t> over_budget{0};
+	if (config.send_allocations != UINT64_MAX) {
+		if (!allocation::installed()) {
+			fprintf(stderr, "--send-allocations needs a build with "
+			                "allocation accounting, not checking\n");
+		}
+		allocation::setBudgetHandler(
+		    [&](const char*, const allocation::Counts&, uint64_t, uint64_t) {
+			    over_budget.fetch_add(1, memory_order_relaxed);
+		    });
+	}
+
+	atomic<uint64_t> sent{0};
+	atomic<uint64_t> sent_measured{0};
+	atomic<uint64_t> failed{0};
+	double cpu_start = 0;
+	atomic<bool> cpu_started{false};
+	vector<thread> threads;
+	for (unsigned i = 0; i < config.publishers; i++) {
+		threads.emplace_back([&, i]() {
+			auto& transport = *publishers[i];
+			UAttributes attributes;
+			attributes.set_type(UMESSAGE_TYPE_PUBLISH);
+			*attributes.mutable_source() = uri(0x1000 + i, 1, 0x8001);
+			attributes.set_payload_format(UPAYLOAD_FORMAT_RAW);
+			auto message_template = transport.makeTemplate(attributes);
+			string payload(config.size, 'x');
+			Clock::duration interval{0};
+			auto due = start;
+			if (config.rate > 0) {
+				interval = seconds(1 / config.rate);
+				// stagger publishers so they don't all send at once
+				due += interval * i / config.publishers;
+			}
+			uint64_t count = 0;
+			uint64_t count_measured = 0;
+			uint64_t failures = 0;
+			while (due < deadline) {
+				if (config.rate > 0) {
+					this_thread::sleep_until(due);
+				} else {
+					due = Clock::now();
+				}
+				if (i == 0 && due >= measure_from && !cpu_started) {
+					cpu_start = cpuSeconds();
+					cpu_started = true;
+				}
+				Stamp stamp{ns(due), ns(Clock::now())};
+				memcpy(payload.data(), &stamp, sizeof(stamp));
+				auto id = uprotocol::datamodel::builder::UuidBuilder::
+				    getBuilder()
+				        .build();
+				UStatus status;
+				{
+					allocation::Budget budget("send",
+					                          due >= measure_from
+					                              ? config.send_allocations
+					                              : UINT64_MAX);
+					status = transport.send(message_template, id, payload);
+				}
+				if (status.code() == UCode::OK) {
+					count++;
+					count_measured += due >= measure_from;
+				} else {
+					failures++;
+				}
+				due += interval;
+			}
+			sent += count;
+			sent_measured += count_measured;
+			failed += failures;
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	// wait for stragglers until all are in or none came for a while
+	uint64_t expected = sent * config.subscribers;
+	auto last_progress = Clock::now();
+	uint64_t seen = delivered;
+	while (seen < expected &&
+	       Clock::now() - last_progress < chrono::seconds(1)) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+		if (delivered != seen) {
+			seen = delivered;
+			last_progress = Clock::now();
+		}
+	}
+	double cpu = cpu_started ? cpuSeconds() - cpu_start : 0;
+	// cpu was counted from the end of the warmup until now
+	double cpu_elapsed =
+	    chrono::duration<double>(Clock::now() - measure_from).count();
+	double elapsed = config.seconds;
+
+	printf("publishers %u subscribers %u size %zu, ", config.publishers,
+	       config.subscribers, config.size);
+	if (config.rate > 0) {
+		printf("%g msg/s per publisher", config.rate);
+	} else {
+		printf("as fast as possible, latency not corrected");
+	}
+	printf(" for %g s after %g s of warmup\n", config.seconds, config.warmup);
+	printf("sent %.0f msg/s, %llu failed; delivered %.0f msg/s, %.3f%% of "
+	       "%llu lost\n",
+	       sent_measured / elapsed, (unsigned long long)failed.load(),
+	       measured / elapsed,
+	       expected ? 100.0 * (expected - min(delivered.load(), expected)) /
+	                      expected
+	                : 0.0,
+	       (unsigned long long)expected);
+	if (config.rate > 0) {
+		printPercentiles("from due", from_due.snapshot());
+	}
+	printPercentiles("from sent", from_sent.snapshot());
+	printf("cpu %.1f%% of a core, %.2f us per message sent, %.2f us per "
+	       "message delivered, transports only, not the dispatcher\n",
+	       100 * cpu / cpu_elapsed,
+	       sent_measured ? 1e6 * cpu / sent_measured : 0.0,
+	       measured ? 1e6 * cpu / measured : 0.0);
+	if (config.inject) {
+		uint64_t drops = 0, duplicates = 0;
+		for (auto& transport : publishers) {
+			auto counters = transport->metrics().counters;
+			drops += counters["injected_drops"];
+			duplicates += counters["injected_duplicates"];
+		}
+		printf("injected %llu drops and %llu duplicates, seed %llu\n",
+		       (unsigned long long)drops, (unsigned long long)duplicates,
+		       (unsigned long long)faults.seed);
+	}
+	if (allocation::installed()) {
+		printAllocations("send", "send", publishers);
+		printAllocations("delivery", "receive", subscribers);
+	}
+	handles.clear();
+	if (over_budget > 0) {
+		printf("%llu sends took more than %llu allocations\n",
+		       (unsigned long long)over_budget.load(),
+		       (unsigned long long)config.send_allocations);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,668 @@
+// SPDX-FileCopyrightText: 2024 Contributors to the Eclipse Foundation
+//
+// See the NOTICE file(s) distributed with this work for additional
+// information regarding copyright ownership.
+//
+// This program and the accompanying materials are made available under the
+// terms of the Apache License Version 2.0 which is available at
+// https://www.apache.org/licenses/LICENSE-2.0
+//
+// SPDX-License-Identifier: Apache-2.0
+
+//
+// Behavior checks for the header-only building blocks, and for streams and
+// echoes through a Dispatcher run in the same process. Needs nothing else
+// running; exits with 0 when every check held.
+//
+//     unitTest [name...]
+//
+// runs only the named tests.
+//
+
+#include <fcntl.h>
+#include <spdlog/spdlog.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <up-cpp/datamodel/builder/Uuid.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Dispatcher.h"
+#include "FlightRecorder.h"
+#include "Frame.h"
+#include "Metrics.h"
+#include "RecentIdSet.h"
+#include "SocketUTransport.h"
+#include "Spool.h"
+#include "Subscription.h"
+#include "TimerWheel.h"
+
+using namespace std;
+using namespace uprotocol::v1;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                   \
+	do {                                                                   \
+		if (!(condition)) {                                                \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+			        #condition);                                           \
+			failures++;                                                    \
+		}                                                                  \
+	} while (0)
+
+static UUri uri(const string& authority, uint32_t ue_id, uint32_t resource_id) {
+	UUri ret;
+	ret.set_authority_name(authority);
+	ret.set_ue_id(ue_id);
+	ret.set_ue_version_major(1);
+	ret.set_resource_id(resource_id);
+	return ret;
+}
+
+static UMessage publish(const UUri& source, const string& payload) {
+	UMessage ret;
+	auto& attributes = *ret.mutable_attributes();
+	attributes.set_type(UMESSAGE_TYPE_PUBLISH);
+	*attributes.mutable_id() =
+	    uprotocol::datamodel::builder::UuidBuilder::getBuilder().build();
+	*attributes.mutable_source() = source;
+	attributes.set_payload_format(UPAYLOAD_FORMAT_RAW);
+	ret.set_payload(payload);
+	return ret;
+}
+
+// Waits up to a few seconds for done() to hold.
+static bool waitFor(const function<bool()>& done) {
+	auto until = chrono::steady_clock::now() + chrono::seconds(5);
+	while (!done()) {
+		if (chrono::steady_clock::now() > until)
+			return false;
+		this_thread::sleep_for(chrono::milliseconds(5));
+	}
+	return true;
+}
+
+// A Dispatcher on a port of its own, relaying until destroyed.
+struct LocalDispatcher {
+	int port;
+	Dispatcher dispatcher;
+	thread runner;
+
+	static Dispatcher::Options options(int port) {
+		Dispatcher::Options ret;
+		ret.port = port;
+		return ret;
+	}
+
+	LocalDispatcher()
+	    : port(20000 + getpid() % 20000),
+	      dispatcher(options(port)),
+	      runner([this]() { dispatcher.run(); }) {}
+
+	~LocalDispatcher() {
+		dispatcher.stop();
+		runner.join();
+	}
+};
+
+static frame::Routing routing(const string& authority) {
+	frame::Routing ret;
+	ret.type = UMESSAGE_TYPE_PUBLISH;
+	ret.priority = UPRIORITY_CS1;
+	ret.source.authority_name = authority;
+	ret.source.ue_id = 0x10001;
+	ret.source.ue_version_major = 1;
+	ret.source.resource_id = 0x8001;
+	return ret;
+}
+
+static void testFrameReader() {
+	// a routed chunk that is also compressed, then a control frame
+	string wire(frame::kHeaderSize, '\0');
+	frame::appendRouting(wire, routing("vehicle"));
+	frame::Chunk chunk{1, 2, 3, frame::kAbort, 1000};
+	frame::appendChunk(wire, chunk);
+	frame::Compressed compressed{2, 0x1234, 500};
+	frame::appendCompressed(wire, compressed);
+	frame::Header header;
+	header.flags = frame::kRouting | frame::kChunk | frame::kCompressed;
+	header.ext_len = wire.size() - frame::kHeaderSize;
+	header.body_len = 5;
+	frame::writeHeader(wire, header);
+	wire += "hello";
+	auto first_size = wire.size();
+	subscription::appendControl(wire, subscription::kSelective);
+
+	// fed a byte at a time, frames only come out once complete
+	frame::Reader reader;
+	vector<string> bodies;
+	vector<uint16_t> flags;
+	frame::Chunk chunk_read;
+	frame::Compressed compressed_read;
+	frame::Routing routing_read;
+	string authority;
+	for (size_t i = 0; i < wire.size(); i++) {
+		auto piece = make_shared<string>(wire.substr(i, 1));
+		CHECK(reader.consume(piece, [&](const frame::Frame& frame) {
+			CHECK(!frame.bare);
+			bodies.emplace_back(frame.body);
+			flags.push_back(frame.flags);
+			if (frame.flags & frame::kChunk) {
+				CHECK(frame.raw.size() == first_size);
+				CHECK(frame::parseRouting(frame.ext, routing_read));
+				authority = string(routing_read.source.authority_name);
+				CHECK(frame::parseCompressed(frame.ext, compressed_read));
+				// the chunk extension comes before the compression one
+				auto ext = frame.ext.substr(
+				    0, frame.ext.size() - frame::kCompressedSize);
+				CHECK(frame::parseChunk(ext, chunk_read));
+			}
+		}));
+		if (i + 1 < first_size)
+			CHECK(bodies.empty());
+	}
+	CHECK(bodies.size() == 2);
+	CHECK(bodies.size() == 2 && bodies[0] == "hello");
+	CHECK(flags.size() == 2 && flags[1] == frame::kControl);
+	CHECK(authority == "vehicle");
+	CHECK(routing_read.source.ue_id == 0x10001);
+	CHECK(routing_read.source.resource_id == 0x8001);
+	CHECK(chunk_read.msb == 1 && chunk_read.lsb == 2 && chunk_read.seq == 3);
+	CHECK(chunk_read.flags == frame::kAbort && chunk_read.total == 1000);
+	CHECK(compressed_read.codec == 2);
+	CHECK(compressed_read.dictionary_id == 0x1234);
+	CHECK(compressed_read.size == 500);
+
+	// extensions too short to hold what is asked for
+	CHECK(!frame::parseChunk(string(frame::kChunkSize - 1, '\0'), chunk_read));
+	CHECK(!frame::parseCompressed(string(frame::kCompressedSize - 1, '\0'),
+	                              compressed_read));
+	string oversize;
+	frame::appendCompressed(oversize,
+	                        frame::Compressed{1, 0, frame::kMaxBodySize + 1});
+	CHECK(!frame::parseCompressed(oversize, compressed_read));
+
+	// a bare message is whatever is left of the read
+	frame::Reader bare_reader;
+	int bare = 0;
+	CHECK(bare_reader.consume(
+	    make_shared<string>("\x0a\x03" "abc"), [&](const frame::Frame& frame) {
+		    bare++;
+		    CHECK(frame.bare);
+		    CHECK(frame.body == "\x0a\x03" "abc");
+	    }));
+	CHECK(bare == 1);
+
+	// a frame header of another version can't be resynchronized
+	string bad;
+	frame::appendHeader(bad, frame::Header{});
+	bad[1] = frame::kVersion + 1;
+	frame::Reader bad_reader;
+	CHECK(!bad_reader.consume(make_shared<string>(bad),
+	                          [&](const frame::Frame&) { CHECK(false); }));
+}
+
+static void testControlRoundTrip() {
+	subscription::Key key;
+	get<0>(key) = "vehicle";
+	get<1>(key) = 0x10001;
+	get<3>(key) = 0x8001;
+	get<6>(key) = 2;
+	for (auto op : {subscription::kSubscribe, subscription::kUnsubscribe}) {
+		string wire;
+		CHECK(subscription::appendControl(wire, op, &key));
+		frame::Header header;
+		CHECK(frame::parseHeader(wire, header));
+		CHECK(header.flags == frame::kControl);
+		CHECK(wire.size() == header.size());
+		subscription::Op op_read;
+		subscription::Key key_read;
+		CHECK(subscription::parseControl(
+		    string_view(wire).substr(frame::kHeaderSize), op_read, key_read));
+		CHECK(op_read == op);
+		CHECK(key_read == key);
+	}
+
+	string wire;
+	CHECK(subscription::appendControl(wire, subscription::kSelective));
+	subscription::Op op_read;
+	subscription::Key key_read;
+	CHECK(subscription::parseControl(
+	    string_view(wire).substr(frame::kHeaderSize), op_read, key_read));
+	CHECK(op_read == subscription::kSelective);
+
+	// wider than a routing header carries, so nothing is written
+	subscription::Key wide;
+	get<3>(wide) = 0x10000;
+	string untouched = "x";
+	CHECK(!subscription::appendControl(untouched, subscription::kSubscribe,
+	                                   &wide));
+	CHECK(untouched == "x");
+
+	// cut short anywhere in the filter
+	string cut;
+	subscription::appendControl(cut, subscription::kSubscribe, &key);
+	auto body = string_view(cut).substr(frame::kHeaderSize);
+	for (size_t size = 1; size < body.size(); size++) {
+		subscription::Key partial;
+		CHECK(!subscription::parseControl(body.substr(0, size), op_read,
+		                                  partial));
+	}
+}
+
+static void testRecentIdSet() {
+	RecentIdSet ids(4);
+	CHECK(!ids.consume(1, 1));
+	ids.insert(1, 1);
+	ids.insert(1, 1);
+	CHECK(ids.consume(1, 1));
+	CHECK(ids.consume(1, 1));
+	CHECK(!ids.consume(1, 1));
+
+	// past capacity the oldest is forgotten
+	for (uint64_t i = 10; i < 15; i++) {
+		ids.insert(i, 0);
+	}
+	CHECK(!ids.consume(10, 0));
+	for (uint64_t i = 11; i < 15; i++) {
+		CHECK(ids.consume(i, 0));
+	}
+
+	// ids that share a probe sequence survive each other's removal
+	RecentIdSet crowded(64);
+	for (uint64_t i = 0; i < 64; i++) {
+		crowded.insert(i, i);
+	}
+	for (uint64_t i = 0; i < 64; i += 2) {
+		CHECK(crowded.consume(i, i));
+	}
+	for (uint64_t i = 1; i < 64; i += 2) {
+		CHECK(crowded.consume(i, i));
+	}
+}
+
+// Everything a Spool sends into one end of a socket pair, read back from
+// the other.
+static string drainAll(Spool& spool, int fds[2], uint64_t now_ms,
+                       uint64_t& expired) {
+	CHECK(spool.drain(fds[0], now_ms, expired));
+	string ret;
+	char buf[4096];
+	ssize_t n;
+	while ((n = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		ret.append(buf, n);
+	}
+	return ret;
+}
+
+static void testSpool() {
+	int fds[2];
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	size_t page = sysconf(_SC_PAGESIZE);
+	Spool spool(page);
+	uint64_t expired = 0;
+
+	// fill it, then go round the ring many times with records of sizes
+	// that don't divide it, so they straddle the end
+	size_t pushed = 0;
+	while (spool.push(string(100, 'a'), 0)) {
+		pushed += 100;
+	}
+	CHECK(pushed > 0 && pushed < page);
+	CHECK(drainAll(spool, fds, 0, expired) == string(pushed, 'a'));
+	CHECK(spool.empty());
+	minstd_rand random(1);
+	for (int round = 0; round < 200; round++) {
+		string sent;
+		for (int i = 0; i < 3; i++) {
+			string record(1 + random() % 700, char('b' + (round + i) % 20));
+			CHECK(spool.push(record, 0));
+			sent += record;
+		}
+		CHECK(drainAll(spool, fds, 0, expired) == sent);
+	}
+	CHECK(spool.empty());
+	CHECK(expired == 0);
+
+	// past their deadline records are dropped, the others go out
+	CHECK(spool.push("late", 5));
+	CHECK(spool.push("on time", 50));
+	CHECK(spool.push("forever", 0));
+	CHECK(drainAll(spool, fds, 10, expired) == "on timeforever");
+	CHECK(expired == 1);
+
+	// a zero capacity spool keeps nothing
+	Spool none(0);
+	CHECK(!none.push("x", 0));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testTimerWheel() {
+	using Clock = TimerWheel<int>::Clock;
+	auto start = Clock::now();
+	auto at = [&](int64_t ms) { return start + chrono::milliseconds(ms); };
+	TimerWheel<int> wheel(chrono::milliseconds(1), start);
+	// one per level, one beyond the 2^24 ticks the wheel covers, and one
+	// already due
+	vector<int64_t> deadlines = {5,          100,      5000,   300000,
+	                             20000000,   -10};
+	for (size_t i = 0; i < deadlines.size(); i++) {
+		wheel.schedule(at(deadlines[i]), int(i));
+	}
+	CHECK(wheel.size() == deadlines.size());
+
+	vector<int> fired;
+	auto collect = [&](int value) { fired.push_back(value); };
+	wheel.advance(at(1), collect);
+	CHECK(fired == vector<int>({5}));
+	// never early, however time is stepped through
+	for (auto step : {4, 99, 4999, 299999, 19999999}) {
+		fired.clear();
+		wheel.advance(at(step), collect);
+		CHECK(fired.empty());
+		auto wakeup = wheel.nextWakeup();
+		CHECK(wakeup && *wakeup > at(step));
+		fired.clear();
+		wheel.advance(at(step + 1), collect);
+		CHECK(fired.size() == 1);
+	}
+	CHECK(wheel.size() == 0);
+	CHECK(!wheel.nextWakeup());
+
+	// many timers cascading through the levels each fire on their tick
+	TimerWheel<int64_t> busy(chrono::milliseconds(1), start);
+	minstd_rand random(2);
+	vector<int64_t> due;
+	for (int i = 0; i < 2000; i++) {
+		due.push_back(1 + random() % 400000);
+		busy.schedule(at(due.back()), due.back());
+	}
+	int64_t now = 0;
+	size_t count = 0;
+	while (busy.size() > 0) {
+		now += 1 + random() % 3000;
+		busy.advance(at(now), [&](int64_t deadline) {
+			count++;
+			CHECK(deadline <= now);
+			CHECK(deadline > now - 3001);
+		});
+	}
+	CHECK(count == due.size());
+}
+
+static void testHistogramBuckets() {
+	using metrics::Histogram;
+	for (size_t bucket = 0; bucket < Histogram::kBuckets; bucket++) {
+		CHECK(Histogram::bucketOf(Histogram::lowest(bucket)) == bucket);
+		CHECK(Histogram::bucketOf(Histogram::highest(bucket)) == bucket);
+		if (bucket + 1 < Histogram::kBuckets) {
+			CHECK(Histogram::highest(bucket) + 1 ==
+			      Histogram::lowest(bucket + 1));
+		}
+	}
+	CHECK(Histogram::lowest(0) == 0);
+	CHECK(Histogram::highest(Histogram::kBuckets - 1) == UINT64_MAX);
+
+	// every value lands in a bucket no wider than 1/16 of it
+	mt19937_64 random(3);
+	for (int i = 0; i < 100000; i++) {
+		uint64_t value = random() >> (random() % 64);
+		auto bucket = Histogram::bucketOf(value);
+		CHECK(bucket < Histogram::kBuckets);
+		CHECK(Histogram::lowest(bucket) <= value);
+		CHECK(value <= Histogram::highest(bucket));
+		auto width = Histogram::highest(bucket) - Histogram::lowest(bucket);
+		CHECK(width <= value / Histogram::kSub);
+	}
+
+	Histogram histogram;
+	for (uint64_t value = 1; value <= 100; value++) {
+		histogram.record(value);
+	}
+	auto snapshot = histogram.snapshot();
+	CHECK(snapshot.count() == 100);
+	CHECK(snapshot.sum() == 5050);
+	CHECK(snapshot.percentile(0.5) >= 50 && snapshot.percentile(0.5) <= 53);
+	CHECK(snapshot.max() >= 100 && snapshot.max() <= 103);
+}
+
+static void testFlightRecorderTornRecords() {
+	char path[] = "/tmp/unitTestFlightXXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	close(fd);
+	{
+		FlightRecorder recorder(path, 64 * 1024);
+		recorder.append(FlightRecorder::kSent, 0, "first");
+		recorder.append(FlightRecorder::kReceived, 1, string(40, 'x'));
+		recorder.append(FlightRecorder::kSent, 2, "third");
+	}
+	// tear the second record the way a writer caught mid-append leaves it
+	size_t page = sysconf(_SC_PAGESIZE);
+	uint64_t torn = UINT64_MAX;
+	fd = open(path, O_RDWR);
+	CHECK(pwrite(fd, &torn, sizeof(torn),
+	             page + FlightRecorder::footprint(5)) == sizeof(torn));
+	close(fd);
+
+	vector<string> frames;
+	vector<uint16_t> links;
+	CHECK(FlightRecorder::load(path, [&](const FlightRecorder::Entry& entry) {
+		frames.emplace_back(entry.frame);
+		links.push_back(entry.link);
+	}));
+	CHECK(frames == vector<string>({"first", "third"}));
+	CHECK(links == vector<uint16_t>({0, 2}));
+
+	// appending again picks up after the torn record
+	{
+		FlightRecorder recorder(path, 64 * 1024);
+		recorder.append(FlightRecorder::kSent, 3, "fourth");
+	}
+	frames.clear();
+	CHECK(FlightRecorder::load(path, [&](const FlightRecorder::Entry& entry) {
+		frames.emplace_back(entry.frame);
+	}));
+	CHECK(frames == vector<string>({"first", "third", "fourth"}));
+	unlink(path);
+}
+
+// A chunked message through a dispatcher, to a listener taking it chunk by
+// chunk and one taking it whole, then one given up on halfway.
+static void testStreamReassembly() {
+	LocalDispatcher local;
+	SocketUTransport::Options options;
+	options.routing_header = true;
+	options.chunk_bytes = 1000;
+	auto receiver = make_shared<SocketUTransport>(
+	    uri("receiver", 0x10002, 0), options, "127.0.0.1", local.port);
+	auto sender = make_shared<SocketUTransport>(
+	    uri("sender", 0x10001, 0), options, "127.0.0.1", local.port);
+	auto source = uri("sender", 0x10001, 0x8001);
+
+	mutex mtx;
+	string streamed;
+	vector<string> whole;
+	size_t chunks = 0;
+	size_t aborted = 0;
+	bool in_order = true;
+	bool completed = false;
+	auto stream_handle = receiver->registerStreamListener(
+	    [&](const SocketUTransport::ChunkView& chunk) {
+		    lock_guard<mutex> lock(mtx);
+		    if (chunk.aborted()) {
+			    aborted++;
+			    return;
+		    }
+		    in_order = in_order && chunk.offset() == streamed.size();
+		    streamed.append(chunk.data());
+		    chunks++;
+		    completed = completed || chunk.last();
+	    },
+	    source);
+	auto view_handle = receiver->registerViewListener(
+	    [&](const SocketUTransport::MessageView& view) {
+		    lock_guard<mutex> lock(mtx);
+		    whole.emplace_back(view.payload());
+	    },
+	    source);
+	// let both connect and advertise their listeners
+	this_thread::sleep_for(chrono::milliseconds(200));
+
+	string payload;
+	for (int i = 0; payload.size() < 10500; i++) {
+		payload += to_string(i) + ",";
+	}
+	auto message = publish(source, "");
+	SocketUTransport::StreamWriter writer;
+	CHECK(sender->openStream(message.attributes(), payload.size(), writer)
+	          .code() == UCode::OK);
+	// written in pieces that don't line up with the chunks
+	for (size_t pos = 0; pos < payload.size(); pos += 3333) {
+		CHECK(writer.write(string_view(payload).substr(pos, 3333)).code() ==
+		      UCode::OK);
+	}
+	CHECK(writer.remaining() == 0);
+	CHECK(waitFor([&]() {
+		lock_guard<mutex> lock(mtx);
+		return completed && whole.size() == 1;
+	}));
+	{
+		lock_guard<mutex> lock(mtx);
+		CHECK(in_order);
+		CHECK(streamed == payload);
+		CHECK(chunks >= payload.size() / options.chunk_bytes);
+		CHECK(whole.size() == 1 && whole[0] == payload);
+		streamed.clear();
+		completed = false;
+	}
+
+	// given up on halfway, stream listeners are told and the whole message
+	// never shows up
+	{
+		auto partial = publish(source, "");
+		SocketUTransport::StreamWriter aborting;
+		CHECK(sender->openStream(partial.attributes(), payload.size(),
+		                         aborting)
+		          .code() == UCode::OK);
+		CHECK(aborting.write(string_view(payload).substr(0, 2500)).code() ==
+		      UCode::OK);
+	}
+	CHECK(waitFor([&]() {
+		lock_guard<mutex> lock(mtx);
+		return aborted == 1;
+	}));
+	this_thread::sleep_for(chrono::milliseconds(100));
+	lock_guard<mutex> lock(mtx);
+	CHECK(streamed == payload.substr(0, 2500));
+	CHECK(!completed);
+	CHECK(whole.size() == 1);
+}
+
+// A stream listener handle moved into an existing one keeps the listener
+// registered, until the handle it was moved to is reset.
+static void testStreamHandleMoveAssign() {
+	LocalDispatcher local;
+	auto transport = make_shared<SocketUTransport>(
+	    uri("local", 0x10001, 0), SocketUTransport::Options(), "127.0.0.1",
+	    local.port);
+	auto source = uri("local", 0x10001, 0x8001);
+	atomic<int> chunks{0};
+	SocketUTransport::ViewListenerHandle handle;
+	CHECK(!handle);
+	handle = transport->registerStreamListener(
+	    [&](const SocketUTransport::ChunkView& chunk) {
+		    chunks += chunk.last();
+	    },
+	    source);
+	CHECK(bool(handle));
+
+	CHECK(transport->send(publish(source, "one")).code() == UCode::OK);
+	CHECK(waitFor([&]() { return chunks == 1; }));
+
+	SocketUTransport::ViewListenerHandle other;
+	other = std::move(handle);
+	CHECK(bool(other));
+	CHECK(transport->send(publish(source, "two")).code() == UCode::OK);
+	CHECK(waitFor([&]() { return chunks == 2; }));
+
+	other.reset();
+	CHECK(!other);
+	// not listened to any more, so not even handed back
+	CHECK(transport->send(publish(source, "three")).code() == UCode::OK);
+	this_thread::sleep_for(chrono::milliseconds(100));
+	CHECK(chunks == 2);
+}
+
+// Own sends reach own listeners once, not again when the dispatcher echoes
+// them back.
+static void testEchoDelivery() {
+	LocalDispatcher local;
+	SocketUTransport::Options options;
+	// framed, so that each echo is counted on its own
+	options.routing_header = true;
+	options.echo_ids = 16;
+	auto transport = make_shared<SocketUTransport>(
+	    uri("self", 0x10001, 0), options, "127.0.0.1", local.port);
+	auto source = uri("self", 0x10001, 0x8001);
+	atomic<int> received{0};
+	auto handle = transport->registerViewListener(
+	    [&](const SocketUTransport::MessageView&) { received++; }, source);
+	this_thread::sleep_for(chrono::milliseconds(200));
+
+	// fewer in flight at once than echo_ids
+	int sent = 0;
+	for (int batch = 0; batch < 10; batch++) {
+		for (int i = 0; i < 8; i++, sent++) {
+			CHECK(transport->send(publish(source, "echo")).code() ==
+			      UCode::OK);
+		}
+		CHECK(waitFor([&]() { return received == sent; }));
+	}
+	// give any echo that got through the time to arrive
+	this_thread::sleep_for(chrono::milliseconds(200));
+	CHECK(received == sent);
+	// the echoes did come back, and were dropped
+	CHECK(transport->metrics().counters["messages_received"] >=
+	      uint64_t(sent));
+}
+
+int main(int argc, char* argv[]) {
+	spdlog::set_level(spdlog::level::warn);
+	const pair<const char*, void (*)()> tests[] = {
+	    {"frame_reader", testFrameReader},
+	    {"control_round_trip", testControlRoundTrip},
+	    {"recent_id_set", testRecentIdSet},
+	    {"spool", testSpool},
+	    {"timer_wheel", testTimerWheel},
+	    {"histogram_buckets", testHistogramBuckets},
+	    {"flight_recorder_torn_records", testFlightRecorderTornRecords},
+	    {"stream_reassembly", testStreamReassembly},
+	    {"stream_handle_move_assign", testStreamHandleMoveAssign},
+	    {"echo_delivery", testEchoDelivery},
+	};
+	for (auto& [name, test] : tests) {
+		bool wanted = argc < 2;
+		for (int i = 1; i < argc; i++) {
+			wanted = wanted || strcmp(argv[i], name) == 0;
+		}
+		if (!wanted)
+			continue;
+		int before = failures;
+		test();
+		printf("%s %s\n", failures == before ? "ok  " : "FAIL", name);
+	}
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}